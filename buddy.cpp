@@ -12,18 +12,137 @@
 #include <infos/kernel/log.h>
 #include <infos/util/math.h>
 #include <infos/util/printf.h>
+#include <infos/util/lock.h>
 
 using namespace infos::kernel;
 using namespace infos::mm;
 using namespace infos::util;
 
 #define MAX_ORDER	16
+// log2 of the size of a page frame, in bytes.
+#define BUDDY_PAGE_SHIFT	12
+// Number of per-CPU order-0 page caches, and the id of the CPU we are running on, which is
+// mapped onto them.  Each cache has its own lock, so any mapping is safe, but CPUs sharing a
+// cache contend on it.  InfOS only brings up the boot processor.
+#ifndef BUDDY_NR_CPUS
+#define BUDDY_NR_CPUS	1
+#endif
+#ifndef BUDDY_CURRENT_CPU
+#define BUDDY_CURRENT_CPU()	0
+#endif
+// Default watermarks for the per-CPU caches: an empty cache is refilled to PCP_LOW pages, and
+// a cache holding more than PCP_HIGH pages is drained back down to PCP_LOW.
+#define PCP_LOW		16
+#define PCP_HIGH	64
+#define NR_MIGRATE_TYPES	3
+// Marks the page descriptor of a page reserved between init and the allocator's first use,
+// before the free lists exist.
+#define BUDDY_EARLY_RESERVED	((PageDescriptor *)1)
+// Define BUDDY_TRACE to count allocator calls, splits and merges, keep cycle-count latency
+// histograms, and record recent events in a per-CPU ring buffer, all reported by dump_state.
+#ifdef BUDDY_TRACE
+// Number of recent events kept in each CPU's ring buffer.  Must be a power of two.
+#define BUDDY_TRACE_RING_SIZE	256
+// Number of latency histogram buckets, one per power of two cycles.
+#define BUDDY_TRACE_BUCKETS	32
+#endif
+
+/**
+* The mobility class of an allocation.  Each pageblock is owned by one class, and free blocks
+* are kept on the free list of their pageblock's class, so that long-lived unmovable
+* allocations are packed together instead of pinning down every high-order block.
+*/
+namespace MigrateType
+{
+	enum MigrateType
+	{
+		UNMOVABLE = 0,
+		RECLAIMABLE = 1,
+		MOVABLE = 2,
+	};
+}
+
+/**
+* The allocator operations that are traced when BUDDY_TRACE is defined.
+*/
+namespace BuddyTraceOp
+{
+	enum BuddyTraceOp
+	{
+		ALLOC = 0,
+		FREE = 1,
+		RESERVE = 2,
+	};
+}
+
+#define NR_BUDDY_TRACE_OPS	3
+
+/**
+* A minimal test-and-set spinlock, guarding the buddy core and each per-CPU cache.  It does not
+* disable interrupts itself; callers must already hold an IRQ lock, so that an interrupt
+* handler on the same CPU can never spin on a lock its own CPU holds.
+*/
+class BuddySpinLock
+{
+public:
+	BuddySpinLock() : _locked(false) { }
+
+	void lock()
+	{
+		while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
+			while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) {
+				__builtin_ia32_pause();
+			}
+		}
+	}
+
+	void unlock()
+	{
+		__atomic_clear(&_locked, __ATOMIC_RELEASE);
+	}
+
+private:
+	bool _locked;
+};
+
+/**
+* Holds a BuddySpinLock for the lifetime of the guard.
+*/
+class BuddyLockGuard
+{
+public:
+	BuddyLockGuard(BuddySpinLock& lock) : _lock(lock) { _lock.lock(); }
+	~BuddyLockGuard() { _lock.unlock(); }
+
+private:
+	BuddySpinLock& _lock;
+};
+
 // I changed the _free_areas array to be of length MAX_ORDER+1, so it contains free lists for orders 0 to 16 inclusive, and thus is of size 17
 /**
 * A buddy page allocation algorithm.
+*
+* Concurrency: there are three levels of protection, always taken in this order.
+*  (1) Interrupts are disabled (UniqueIRQLock) on entry to every public operation, so that an
+*      interrupt handler can never spin on a lock its own CPU holds.
+*  (2) Each per-CPU page cache has its own lock, which also guards the back-links of the pages
+*      in it.  The order-0 alloc/free path takes only the lock of the current CPU's cache, which
+*      other CPUs only take to drain it, so the common case is uncontended.  Operations that
+*      need every cache take all of their locks, in ascending CPU order (see CachesGuard).
+*  (3) _zone_lock protects everything shared between CPUs: the free areas, the per-page free
+*      tags and back-links of pages in the free areas, the pair bitmaps and the non-empty mask.
+*      It is taken once per batch when a per-CPU cache is refilled or drained, and around every
+*      higher-order operation.
+* Nothing is ever acquired while _zone_lock is held, and the private helpers below assume the
+* appropriate locks are already held.
 */
-class BuddyPageAllocator : public PageAllocatorAlgorithm
+template<int MaxOrder, int PageShift>
+class BasicBuddyPageAllocator : public PageAllocatorAlgorithm
 {
+	// The order must fit in the five bits of a free tag, and the non-empty masks are 32 bits wide.
+	static_assert(MaxOrder > 0 && MaxOrder <= 30, "MaxOrder must be between 1 and 30");
+	static_assert(PageShift >= 9 && PageShift < 21, "pages must be at least 512 bytes, and smaller than a pageblock");
+
 private:
 	/**
 	* Returns the number of pages that comprise a 'block', in a given order.
@@ -33,9 +152,54 @@ private:
 	static inline constexpr uint64_t pages_per_block(int order)
 	{
 		/* The number of pages per block in a given order is simply 1, shifted left by the order number.
-		* For example, in order-2, there are (1 << 2) == 4 pages in each block.
+		* For example, in order-2, there are (1 << 2) == 4 pages in each block.  The shift is done in
+		* 64 bits, so it cannot overflow for any order that fits in the free tags.
 		*/
-		return (1 << order);
+		return (1ull << order);
+	}
+
+	/**
+	* Returns the size, in bytes, of a page frame.
+	*/
+	static inline constexpr uint64_t page_size()
+	{
+		return 1ull << PageShift;
+	}
+
+	/**
+	* Returns the order of a pageblock, the unit in which free memory is grouped by mobility.
+	* Pageblocks are 2 MiB, or the largest block if that is smaller.
+	*/
+	static inline constexpr int pageblock_order()
+	{
+		return (21 - PageShift) < MaxOrder ? (21 - PageShift) : MaxOrder;
+	}
+
+	/**
+	* Returns the page-frame-number of the given page descriptor.  This, pgd_of and vpa_of are
+	* the only places the allocator asks the page allocator core about descriptors, so a hosted
+	* build of the algorithm only needs to provide these three conversions.
+	*/
+	static inline uint64_t pfn_of(const PageDescriptor *pgd)
+	{
+		return sys.mm().pgalloc().pgd_to_pfn(pgd);
+	}
+
+	/**
+	* Returns the page descriptor of the given page-frame-number.
+	*/
+	static inline PageDescriptor *pgd_of(uint64_t pfn)
+	{
+		return sys.mm().pgalloc().pfn_to_pgd(pfn);
+	}
+
+	/**
+	* Returns the address that the given page frame is mapped at.  Physical memory is mapped
+	* linearly, so consecutive page frames are mapped at consecutive addresses.
+	*/
+	static inline void *vpa_of(uint64_t pfn)
+	{
+		return (void *)sys.mm().pgalloc().pgd_to_vpa(pgd_of(pfn));
 	}
 
 	/**
@@ -48,7 +212,7 @@ private:
 	{
 		// Calculate the page-frame-number for the page descriptor, and return TRUE if
 		// it divides evenly into the number pages in a block of the given order.
-		return (sys.mm().pgalloc().pgd_to_pfn(pgd) % pages_per_block(order)) == 0;
+		return (pfn_of(pgd) % pages_per_block(order)) == 0;
 	}
 
 	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
@@ -60,7 +224,7 @@ private:
 	PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
 	{
 		// (1) Make sure 'order' is within range
-		if (order >= MAX_ORDER) {
+		if (order >= MaxOrder) {
 			return NULL;
 		}
 
@@ -73,38 +237,142 @@ private:
 		// * If the PFN is aligned to the next order, then the buddy is the next block in THIS order.
 		// * If it's not aligned, then the buddy must be the previous block in THIS order.
 		uint64_t buddy_pfn = is_correct_alignment_for_order(pgd, order + 1) ?
-		sys.mm().pgalloc().pgd_to_pfn(pgd) + pages_per_block(order) :
-		sys.mm().pgalloc().pgd_to_pfn(pgd) - pages_per_block(order);
+		pfn_of(pgd) + pages_per_block(order) :
+		pfn_of(pgd) - pages_per_block(order);
 
 		// (4) Return the page descriptor associated with the buddy page-frame-number.
-		return sys.mm().pgalloc().pfn_to_pgd(buddy_pfn);
+		return pgd_of(buddy_pfn);
+	}
+
+	/**
+	* Returns TRUE if the given page descriptor is the head of a block that is currently
+	* sitting in the free list of the given order.  This is a constant time check, using the
+	* per-page free tag, rather than a walk of the free list.
+	* @param pgd The page descriptor to test.
+	* @param order The order in which the block should be free.
+	*/
+	bool is_free_block(const PageDescriptor *pgd, int order) const
+	{
+		uint64_t pfn = pfn_of(pgd);
+		return pfn < _nr_pages && free_tag_order(_free_tag[pfn]) == order;
+	}
+
+	/**
+	* A free tag holds order+1 in its low five bits and the migrate type of the free list the block
+	* is on in the bits above, with zero meaning "not the head of a free block".
+	*/
+	static inline uint8_t make_free_tag(int order, MigrateType::MigrateType mt)
+	{
+		return (order + 1) | (mt << 5);
+	}
+
+	static inline int free_tag_order(uint8_t tag)
+	{
+		return (tag & 0x1f) - 1;
+	}
+
+	static inline MigrateType::MigrateType free_tag_type(uint8_t tag)
+	{
+		return (MigrateType::MigrateType)(tag >> 5);
+	}
+
+	/**
+	* Returns the migrate type owning the pageblock the given pfn lives in.  The free path reads
+	* this before taking any lock, so the access is atomic; a stale answer only sends the page
+	* down the slower of the two free paths.
+	*/
+	MigrateType::MigrateType pageblock_type(uint64_t pfn) const
+	{
+		return (MigrateType::MigrateType)__atomic_load_n(&_pageblock_type[pfn >> pageblock_order()], __ATOMIC_RELAXED);
+	}
+
+	/**
+	* Hands the pageblock the given pfn lives in to a migrate type.
+	*/
+	void set_pageblock_type(uint64_t pfn, MigrateType::MigrateType mt)
+	{
+		__atomic_store_n(&_pageblock_type[pfn >> pageblock_order()], (uint8_t)mt, __ATOMIC_RELAXED);
+	}
+
+	/**
+	* Returns a mask of the orders that have a free block of any migrate type.
+	*/
+	uint32_t nonempty_orders() const
+	{
+		uint32_t mask = 0;
+		for (int mt = 0; mt < NR_MIGRATE_TYPES; mt++) {
+			mask |= _nonempty_orders[mt];
+		}
+		return mask;
+	}
+
+	/**
+	* Returns the bit index, within the pair bitmaps, of the buddy pair containing the given pfn
+	* in the given order.  The bitmaps for each order are packed back-to-back, with order N
+	* holding one bit for every 2^(N+1) pages of the (power-of-two) pair span.
+	*/
+	uint64_t pair_bit_index(uint64_t pfn, int order) const
+	{
+		return (_pair_span - (_pair_span >> order)) + (pfn >> (order + 1));
+	}
+
+	/**
+	* Flips the pair bit for the buddy pair containing the given pfn.  The bit is the XOR of the
+	* free state of the two buddies, so it must be flipped whenever either of them enters or
+	* leaves the free list.  There are no pairs in MaxOrder, so that order has no bitmap.
+	*/
+	void toggle_pair_bit(uint64_t pfn, int order)
+	{
+		if (order >= MaxOrder) {
+			return;
+		}
+
+		uint64_t bit = pair_bit_index(pfn, order);
+		_pair_bitmap[bit / 64] ^= (1ull << (bit % 64));
+	}
+
+	/**
+	* Returns TRUE if exactly one of the buddy pair containing the given pfn is free in the given
+	* order.  If the block at pfn is known to be free, a clear bit means its buddy is free too.
+	*/
+	bool test_pair_bit(uint64_t pfn, int order) const
+	{
+		uint64_t bit = pair_bit_index(pfn, order);
+		return (_pair_bitmap[bit / 64] >> (bit % 64)) & 1;
 	}
 
 	/**
-	* Inserts a block into the free list of the given order.  The block is inserted in ascending order.
+	* Inserts a block into the free list of the given order and migrate type.  The block is pushed
+	* onto the head of the list, and tagged as free in that order, so insertion is constant time.
 	* @param pgd The page descriptor of the block to insert.
 	* @param order The order in which to insert the block.
+	* @param mt The migrate type of the free list to insert the block into.
 	* @return Returns the slot (i.e. a pointer to the pointer that points to the block) that the block
 	* was inserted into.
 	*/
-	PageDescriptor **insert_block(PageDescriptor *pgd, int order)
+	PageDescriptor **insert_block(PageDescriptor *pgd, int order, MigrateType::MigrateType mt)
 	{
-		// Starting from the _free_areas array, find the slot in which the page descriptor
-		// should be inserted.
-		PageDescriptor **slot = &_free_areas[order];
+		uint64_t pfn = pfn_of(pgd);
+		assert(pfn < _nr_pages && _free_tag[pfn] == 0);
 
-		// Iterate whilst there is a slot, and whilst the page descriptor pointer is numerically
-		// greater than what the slot is pointing to.
-		while (*slot && pgd > *slot) {
-			slot = &(*slot)->next_free;
+		// Link the block in front of the current head of the list.
+		PageDescriptor *head = _free_areas[order][mt];
+		pgd->next_free = head;
+		_prev_free[pfn] = NULL;
+		if (head) {
+			_prev_free[pfn_of(head)] = pgd;
 		}
+		_free_areas[order][mt] = pgd;
 
-		// Insert the page descriptor into the linked list.
-		pgd->next_free = *slot;
-		*slot = pgd;
+		// Tag the block as being free in this order.
+		_free_tag[pfn] = make_free_tag(order, mt);
+		toggle_pair_bit(pfn, order);
+		_nonempty_orders[mt] |= (1u << order);
+		_nr_free[order]++;
+		_nr_free_pages[mt] += pages_per_block(order);
 
 		// Return the insert point (i.e. slot)
-		return slot;
+		return &_free_areas[order][mt];
 	}
 
 	/**
@@ -115,18 +383,43 @@ private:
 	*/
 	void remove_block(PageDescriptor *pgd, int order)
 	{
-		// Starting from the _free_areas array, iterate until the block has been located in the linked-list.
-		PageDescriptor **slot = &_free_areas[order];
-		while (*slot && pgd != *slot) {
-			slot = &(*slot)->next_free;
+		// Make sure the block actually exists.  Panic the system if it does not.
+		assert(is_free_block(pgd, order));
+
+		uint64_t pfn = pfn_of(pgd);
+		MigrateType::MigrateType mt = free_tag_type(_free_tag[pfn]);
+		PageDescriptor *prev = _prev_free[pfn];
+		PageDescriptor *next = pgd->next_free;
+
+		// Unlink the block from its neighbours.
+		if (prev) {
+			prev->next_free = next;
+		} else {
+			_free_areas[order][mt] = next;
+			if (!next) {
+				_nonempty_orders[mt] &= ~(1u << order);
+			}
 		}
 
-		// Make sure the block actually exists.  Panic the system if it does not.
-		assert(*slot == pgd);
+		if (next) {
+			_prev_free[pfn_of(next)] = prev;
+		}
 
-		// Remove the block from the free list.
-		*slot = pgd->next_free;
 		pgd->next_free = NULL;
+		_prev_free[pfn] = NULL;
+		_free_tag[pfn] = 0;
+		toggle_pair_bit(pfn, order);
+		_nr_free[order]--;
+		_nr_free_pages[mt] -= pages_per_block(order);
+	}
+
+	/**
+	* Moves a free block onto the free list of another migrate type.
+	*/
+	void move_block(PageDescriptor *pgd, int order, MigrateType::MigrateType mt)
+	{
+		remove_block(pgd, order);
+		insert_block(pgd, order, mt);
 	}
 
 	/**
@@ -151,11 +444,14 @@ private:
 		int new_order = source_order - 1;
 		PageDescriptor *left = *block_pointer;
 		PageDescriptor *right = buddy_of(left , new_order);
+		// both halves stay on the free list of the same migrate type
+		MigrateType::MigrateType mt = free_tag_type(_free_tag[pfn_of(left)]);
 
 		remove_block(left,source_order);
+		trace_split();
 
-		insert_block(left, new_order);
-		insert_block(right, new_order);
+		insert_block(left, new_order, mt);
+		insert_block(right, new_order, mt);
 
 		return left;
 	}
@@ -166,15 +462,16 @@ private:
 	* source order.  If they aren't this function will panic the system.
 	* @param block_pointer A pointer to a pointer containing a block in the pair to merge.
 	* @param source_order The order in which the pair of blocks live.
+	* @param mt The migrate type of the free list the merged block goes on.
 	* @return Returns the new slot that points to the merged block.
 	*/
-	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order)
+	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order, MigrateType::MigrateType mt)
 	{
 		assert(*block_pointer);
 
 		// Make sure the area_pointer is correctly aligned.
 		assert(is_correct_alignment_for_order(*block_pointer, source_order));
-		assert(source_order<MAX_ORDER);
+		assert(source_order<MaxOrder);
 
 		PageDescriptor *protagonist = *block_pointer;
 		PageDescriptor *buddy = buddy_of(protagonist, source_order);
@@ -192,215 +489,1341 @@ private:
 
 		remove_block(left, source_order);
 		remove_block(right, source_order);
-		return insert_block(left, source_order + 1);
+		trace_merge();
+		return insert_block(left, source_order + 1, mt);
 	}
 
-public:
 	/**
-	* Constructs a new instance of the Buddy Page Allocator.
+	* Claims whole pageblock for the given migrate type, moving every free block in it onto
+	* that type's free lists.  Ownership of the pageblock only changes hands if at least half of
+	* it is free, as otherwise the pages in use would still be of the old type.
+	* @param pfn The first page-frame-number of the pageblock.
+	* @param mt The migrate type claiming the pageblock.
 	*/
-	BuddyPageAllocator() {
-		// Iterate over each free area, and clear it.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			_free_areas[i] = NULL;
+	void steal_pageblock(uint64_t pfn, MigrateType::MigrateType mt)
+	{
+		uint64_t end = pfn + pages_per_block(pageblock_order());
+		if (end > _nr_pages) {
+			end = _nr_pages;
+		}
+
+		uint64_t nr_free = 0;
+		uint64_t start = pfn;
+		while (pfn < end) {
+			uint8_t tag = _free_tag[pfn];
+			if (!tag) {
+				pfn++;
+				continue;
+			}
+
+			int order = free_tag_order(tag);
+			if (free_tag_type(tag) != mt) {
+				move_block(pgd_of(pfn), order, mt);
+			}
+			nr_free += pages_per_block(order);
+			pfn += pages_per_block(order);
+		}
+
+		if (nr_free >= pages_per_block(pageblock_order() - 1)) {
+			set_pageblock_type(start, mt);
 		}
 	}
 
 	/**
-	* Allocates 2^order number of contiguous pages
-	* @param order The power of two, of the number of contiguous pages to allocate.
-	* @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
-	* allocation failed.
+	* Called when the free lists of a migrate type cannot satisfy an allocation: steals a block
+	* from another type, largest first, so that the stolen memory is as contiguous as possible.
+	* No more than one pageblock (or the requested order, if larger) is taken per steal, and
+	* where the steal is large, or is for a non-movable allocation, the surrounding pageblock
+	* is claimed too so that later allocations of this type come from the same place.
+	* @param order The order of the allocation that failed.
+	* @param mt The migrate type of the allocation.
+	* @return Returns TRUE if a block was moved onto the free lists of the given type.
 	*/
-	PageDescriptor *alloc_pages(int order) override
+	bool steal_fallback(int order, MigrateType::MigrateType mt)
 	{
-		//not_implemented();
-		// get pointer to location where enough space is free
-		assert(0 <= order && order <= MAX_ORDER);
-		PageDescriptor *new_block = _free_areas[order];
-		int current_order = order;
-		// if non existent, we must split to create, continue algorithm until current_order once again matches order
-		while(!new_block || current_order > order){
+		static const MigrateType::MigrateType fallbacks[NR_MIGRATE_TYPES][NR_MIGRATE_TYPES - 1] = {
+			{ MigrateType::RECLAIMABLE, MigrateType::MOVABLE },
+			{ MigrateType::UNMOVABLE, MigrateType::MOVABLE },
+			{ MigrateType::RECLAIMABLE, MigrateType::UNMOVABLE },
+		};
 
-			if(current_order > MAX_ORDER){
-				// no blocks to split, no memory free at any level
-				return nullptr;
+		for (int i = 0; i < NR_MIGRATE_TYPES - 1; i++) {
+			MigrateType::MigrateType fallback = fallbacks[mt][i];
+			uint32_t candidates = _nonempty_orders[fallback] & ~((1u << order) - 1);
+			if (!candidates) {
+				continue;
 			}
 
-			if(_free_areas[current_order]){
-				new_block = split_block(&_free_areas[current_order], current_order);
-				// decrement current order
+			int current_order = 31 - __builtin_clz(candidates);
+			PageDescriptor *block = _free_areas[current_order][fallback];
+
+			int target_order = order > pageblock_order() ? order : pageblock_order();
+			while (current_order > target_order) {
+				block = split_block(&block, current_order);
 				--current_order;
 			}
-			// no free blocks in current_order, increase order and intend to split
-			else {
-				++current_order;
+
+			uint64_t pfn = pfn_of(block);
+			if (current_order >= pageblock_order()) {
+				// whole pageblocks change hands
+				for (uint64_t pb = pfn; pb < pfn + pages_per_block(current_order); pb += pages_per_block(pageblock_order())) {
+					set_pageblock_type(pb, mt);
+				}
+				move_block(block, current_order, mt);
+			} else if (current_order >= pageblock_order() / 2 || mt != MigrateType::MOVABLE) {
+				steal_pageblock(pfn & ~(pages_per_block(pageblock_order()) - 1), mt);
+			} else {
+				move_block(block, current_order, mt);
 			}
+
+			return true;
 		}
-		remove_block(new_block,current_order);
-		return new_block;
+
+		return false;
 	}
 
-	// helper function for free_pages
-	// called on a buddy, to ascertain whether it is contained in the free list for said order
-	PageDescriptor** buddy_free(PageDescriptor *pgd, int order){
-		PageDescriptor **slot = &_free_areas[order];
-		while(*slot != nullptr){
-			if(*slot == pgd){return slot;}
-			// otherwise ,check next_free
-			slot = &(*slot) -> next_free;
+	/**
+	* Allocates a block of the given order directly from the free areas, splitting a larger
+	* block if need be.
+	* @param order The order of the block to allocate.
+	* @param mt The migrate type of the allocation.
+	* @return Returns the allocated block, or NULL if no block large enough is free.
+	*/
+	PageDescriptor *alloc_block(int order, MigrateType::MigrateType mt)
+	{
+		// find the lowest non-empty order that can satisfy the request, stealing from another
+		// migrate type if this one has nothing large enough
+		uint32_t candidates = _nonempty_orders[mt] & ~((1u << order) - 1);
+		if(!candidates){
+			if(!steal_fallback(order, mt)){
+				// no blocks to split, no memory free at any level
+				return nullptr;
+			}
+			candidates = _nonempty_orders[mt] & ~((1u << order) - 1);
+			assert(candidates);
+		}
+		int current_order = __builtin_ctz(candidates);
+		PageDescriptor *new_block = _free_areas[current_order][mt];
+		// split down until current_order once again matches order, keeping the left half each time
+		while(current_order > order){
+			new_block = split_block(&new_block, current_order);
+			--current_order;
 		}
-		return nullptr;
+		remove_block(new_block,current_order);
+		return new_block;
 	}
 
 	/**
-	* Frees 2^order contiguous pages.
-	* @param pgd A pointer to an array of page descriptors to be freed.
-	* @param order The power of two number of contiguous pages to free.
+	* Returns a block of the given order to the free areas, merging it with its buddy for as
+	* long as the buddy is also free.  The block goes on the free list of its pageblock's type.
+	* @param pgd The first page descriptor of the block.
+	* @param order The order of the block.
 	*/
-	void free_pages(PageDescriptor *pgd, int order) override
+	void free_block(PageDescriptor *pgd, int order)
 	{
-		// Make sure that the incoming page descriptor is correctly aligned
-		// for the order on which it is being freed, for example, it is
-		// illegal to free page 1 in order-1.
-		assert(is_correct_alignment_for_order(pgd, order));
-		assert(0<=order && order<=MAX_ORDER);
+		MigrateType::MigrateType mt = pageblock_type(pfn_of(pgd));
 
 		// add pointer to free list off the bat
-		insert_block(pgd,order);
-		// no buddy or merging if we are freeing all of the memory
-		if(order==MAX_ORDER){return;}
+		insert_block(pgd,order,mt);
 
-		PageDescriptor *buddy = buddy_of(pgd,order);
-		// no buddy if order is MAX_ORDER
-		while(buddy_free(buddy,order)!=nullptr && order<MAX_ORDER){
-			pgd = *merge_block(&pgd, order);
-			// by merging we increase the order by 1, and find the new buddy given this order increase
-			buddy = buddy_of(pgd,++order);
+		// the block is now free, so a clear pair bit means its buddy is free too
+		while(order<MaxOrder && !test_pair_bit(pfn_of(pgd), order)){
+			pgd = *merge_block(&pgd, order, mt);
+			// by merging we increase the order by 1
+			++order;
 		}
-		return;
 	}
 
-	// helper function, ascertain whether page in a block, used in reserve_block
-	// address  of pgd will be contained within lower and upper bounds of memory addresses in the block IFF it is present in the block
-	bool page_in_block(PageDescriptor *block, PageDescriptor *pgd, int order){
-		int ppb = pages_per_block(order);
-		PageDescriptor *last_page = block + ppb;
-		return (block <= pgd) && (pgd < last_page);
-	}
+	/**
+	* A per-CPU cache of free order-0 pages, sitting in front of the free areas.  Pages are
+	* doubly-linked through next_free and _prev_free, with recently freed (cache-hot) pages at
+	* the head and pages pulled in from the free areas (cold) at the tail.  Pages in a cache
+	* are not tagged as free, so the buddy core treats them as allocated.  The caches only serve
+	* unmovable allocations, which is what the generic alloc_pages interface hands out.
+	*/
+	struct PerCpuPages {
+		PageDescriptor *head;
+		PageDescriptor *tail;
+		unsigned int count;
+		mutable BuddySpinLock lock;
+	};
 
 	/**
-	* Reserves a specific page, so that it cannot be allocated.
-	* @param pgd The page descriptor of the page to reserve.
-	* @return Returns TRUE if the reservation was successful, FALSE otherwise.
+	* Holds the lock of every per-CPU cache, taken in ascending CPU order, for the operations
+	* that drain or inspect all of the caches.
 	*/
-	bool reserve_page(PageDescriptor *pgd)
+	class CachesGuard
 	{
-		//not_implemented();
-		// start from the top and split till we find it
-		int current_order = MAX_ORDER;
-		PageDescriptor *current_block = nullptr;
-
-		while(current_order >= 0){
-			if(current_order==0 && current_block!=nullptr){
-				PageDescriptor **slot = buddy_free(pgd,current_order);
-				if(slot!=nullptr){
-					//Test with and without this assertion
-					//assert(*slot==pgd);
-					remove_block(*slot,current_order);
-					return true;
-				}
-				// found, but it is not free
-				else{return false;}
-			}
-			// block found on prior loop
-			if(current_block!=nullptr){
-				PageDescriptor *left = split_block(&current_block, current_order);
-				// ascertain which half page is in and re-assign current block
-				current_block = (page_in_block(left,pgd, current_order - 1)) ? left : buddy_of(left, current_order - 1);
-				--current_order;
-				continue;
+	public:
+		CachesGuard(const PerCpuPages *pcp) : _pcp(pcp)
+		{
+			for (unsigned int i = 0; i < BUDDY_NR_CPUS; i++) {
+				_pcp[i].lock.lock();
 			}
-			current_block = _free_areas[current_order];
-			// search through the linked-list of blocks for pgd if we have found a free block in the current order
-			while(current_block!=nullptr){
-				if(page_in_block(current_block,pgd,current_order)){break;}
-				// otherwise interrogate next block with same check
-				current_block = current_block->next_free;
+		}
+
+		~CachesGuard()
+		{
+			for (unsigned int i = BUDDY_NR_CPUS; i > 0; i--) {
+				_pcp[i - 1].lock.unlock();
 			}
-			if(current_block==nullptr){--current_order;}
 		}
-		// nothing found
-		return false;
+
+	private:
+		const PerCpuPages *_pcp;
+	};
+
+	/**
+	* Returns the index of the processor we are running on, as mapped onto the per-CPU caches.
+	*/
+	static inline unsigned int current_cpu()
+	{
+		return (unsigned int)(BUDDY_CURRENT_CPU()) % BUDDY_NR_CPUS;
 	}
 
 	/**
-	* Initialises the allocation algorithm.
-	* @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	* Returns the page cache for the processor we are running on.
 	*/
-	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	PerCpuPages& current_pcp()
 	{
-		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator Initialising pd=%p, nr=0x%lx", page_descriptors, nr_page_descriptors);
+		return _pcp[current_cpu()];
+	}
 
-		// TODO: Initialise the free area linked list for the maximum order
-		// to initialise the allocation algorithm.
-		if(nr_page_descriptors==0){return false;}
-		int current_order = MAX_ORDER;
-		do{
-			assert(current_order>0);
-			// reset variables on each loop
-			int current_block_size = pages_per_block(current_order);
-			int nr_blocks = nr_page_descriptors / current_block_size;
-			PageDescriptor *last_block = page_descriptors + (nr_blocks * current_block_size);
-
-			while(page_descriptors < last_block){
-				// build free list for current order
-				insert_block(page_descriptors, current_order);
-				// increment pgd pointer, decrement available pages, as they are added into the free list
-				page_descriptors += current_block_size;
-				nr_page_descriptors -= current_block_size;
+	/**
+	* Pushes a page onto the hot end of a per-CPU cache.
+	*/
+	void pcp_push_hot(PerCpuPages& pcp, PageDescriptor *pgd)
+	{
+		pgd->next_free = pcp.head;
+		_prev_free[pfn_of(pgd)] = nullptr;
+		if (pcp.head) {
+			_prev_free[pfn_of(pcp.head)] = pgd;
+		} else {
+			pcp.tail = pgd;
+		}
+		pcp.head = pgd;
+		pcp.count++;
+	}
+
+	/**
+	* Appends a page to the cold end of a per-CPU cache.
+	*/
+	void pcp_push_cold(PerCpuPages& pcp, PageDescriptor *pgd)
+	{
+		pgd->next_free = nullptr;
+		_prev_free[pfn_of(pgd)] = pcp.tail;
+		if (pcp.tail) {
+			pcp.tail->next_free = pgd;
+		} else {
+			pcp.head = pgd;
+		}
+		pcp.tail = pgd;
+		pcp.count++;
+	}
+
+	/**
+	* Takes the hottest page from a per-CPU cache, which must not be empty.
+	*/
+	PageDescriptor *pcp_pop_hot(PerCpuPages& pcp)
+	{
+		PageDescriptor *pgd = pcp.head;
+		assert(pgd);
+
+		pcp.head = pgd->next_free;
+		if (pcp.head) {
+			_prev_free[pfn_of(pcp.head)] = nullptr;
+		} else {
+			pcp.tail = nullptr;
+		}
+		pgd->next_free = nullptr;
+		pcp.count--;
+		return pgd;
+	}
+
+	/**
+	* Takes the coldest page from a per-CPU cache, which must not be empty.
+	*/
+	PageDescriptor *pcp_pop_cold(PerCpuPages& pcp)
+	{
+		PageDescriptor *pgd = pcp.tail;
+		assert(pgd);
+
+		uint64_t pfn = pfn_of(pgd);
+		pcp.tail = _prev_free[pfn];
+		if (pcp.tail) {
+			pcp.tail->next_free = nullptr;
+		} else {
+			pcp.head = nullptr;
+		}
+		_prev_free[pfn] = nullptr;
+		pcp.count--;
+		return pgd;
+	}
+
+	/**
+	* Tops a per-CPU cache up to the low watermark with pages from the free areas, as one batch.
+	*/
+	void pcp_refill(PerCpuPages& pcp)
+	{
+		while (pcp.count < _pcp_low) {
+			PageDescriptor *pgd = alloc_block(0, MigrateType::UNMOVABLE);
+			if (!pgd) {
+				break;
 			}
-			--current_order;
-		} while(nr_page_descriptors > 0);
+			pcp_push_cold(pcp, pgd);
+		}
+	}
 
-		return true;
+	/**
+	* Returns the coldest pages of a per-CPU cache to the free areas, until it holds no more
+	* than the given number of pages.
+	*/
+	void pcp_drain(PerCpuPages& pcp, unsigned int target)
+	{
+		while (pcp.count > target) {
+			free_block(pcp_pop_cold(pcp), 0);
+		}
 	}
 
 	/**
-	* Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	* Returns every page sitting in the per-CPU caches to the free areas, where they can merge
+	* back into larger blocks.
 	*/
-	const char* name() const override { return "buddy"; }
+	void pcp_drain_all()
+	{
+		CachesGuard caches(_pcp);
+		BuddyLockGuard zone(_zone_lock);
+		for(unsigned int i = 0; i < ARRAY_SIZE(_pcp); ++i){
+			pcp_drain(_pcp[i], 0);
+		}
+	}
 
 	/**
-	* Dumps out the current state of the buddy system
+	* Allocates 2^order pages of the given migrate type.  If memory has run out, the pages held
+	* in the per-CPU caches are given back to the free areas and the allocation is tried once
+	* more, as they may be all that is left, or may complete a block of the wanted order.  The
+	* caller has checked the order.
 	*/
-	void dump_state() const override
+	PageDescriptor *do_alloc_pages(int order, MigrateType::MigrateType mt)
 	{
-		// Print out a header, so we can find the output in the logs.
-		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+		UniqueIRQLock irq;
+		PageDescriptor *pgd = try_alloc_pages(order, mt);
+		if(!pgd){
+			pcp_drain_all();
+			pgd = try_alloc_pages(order, mt);
+		}
+		return pgd;
+	}
 
-		// Iterate over each free area.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			char buffer[256];
-			snprintf(buffer, sizeof(buffer), "[%d] ", i);
+	/**
+	* Makes one attempt at allocating 2^order pages of the given migrate type, taking single
+	* unmovable pages from this CPU's cache.
+	*/
+	PageDescriptor *try_alloc_pages(int order, MigrateType::MigrateType mt)
+	{
+		if(order > 0 || mt != MigrateType::UNMOVABLE){
+			BuddyLockGuard zone(_zone_lock);
+			return alloc_block(order, mt);
+		}
 
-			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
-			while (pg) {
-				// Append the PFN of the free block to the output buffer.
-				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
-				pg = pg->next_free;
+		// single pages come from this CPU's cache, refilling it in one batch when it runs dry
+		PerCpuPages& pcp = current_pcp();
+		BuddyLockGuard cache(pcp.lock);
+		if(pcp.count == 0){
+			BuddyLockGuard zone(_zone_lock);
+			pcp_refill(pcp);
+			if(pcp.count == 0){
+				return nullptr;
 			}
+		}
+		return pcp_pop_hot(pcp);
+	}
 
-			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+	/**
+	* Frees 2^order pages, returning single unmovable pages to this CPU's cache.  The caller has
+	* checked the order and alignment.
+	*/
+	void do_free_pages(PageDescriptor *pgd, int order)
+	{
+		UniqueIRQLock irq;
+		if(order > 0 || pageblock_type(pfn_of(pgd)) != MigrateType::UNMOVABLE){
+			BuddyLockGuard zone(_zone_lock);
+			free_block(pgd, order);
+			return;
+		}
+
+		// single unmovable pages go back onto the hot end of this CPU's cache, which is drained
+		// back into the free areas in one batch once it grows past the high watermark
+		PerCpuPages& pcp = current_pcp();
+		BuddyLockGuard cache(pcp.lock);
+		pcp_push_hot(pcp, pgd);
+		if(pcp.count > _pcp_high){
+			BuddyLockGuard zone(_zone_lock);
+			pcp_drain(pcp, _pcp_low);
 		}
 	}
 
+#ifdef BUDDY_TRACE
+	/**
+	* A traced allocator event, as recorded in the per-CPU ring buffers.
+	*/
+	struct TraceEvent {
+		uint64_t timestamp;
+		uint64_t pfn;
+		uint32_t cycles;
+		uint8_t op;
+		int8_t order;
+	};
+
+	/**
+	* The trace counters, latency histograms and recent events of one CPU.  The split and merge
+	* counts are only written under _zone_lock, and everything else under the lock of the CPU's
+	* page cache, so CPUs that share a slot can't corrupt it; the ring head is published with
+	* release ordering so that dump_state can read the ring from any CPU.
+	*/
+	struct TraceStats {
+		uint64_t calls[NR_BUDDY_TRACE_OPS][MaxOrder+1];
+		uint64_t failures[NR_BUDDY_TRACE_OPS][MaxOrder+1];
+		uint64_t splits;
+		uint64_t merges;
+		uint64_t latency[NR_BUDDY_TRACE_OPS][BUDDY_TRACE_BUCKETS];
+		TraceEvent ring[BUDDY_TRACE_RING_SIZE];
+		uint64_t ring_head;
+	};
+
+	/**
+	* Returns the trace statistics for the processor we are running on.
+	*/
+	TraceStats& current_trace()
+	{
+		return _trace[current_cpu()];
+	}
+#endif
+
+	/**
+	* Returns the cycle count at the start of a traced operation, for passing to trace_event.
+	*/
+	static inline uint64_t trace_start()
+	{
+#ifdef BUDDY_TRACE
+		return __builtin_ia32_rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+	/**
+	* Records the completion of a traced operation: counts the call (and whether it failed),
+	* adds its latency to the histogram, and appends it to this CPU's ring buffer.
+	* @param op The operation that completed.
+	* @param order The order of the operation.
+	* @param pgd The block that was operated on, or NULL if the operation failed.
+	* @param start The cycle count returned by trace_start when the operation began.
+	*/
+	void trace_event(BuddyTraceOp::BuddyTraceOp op, int order, const PageDescriptor *pgd, uint64_t start)
+	{
+#ifdef BUDDY_TRACE
+		uint64_t cycles = __builtin_ia32_rdtsc() - start;
+
+		UniqueIRQLock irq;
+		BuddyLockGuard cache(current_pcp().lock);
+		TraceStats& trace = current_trace();
+
+		trace.calls[op][order]++;
+		if (!pgd) {
+			trace.failures[op][order]++;
+		}
+
+		int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+		if (bucket >= BUDDY_TRACE_BUCKETS) {
+			bucket = BUDDY_TRACE_BUCKETS - 1;
+		}
+		trace.latency[op][bucket]++;
+
+		uint64_t head = trace.ring_head;
+		TraceEvent& event = trace.ring[head & (BUDDY_TRACE_RING_SIZE - 1)];
+		event.timestamp = start;
+		event.pfn = pgd ? pfn_of(pgd) : ~0ull;
+		event.cycles = cycles > 0xffffffffull ? 0xffffffffu : (uint32_t)cycles;
+		event.op = op;
+		event.order = order;
+		__atomic_store_n(&trace.ring_head, head + 1, __ATOMIC_RELEASE);
+#else
+		(void)op;
+		(void)order;
+		(void)pgd;
+		(void)start;
+#endif
+	}
+
+	/**
+	* Counts a block split, when tracing.
+	*/
+	void trace_split()
+	{
+#ifdef BUDDY_TRACE
+		current_trace().splits++;
+#endif
+	}
+
+	/**
+	* Counts a buddy merge, when tracing.
+	*/
+	void trace_merge()
+	{
+#ifdef BUDDY_TRACE
+		current_trace().merges++;
+#endif
+	}
+
+	/**
+	* Returns the pages [pfn, end) to the free areas, as the largest aligned blocks that fit.
+	* Each block is merged with its buddy where possible.
+	*/
+	void free_range(uint64_t pfn, uint64_t end)
+	{
+		while (pfn < end) {
+			int order = pfn ? __builtin_ctzll(pfn) : MaxOrder;
+			if (order > MaxOrder) {
+				order = MaxOrder;
+			}
+			while (pfn + pages_per_block(order) > end) {
+				order--;
+			}
+
+			free_block(pgd_of(pfn), order);
+			pfn += pages_per_block(order);
+		}
+	}
+
+	/**
+	* Finds the free block containing the given page.  In each order, the only candidate is the
+	* block that the pfn rounds down to, so its free tag is checked rather than walking the lists.
+	* @param pfn The page-frame-number of the page to look for.
+	* @param order Set to the order of the block, if one is found.
+	* @return Returns the first page descriptor of the free block, or NULL if the page is not free.
+	*/
+	PageDescriptor *find_free_block(uint64_t pfn, int& order) const
+	{
+		for (order = 0; order <= MaxOrder; order++) {
+			PageDescriptor *candidate = pgd_of(pfn & ~(pages_per_block(order) - 1));
+			if (is_free_block(candidate, order)) {
+				return candidate;
+			}
+		}
+
+		return NULL;
+	}
+
+	/**
+	* Appends a block to the tail of the free list of the given order.  Used while building
+	* the free areas at initialisation time, where the caller tracks the tail of each list.
+	* @param pgd The page descriptor of the block to append.
+	* @param order The order of the block.
+	* @param mt The migrate type of the free list.
+	* @param tail The current tail of the free list, updated to the appended block.
+	*/
+	void append_block(PageDescriptor *pgd, int order, MigrateType::MigrateType mt, PageDescriptor *&tail)
+	{
+		uint64_t pfn = pfn_of(pgd);
+		assert(pfn < _nr_pages && _free_tag[pfn] == 0);
+
+		pgd->next_free = NULL;
+		_prev_free[pfn] = tail;
+		if (tail) {
+			tail->next_free = pgd;
+		} else {
+			_free_areas[order][mt] = pgd;
+		}
+		tail = pgd;
+
+		_free_tag[pfn] = make_free_tag(order, mt);
+		toggle_pair_bit(pfn, order);
+		_nonempty_orders[mt] |= (1u << order);
+		_nr_free[order]++;
+		_nr_free_pages[mt] += pages_per_block(order);
+	}
+
+	/**
+	* Sorts an array of page descriptors into ascending order, in place (heapsort, so that no
+	* memory needs to be allocated).
+	*/
+	static void sort_pages(PageDescriptor **pages, unsigned int nr)
+	{
+		// Sift the element at 'root' down into the heap of the first 'size' elements.
+		auto sift_down = [pages](unsigned int root, unsigned int size) {
+			while (2 * root + 1 < size) {
+				unsigned int child = 2 * root + 1;
+				if (child + 1 < size && pages[child] < pages[child + 1]) {
+					child++;
+				}
+				if (pages[root] >= pages[child]) {
+					return;
+				}
+
+				PageDescriptor *tmp = pages[root];
+				pages[root] = pages[child];
+				pages[child] = tmp;
+				root = child;
+			}
+		};
+
+		for (unsigned int i = nr / 2; i > 0; i--) {
+			sift_down(i - 1, nr);
+		}
+
+		for (unsigned int end = nr; end > 1; end--) {
+			PageDescriptor *tmp = pages[0];
+			pages[0] = pages[end - 1];
+			pages[end - 1] = tmp;
+			sift_down(0, end - 1);
+		}
+	}
+
+	/**
+	* Places the per-page metadata in the highest run of pages that no early reservation
+	* touches, then cuts every other unreserved page into the largest aligned blocks that fit,
+	* appending each block to its free list so the lists come out in ascending order.  The
+	* metadata pages never go on the free lists.  Called once, with every lock held.
+	*/
+	void lay_out()
+	{
+		uint64_t run = 0;
+		for(uint64_t pfn = _nr_pages; pfn-- > _base_pfn;){
+			run = pgd_of(pfn)->next_free == BUDDY_EARLY_RESERVED ? 0 : run + 1;
+			if(run == _meta_pages){
+				_meta_start = pfn;
+				_meta_end = pfn + _meta_pages;
+				break;
+			}
+		}
+
+		if(_meta_end == 0){
+			// nothing can be managed without the metadata, so leave the free lists empty
+			mm_log.messagef(LogLevel::ERROR, "Buddy Allocator has no 0x%lx unreserved pages in a row for its metadata", _meta_pages);
+			for(uint64_t pfn = _base_pfn; pfn < _nr_pages; ++pfn){
+				pgd_of(pfn)->next_free = nullptr;
+			}
+			_nr_pages = 0;
+			return;
+		}
+
+		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator metadata: 0x%lx pages at pfn 0x%lx", _meta_pages, _meta_start);
+
+		uint64_t nr_pageblocks = ((_nr_pages - 1) >> pageblock_order()) + 1;
+		uint8_t *meta = (uint8_t *)vpa_of(_meta_start);
+		_prev_free = (PageDescriptor **)meta;
+		meta += _nr_pages * sizeof(PageDescriptor *);
+		_pair_bitmap = (uint64_t *)meta;
+		meta += (_pair_span / 64) * sizeof(uint64_t);
+		_free_tag = meta;
+		meta += _nr_pages;
+		_pageblock_type = meta;
+
+		// clear the per-page free-list metadata for the pages being managed
+		for(uint64_t i = 0; i < _nr_pages; ++i){
+			_prev_free[i] = nullptr;
+			_free_tag[i] = 0;
+		}
+		for(uint64_t i = 0; i < _pair_span / 64; ++i){
+			_pair_bitmap[i] = 0;
+		}
+
+		// all memory starts out movable, and other types steal from it as they need to
+		for(uint64_t i = 0; i < nr_pageblocks; ++i){
+			_pageblock_type[i] = MigrateType::MOVABLE;
+		}
+
+		PageDescriptor *tails[MaxOrder+1] = {};
+		uint64_t pfn = _base_pfn;
+		while(pfn < _nr_pages){
+			if(pfn == _meta_start){
+				pfn = _meta_end;
+				continue;
+			}
+			if(pgd_of(pfn)->next_free == BUDDY_EARLY_RESERVED){
+				pgd_of(pfn)->next_free = nullptr;
+				++pfn;
+				continue;
+			}
+
+			// the run of free pages starting here ends at the metadata or the next reservation
+			uint64_t end = pfn + 1;
+			while(end < _nr_pages && end != _meta_start && pgd_of(end)->next_free != BUDDY_EARLY_RESERVED){++end;}
+
+			while(pfn < end){
+				int order = pfn ? __builtin_ctzll(pfn) : MaxOrder;
+				if(order > MaxOrder){order = MaxOrder;}
+				while(pfn + pages_per_block(order) > end){--order;}
+
+				append_block(pgd_of(pfn), order, MigrateType::MOVABLE, tails[order]);
+				pfn += pages_per_block(order);
+			}
+		}
+	}
+
+public:
+	/**
+	* Constructs a new instance of the Buddy Page Allocator.
+	*/
+	BasicBuddyPageAllocator() : _pcp_low(PCP_LOW), _pcp_high(PCP_HIGH),
+#ifdef BUDDY_TRACE
+	_trace(),
+#endif
+	_laid_out(false), _base_pfn(0), _nr_pages(0), _pair_span(0), _meta_pages(0), _meta_start(0), _meta_end(0),
+	_prev_free(NULL), _free_tag(NULL), _pageblock_type(NULL), _pair_bitmap(NULL) {
+		// Iterate over each free area, and clear it.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
+			for (int mt = 0; mt < NR_MIGRATE_TYPES; mt++) {
+				_free_areas[i][mt] = NULL;
+			}
+			_nr_free[i] = 0;
+		}
+
+		for (int mt = 0; mt < NR_MIGRATE_TYPES; mt++) {
+			_nonempty_orders[mt] = 0;
+			_nr_free_pages[mt] = 0;
+		}
+
+		// Start with empty per-CPU caches.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_pcp); i++) {
+			_pcp[i].head = NULL;
+			_pcp[i].tail = NULL;
+			_pcp[i].count = 0;
+		}
+	}
+
+	/**
+	* Sets the watermarks of the per-CPU page caches.  Caches holding more than the new high
+	* watermark are drained immediately.
+	* @param low The number of pages an empty cache is refilled to, which must be at least one.
+	* @param high The number of pages above which a cache is drained back to the low watermark.
+	*/
+	void set_pcp_watermarks(unsigned int low, unsigned int high)
+	{
+		// a low watermark of zero would leave every refill empty-handed
+		assert(low >= 1 && low <= high);
+
+		UniqueIRQLock irq;
+		CachesGuard caches(_pcp);
+		BuddyLockGuard zone(_zone_lock);
+		_pcp_low = low;
+		_pcp_high = high;
+
+		for (unsigned int i = 0; i < ARRAY_SIZE(_pcp); i++) {
+			if (_pcp[i].count > _pcp_high) {
+				pcp_drain(_pcp[i], _pcp_low);
+			}
+		}
+	}
+
+	/**
+	* Allocates 2^order number of contiguous pages
+	* @param order The power of two, of the number of contiguous pages to allocate.
+	* @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	* allocation failed.
+	*/
+	PageDescriptor *alloc_pages(int order) override
+	{
+		return alloc_pages(order, MigrateType::UNMOVABLE);
+	}
+
+	/**
+	* Allocates 2^order number of contiguous pages, of the given mobility class.
+	* @param order The power of two, of the number of contiguous pages to allocate.
+	* @param mt The migrate type of the allocation.
+	* @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	* allocation failed.
+	*/
+	PageDescriptor *alloc_pages(int order, MigrateType::MigrateType mt)
+	{
+		assert(0 <= order && order <= MaxOrder);
+		finish_init();
+
+		uint64_t start = trace_start();
+		PageDescriptor *pgd = do_alloc_pages(order, mt);
+		trace_event(BuddyTraceOp::ALLOC, order, pgd, start);
+		return pgd;
+	}
+
+	/**
+	* Frees 2^order contiguous pages.
+	* @param pgd A pointer to an array of page descriptors to be freed.
+	* @param order The power of two number of contiguous pages to free.
+	*/
+	void free_pages(PageDescriptor *pgd, int order) override
+	{
+		// Make sure that the incoming page descriptor is correctly aligned
+		// for the order on which it is being freed, for example, it is
+		// illegal to free page 1 in order-1.
+		assert(is_correct_alignment_for_order(pgd, order));
+		assert(0<=order && order<=MaxOrder);
+		finish_init();
+
+		uint64_t start = trace_start();
+		do_free_pages(pgd, order);
+		trace_event(BuddyTraceOp::FREE, order, pgd, start);
+	}
+
+	/**
+	* Allocates a number of single pages in one pass, filling the given array with their page
+	* descriptors.  Pages are taken from this CPU's cache first, and the remainder are carved as
+	* consecutive pages out of one block split from the free areas, rather than splitting a
+	* fresh block per page.  Allocation stops early if memory runs out.
+	* @param pages The array to fill with page descriptors.
+	* @param nr The number of pages to allocate.
+	* @return Returns the number of pages actually allocated.
+	*/
+	unsigned int alloc_pages_bulk(PageDescriptor **pages, unsigned int nr)
+	{
+		finish_init();
+
+		UniqueIRQLock irq;
+		unsigned int allocated = 0;
+
+		PerCpuPages& pcp = current_pcp();
+		BuddyLockGuard cache(pcp.lock);
+		while (allocated < nr && pcp.count > 0) {
+			pages[allocated++] = pcp_pop_hot(pcp);
+		}
+
+		BuddyLockGuard zone(_zone_lock);
+		while (allocated < nr && nonempty_orders()) {
+			uint64_t remaining = nr - allocated;
+
+			// the smallest order whose blocks cover the remaining pages
+			int order = 0;
+			while (order < MaxOrder && pages_per_block(order) < remaining) {
+				order++;
+			}
+
+			// if no block is that large, consume the largest block there is
+			if (!(nonempty_orders() >> order)) {
+				order = 31 - __builtin_clz(nonempty_orders());
+			}
+
+			PageDescriptor *block = alloc_block(order, MigrateType::UNMOVABLE);
+			assert(block);
+
+			uint64_t pfn = pfn_of(block);
+			uint64_t take = pages_per_block(order) < remaining ? pages_per_block(order) : remaining;
+			for (uint64_t i = 0; i < take; i++) {
+				pages[allocated++] = pgd_of(pfn + i);
+			}
+
+			// give back the unused tail of the block.  None of its pieces can merge, as their
+			// buddies all lie in the part of the block that was handed out.
+			free_range(pfn + take, pfn + pages_per_block(order));
+		}
+
+		return allocated;
+	}
+
+	/**
+	* Frees a number of single pages in one pass.  The pages are sorted, and each run of
+	* consecutive pages is returned to the free areas as the largest aligned blocks that fit, so
+	* that coalescing happens in as few steps as possible.
+	* @param pages The array of page descriptors to free.  The array is sorted in place.
+	* @param nr The number of pages in the array.
+	*/
+	void free_pages_bulk(PageDescriptor **pages, unsigned int nr)
+	{
+		finish_init();
+		sort_pages(pages, nr);
+
+		UniqueIRQLock irq;
+		BuddyLockGuard zone(_zone_lock);
+
+		unsigned int i = 0;
+		while (i < nr) {
+			uint64_t start = pfn_of(pages[i]);
+			uint64_t end = start + 1;
+			i++;
+
+			while (i < nr && pfn_of(pages[i]) == end) {
+				end++;
+				i++;
+			}
+
+			free_range(start, end);
+		}
+	}
+
+	/**
+	* Reserves a specific page, so that it cannot be allocated.
+	* @param pgd The page descriptor of the page to reserve.
+	* @return Returns TRUE if the reservation was successful, FALSE otherwise.
+	*/
+	bool reserve_page(PageDescriptor *pgd)
+	{
+		uint64_t start = trace_start();
+		bool reserved = reserve_range(pfn_of(pgd), 1) == 1;
+		trace_event(BuddyTraceOp::RESERVE, 0, reserved ? pgd : NULL, start);
+		return reserved;
+	}
+
+	/**
+	* Reserves a contiguous range of pages, so that they cannot be allocated.  The range is
+	* carved out in a single pass: each free block overlapping it is removed from the free
+	* areas once, and only the parts of it lying outside the range are given back.
+	* @param pfn_start The page-frame-number of the first page to reserve.
+	* @param count The number of pages to reserve.
+	* @return Returns the number of pages that were reserved.  Pages in the range that were not
+	* free (i.e. allocated, or already reserved) are skipped.
+	*/
+	uint64_t reserve_range(uint64_t pfn_start, uint64_t count)
+	{
+		UniqueIRQLock irq;
+		CachesGuard caches(_pcp);
+		BuddyLockGuard zone(_zone_lock);
+
+		uint64_t end = pfn_start + count;
+		if(end > _nr_pages){end = _nr_pages;}
+
+		// until the free lists are built, a reservation only marks the page's descriptor, and
+		// the metadata is later placed clear of every marked page
+		if(!_laid_out){
+			uint64_t reserved = 0;
+			for(uint64_t pfn = pfn_start < _base_pfn ? _base_pfn : pfn_start; pfn < end; ++pfn){
+				if(pgd_of(pfn)->next_free != BUDDY_EARLY_RESERVED){
+					pgd_of(pfn)->next_free = BUDDY_EARLY_RESERVED;
+					++reserved;
+				}
+			}
+			return reserved;
+		}
+
+		// pages sitting in the per-CPU caches are free too, so return them to the free areas
+		// before looking for the range.  Every cache stays locked until the range has been
+		// carved out, so none of them can pull pages from it in the meantime.
+		for(unsigned int i = 0; i < ARRAY_SIZE(_pcp); ++i){
+			pcp_drain(_pcp[i], 0);
+		}
+
+		uint64_t reserved = 0;
+		uint64_t pfn = pfn_start;
+		while(pfn < end){
+			// the allocator's own metadata can never be handed out, so it is already reserved
+			if(pfn >= _meta_start && pfn < _meta_end){
+				++reserved;
+				++pfn;
+				continue;
+			}
+
+			int order;
+			PageDescriptor *block = find_free_block(pfn, order);
+			// page is not part of any free block, so it is either allocated or already reserved
+			if(block == nullptr){
+				++pfn;
+				continue;
+			}
+
+			// take the whole block out, then give back whatever lies either side of the range
+			uint64_t block_start = pfn_of(block);
+			uint64_t block_end = block_start + pages_per_block(order);
+			remove_block(block, order);
+
+			if(block_start < pfn_start){
+				free_range(block_start, pfn_start);
+			}
+			if(block_end > end){
+				free_range(end, block_end);
+				block_end = end;
+			}
+
+			reserved += block_end - pfn;
+			pfn = block_end;
+		}
+
+		return reserved;
+	}
+
+	/**
+	* Initialises the allocation algorithm.  The per-page metadata, about 9 bytes a page, is
+	* carved out of the managed pages themselves, since the kernel heap doesn't exist yet.  The
+	* page allocator core only reserves firmware, ACPI, MMIO, module and kernel pages after
+	* init returns, so nothing is written to the managed pages here: reservations made before
+	* the allocator is first used are only recorded, and the metadata is then placed in the
+	* highest run of pages that none of them touch (see finish_init).  Pages reserved after the
+	* first allocation can't move the metadata, so the core must make its reservations first.
+	* @param page_descriptors The page descriptor of the first page to manage.
+	* @param nr_page_descriptors The number of pages to manage.
+	* @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	*/
+	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	{
+		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator Initialising pd=%p, nr=0x%lx", page_descriptors, nr_page_descriptors);
+
+		if(nr_page_descriptors==0){return false;}
+
+		uint64_t pfn = pfn_of(page_descriptors);
+		uint64_t end = pfn + nr_page_descriptors;
+
+		// the per-page metadata is sized for the pages actually being managed
+		_base_pfn = pfn;
+		_nr_pages = end;
+		_pair_span = 64;
+		while(_pair_span < _nr_pages){_pair_span <<= 1;}
+
+		uint64_t nr_pageblocks = ((_nr_pages - 1) >> pageblock_order()) + 1;
+		uint64_t meta_bytes = _nr_pages * sizeof(PageDescriptor *) + (_pair_span / 64) * sizeof(uint64_t) + _nr_pages + nr_pageblocks;
+		_meta_pages = (meta_bytes + page_size() - 1) / page_size();
+		if(_meta_pages >= end - pfn){
+			mm_log.messagef(LogLevel::ERROR, "Buddy Allocator needs 0x%lx pages of metadata, but only has 0x%lx pages", _meta_pages, end - pfn);
+			return false;
+		}
+
+		// the descriptors belong to the core, so they are safe to write, and from now on an
+		// early reservation is the only thing their free links can hold
+		for(; pfn < end; ++pfn){
+			pgd_of(pfn)->next_free = nullptr;
+		}
+
+		return true;
+	}
+
+	/**
+	* Places the metadata and builds the free lists, if that hasn't been done yet, once the page
+	* allocator core has made its boot-time reservations.  Every allocation and free calls this
+	* first, so it only needs calling directly to control when the work is done.
+	*/
+	void finish_init()
+	{
+		if(__atomic_load_n(&_laid_out, __ATOMIC_ACQUIRE)){return;}
+
+		UniqueIRQLock irq;
+		CachesGuard caches(_pcp);
+		BuddyLockGuard zone(_zone_lock);
+		if(!_laid_out){
+			lay_out();
+			__atomic_store_n(&_laid_out, true, __ATOMIC_RELEASE);
+		}
+	}
+
+	/**
+	* Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	*/
+	const char* name() const override { return "buddy"; }
+
+	/**
+	* Dumps out the current state of the buddy system
+	*/
+	void dump_state() const override
+	{
+		UniqueIRQLock irq;
+		CachesGuard caches(_pcp);
+		BuddyLockGuard zone(_zone_lock);
+
+		// Print out a header, so we can find the output in the logs.
+		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+		if (!_laid_out) {
+			mm_log.messagef(LogLevel::DEBUG, "not in use yet: no free lists, 0x%lx pages of metadata still to place", _meta_pages);
+			return;
+		}
+
+		// Iterate over each free area.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
+			char buffer[256];
+			int len = snprintf(buffer, sizeof(buffer), "[%d] ", i);
+
+			// Iterate over each block in the free area, across all migrate types.
+			for (int mt = 0; mt < NR_MIGRATE_TYPES; mt++) {
+				PageDescriptor *pg = _free_areas[i][mt];
+				while (pg && len < (int)sizeof(buffer)) {
+					// Append the PFN of the free block to the output buffer.
+					len += snprintf(buffer + len, sizeof(buffer) - len, "%lx ", pfn_of(pg));
+					pg = pg->next_free;
+				}
+			}
+
+			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+		}
+
+		// Report the length of each free list, and the total number of free pages they hold.
+		{
+			char buffer[256];
+			int len = snprintf(buffer, sizeof(buffer), "free blocks:");
+			uint64_t free_pages = 0;
+			for (int i = 0; i <= MaxOrder && len < (int)sizeof(buffer); i++) {
+				free_pages += _nr_free[i] * pages_per_block(i);
+				len += snprintf(buffer + len, sizeof(buffer) - len, " [%d]=%lu", i, _nr_free[i]);
+			}
+			mm_log.messagef(LogLevel::DEBUG, "%s pages=%lu (%lu KiB)", buffer, free_pages, (free_pages * page_size()) >> 10);
+
+			// Report the fragmentation index of each order (in thousandths, as Linux does): -1000
+			// if an allocation of that order would succeed, otherwise tending towards 1000 the more
+			// the failure is down to fragmentation rather than a lack of free memory.
+			uint64_t free_blocks = 0;
+			for (int i = 0; i <= MaxOrder; i++) {
+				free_blocks += _nr_free[i];
+			}
+
+			len = snprintf(buffer, sizeof(buffer), "fragmentation index:");
+			uint32_t nonempty = nonempty_orders();
+			for (int i = 0; i <= MaxOrder && len < (int)sizeof(buffer); i++) {
+				int64_t index;
+				if (nonempty >> i) {
+					index = -1000;
+				} else if (free_blocks == 0) {
+					index = 0;
+				} else {
+					index = 1000 - (int64_t)((1000 + (free_pages * 1000) / pages_per_block(i)) / free_blocks);
+				}
+				len += snprintf(buffer + len, sizeof(buffer) - len, " [%d]=%ld", i, index);
+			}
+			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+		}
+
+		// Report the free pages and pageblocks owned by each migrate type.
+		{
+			static const char *type_names[NR_MIGRATE_TYPES] = { "unmovable", "reclaimable", "movable" };
+			uint64_t nr_pageblocks[NR_MIGRATE_TYPES] = {};
+			for (uint64_t i = 0; _nr_pages && i <= (_nr_pages - 1) >> pageblock_order(); i++) {
+				nr_pageblocks[_pageblock_type[i]]++;
+			}
+
+			for (int mt = 0; mt < NR_MIGRATE_TYPES; mt++) {
+				mm_log.messagef(LogLevel::DEBUG, "%s: free pages=%lu pageblocks=%lu", type_names[mt], _nr_free_pages[mt], nr_pageblocks[mt]);
+			}
+		}
+
+		// Report the memory overhead of the pair bitmaps, for the pages actually being managed.
+		char buffer[256];
+		int len = snprintf(buffer, sizeof(buffer), "bitmap bytes:");
+		uint64_t total = 0;
+		for (int i = 0; i < MaxOrder && len < (int)sizeof(buffer); i++) {
+			uint64_t bytes = ((_nr_pages >> (i + 1)) + 7) / 8;
+			total += bytes;
+			len += snprintf(buffer + len, sizeof(buffer) - len, " [%d]=%lu", i, bytes);
+		}
+		mm_log.messagef(LogLevel::DEBUG, "%s total=%lu", buffer, total);
+		mm_log.messagef(LogLevel::DEBUG, "metadata: %lu pages at pfn %lx", _meta_end - _meta_start, _meta_start);
+
+		// Report the occupancy of the per-CPU page caches.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_pcp); i++) {
+			mm_log.messagef(LogLevel::DEBUG, "pcp[%u]: count=%u low=%u high=%u", i, _pcp[i].count, _pcp_low, _pcp_high);
+		}
+
+#ifdef BUDDY_TRACE
+		dump_trace();
+#endif
+	}
+
+#ifdef BUDDY_TRACE
+	/**
+	* Dumps out the trace counters and latency histograms, summed over all CPUs, followed by the
+	* most recent events recorded by each CPU.
+	*/
+	void dump_trace() const
+	{
+		static const char *op_names[NR_BUDDY_TRACE_OPS] = { "alloc", "free", "reserve" };
+		uint64_t splits = 0, merges = 0;
+		for (unsigned int cpu = 0; cpu < ARRAY_SIZE(_trace); cpu++) {
+			splits += _trace[cpu].splits;
+			merges += _trace[cpu].merges;
+		}
+		mm_log.messagef(LogLevel::DEBUG, "trace: splits=%lu merges=%lu", splits, merges);
+
+		for (int op = 0; op < NR_BUDDY_TRACE_OPS; op++) {
+			char calls[256], failures[256], latency[256];
+			int calls_len = snprintf(calls, sizeof(calls), "%s calls:", op_names[op]);
+			int failures_len = snprintf(failures, sizeof(failures), "%s failures:", op_names[op]);
+			int latency_len = snprintf(latency, sizeof(latency), "%s latency (cycles):", op_names[op]);
+
+			for (int order = 0; order <= MaxOrder; order++) {
+				uint64_t nr_calls = 0, nr_failures = 0;
+				for (unsigned int cpu = 0; cpu < ARRAY_SIZE(_trace); cpu++) {
+					nr_calls += _trace[cpu].calls[op][order];
+					nr_failures += _trace[cpu].failures[op][order];
+				}
+
+				if (nr_calls && calls_len < (int)sizeof(calls)) {
+					calls_len += snprintf(calls + calls_len, sizeof(calls) - calls_len, " [%d]=%lu", order, nr_calls);
+				}
+				if (nr_failures && failures_len < (int)sizeof(failures)) {
+					failures_len += snprintf(failures + failures_len, sizeof(failures) - failures_len, " [%d]=%lu", order, nr_failures);
+				}
+			}
+
+			// Each histogram bucket counts the operations taking [2^N, 2^N+1) cycles.
+			for (int bucket = 0; bucket < BUDDY_TRACE_BUCKETS; bucket++) {
+				uint64_t count = 0;
+				for (unsigned int cpu = 0; cpu < ARRAY_SIZE(_trace); cpu++) {
+					count += _trace[cpu].latency[op][bucket];
+				}
+
+				if (count && latency_len < (int)sizeof(latency)) {
+					latency_len += snprintf(latency + latency_len, sizeof(latency) - latency_len, " [2^%d]=%lu", bucket, count);
+				}
+			}
+
+			mm_log.messagef(LogLevel::DEBUG, "%s", calls);
+			mm_log.messagef(LogLevel::DEBUG, "%s", failures);
+			mm_log.messagef(LogLevel::DEBUG, "%s", latency);
+		}
+
+		// Print the last few events from each CPU's ring, oldest first.
+		for (unsigned int cpu = 0; cpu < ARRAY_SIZE(_trace); cpu++) {
+			uint64_t head = __atomic_load_n(&_trace[cpu].ring_head, __ATOMIC_ACQUIRE);
+			uint64_t first = head > 16 ? head - 16 : 0;
+
+			for (uint64_t i = first; i < head; i++) {
+				const TraceEvent& event = _trace[cpu].ring[i & (BUDDY_TRACE_RING_SIZE - 1)];
+				mm_log.messagef(LogLevel::DEBUG, "event[%u]: tsc=%lu %s order=%d pfn=%lx cycles=%u",
+					cpu, event.timestamp, op_names[event.op], event.order, event.pfn, event.cycles);
+			}
+		}
+	}
+#endif
+
+	/**
+	* Returns the number of free blocks of the given order, across all migrate types.
+	*/
+	uint64_t nr_free_blocks(int order) const
+	{
+		return _nr_free[order];
+	}
+
+	/**
+	* Checks the internal consistency of the free areas and the per-CPU caches: every block on a
+	* free list must be aligned, tagged with its order and correctly back-linked, the pair bitmaps
+	* must agree with the free state of each buddy pair, and the cache counts must match their
+	* lists.  Intended to be run after stress testing the allocator.
+	* @return Returns TRUE if the allocator state is consistent, FALSE otherwise.
+	*/
+	bool verify_free_lists() const
+	{
+		UniqueIRQLock irq;
+		CachesGuard caches(_pcp);
+		BuddyLockGuard zone(_zone_lock);
+		bool ok = true;
+
+		uint64_t nr_free_pages[NR_MIGRATE_TYPES] = {};
+		for (int order = 0; order <= MaxOrder; order++) {
+			uint64_t count = 0;
+			for (int mt = 0; mt < NR_MIGRATE_TYPES; mt++) {
+				const PageDescriptor *prev = NULL;
+				for (const PageDescriptor *pg = _free_areas[order][mt]; pg; prev = pg, pg = pg->next_free, count++) {
+					uint64_t pfn = pfn_of(pg);
+					if (pfn >= _nr_pages || _free_tag[pfn] != make_free_tag(order, (MigrateType::MigrateType)mt) ||
+						_prev_free[pfn] != prev || !is_correct_alignment_for_order(pg, order)) {
+						mm_log.messagef(LogLevel::ERROR, "buddy: bad free block %lx in order %d", pfn, order);
+						ok = false;
+						break;
+					}
+					nr_free_pages[mt] += pages_per_block(order);
+
+					// The pair bit is set iff exactly one of the pair is free, and this one is.
+					if (order < MaxOrder) {
+						uint64_t buddy_pfn = pfn ^ pages_per_block(order);
+						bool buddy_is_free = buddy_pfn < _nr_pages && free_tag_order(_free_tag[buddy_pfn]) == order;
+						if (test_pair_bit(pfn, order) == buddy_is_free) {
+							mm_log.messagef(LogLevel::ERROR, "buddy: bad pair bit for %lx in order %d", pfn, order);
+							ok = false;
+						}
+					}
+				}
+
+				if (((_nonempty_orders[mt] >> order) & 1) != (_free_areas[order][mt] != NULL)) {
+					mm_log.messagef(LogLevel::ERROR, "buddy: bad non-empty bit for order %d", order);
+					ok = false;
+				}
+			}
+
+			if (count != _nr_free[order]) {
+				mm_log.messagef(LogLevel::ERROR, "buddy: free list length mismatch in order %d", order);
+				ok = false;
+			}
+		}
+
+		for (int mt = 0; mt < NR_MIGRATE_TYPES; mt++) {
+			if (nr_free_pages[mt] != _nr_free_pages[mt]) {
+				mm_log.messagef(LogLevel::ERROR, "buddy: free page count mismatch for migrate type %d", mt);
+				ok = false;
+			}
+		}
+
+		for (unsigned int i = 0; i < ARRAY_SIZE(_pcp); i++) {
+			unsigned int count = 0;
+			const PageDescriptor *prev = NULL;
+			for (const PageDescriptor *pg = _pcp[i].head; pg; prev = pg, pg = pg->next_free) {
+				uint64_t pfn = pfn_of(pg);
+				if (pfn >= _nr_pages || _free_tag[pfn] != 0 || _prev_free[pfn] != prev) {
+					mm_log.messagef(LogLevel::ERROR, "buddy: bad cached page %lx on cpu %u", pfn, i);
+					ok = false;
+					break;
+				}
+				count++;
+			}
+
+			if (count != _pcp[i].count || prev != _pcp[i].tail) {
+				mm_log.messagef(LogLevel::ERROR, "buddy: bad page cache on cpu %u", i);
+				ok = false;
+			}
+		}
+
+		return ok;
+	}
+
 // changed to +1 so that if max order is 16, _free_areas has indices 0->16 inclusive
 private:
-	PageDescriptor *_free_areas[MAX_ORDER+1];
+	PageDescriptor *_free_areas[MaxOrder+1][NR_MIGRATE_TYPES];
+	// number of blocks in each order, across all migrate types
+	uint64_t _nr_free[MaxOrder+1];
+	// number of free pages on the free lists of each migrate type
+	uint64_t _nr_free_pages[NR_MIGRATE_TYPES];
+	// bit N set if _free_areas[N][type] is non-empty, for finding the lowest usable order with ctz
+	uint32_t _nonempty_orders[NR_MIGRATE_TYPES];
+
+	// per-CPU order-0 page caches, and their watermarks
+	PerCpuPages _pcp[BUDDY_NR_CPUS];
+	unsigned int _pcp_low, _pcp_high;
+
+	// guards the shared buddy state, see the locking notes at the top of the class
+	mutable BuddySpinLock _zone_lock;
+
+#ifdef BUDDY_TRACE
+	// per-CPU trace statistics
+	TraceStats _trace[BUDDY_NR_CPUS];
+#endif
+
+	// set once the metadata has been placed and the free lists built, by finish_init
+	bool _laid_out;
+	// the first page frame being managed
+	uint64_t _base_pfn;
+	// number of page frames covered by the metadata below, and that number rounded up to a power
+	// of two, which the pair bitmaps are packed for
+	uint64_t _nr_pages;
+	uint64_t _pair_span;
+	// the number of page frames the metadata below takes, and the frames [_meta_start, _meta_end)
+	// it was placed in
+	uint64_t _meta_pages;
+	uint64_t _meta_start, _meta_end;
+	// back-links for the free lists, indexed by pfn, making them doubly-linked
+	PageDescriptor **_prev_free;
+	// free tag of the block headed by this pfn (see make_free_tag), or zero if it does not head a free block
+	uint8_t *_free_tag;
+	// the migrate type owning each pageblock
+	uint8_t *_pageblock_type;
+	// per-order buddy pair bitmaps, one bit per pair set when exactly one of the pair is free
+	uint64_t *_pair_bitmap;
 };
 
+/**
+* The buddy allocator used by the kernel: 4 KiB pages, in blocks of up to 2^MAX_ORDER pages.
+*/
+typedef BasicBuddyPageAllocator<MAX_ORDER, BUDDY_PAGE_SHIFT> BuddyPageAllocator;
+
+/**
+* A variant whose largest blocks are 1 GiB, for backing huge pages.
+*/
+typedef BasicBuddyPageAllocator<18, BUDDY_PAGE_SHIFT> HugePageBuddyPageAllocator;
+
+/**
+* A variant for small machines, whose largest blocks are 4 MiB.
+*/
+typedef BasicBuddyPageAllocator<10, BUDDY_PAGE_SHIFT> SmallBuddyPageAllocator;
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 /*
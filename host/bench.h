@@ -0,0 +1,75 @@
+/*
+ * Latency collection for the host benchmarks.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Collects the latency of every timed call in a benchmark, and reports the mean cost per call
+ * along with the median and 99th percentile latencies.
+ */
+class Latencies
+{
+public:
+	/**
+	 * Times a single call.
+	 */
+	template<typename Op>
+	auto time(Op op) -> decltype(op())
+	{
+		uint64_t start = now_ns();
+		auto result = op();
+		_samples.push_back(now_ns() - start);
+		return result;
+	}
+
+	/**
+	 * Times a single call that returns nothing.
+	 */
+	template<typename Op>
+	void time_void(Op op)
+	{
+		uint64_t start = now_ns();
+		op();
+		_samples.push_back(now_ns() - start);
+	}
+
+	size_t nr_calls() const { return _samples.size(); }
+
+	uint64_t total_ns() const
+	{
+		uint64_t total = 0;
+		for (uint64_t sample : _samples) {
+			total += sample;
+		}
+		return total;
+	}
+
+	void report(const char *name)
+	{
+		if (_samples.empty()) {
+			printf("%-28s %10s\n", name, "no calls");
+			return;
+		}
+
+		uint64_t total = total_ns();
+		std::sort(_samples.begin(), _samples.end());
+		printf("%-28s %10zu %10.1f %8lu %8lu\n", name, _samples.size(), (double)total / _samples.size(),
+			(unsigned long)_samples[_samples.size() / 2], (unsigned long)_samples[_samples.size() * 99 / 100]);
+	}
+
+private:
+	std::vector<uint64_t> _samples;
+};
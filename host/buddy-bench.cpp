@@ -0,0 +1,255 @@
+/*
+ * Host benchmarks for the buddy page allocator.
+ *
+ * Usage: buddy-bench [nr-pages]
+ *
+ * Each benchmark runs against a freshly initialised allocator, times every allocator call,
+ * and reports the mean cost per call along with the median and 99th percentile latencies,
+ * followed by the length of each free list when it finished.  The allocator's free lists
+ * are checked for consistency after every benchmark.
+ */
+#include "../buddy.cpp"
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+// Default amount of memory to manage: 1 GiB of 4 KiB pages.
+#define BENCH_NR_PAGES		(1 << 18)
+// Number of calls made by each of the randomised benchmarks.
+#define BENCH_RANDOM_OPS	2000000
+
+static uint64_t nr_pages;
+static bool failed;
+
+/**
+ * Creates an allocator managing every page, as the kernel would.
+ */
+static BuddyPageAllocator *create_allocator()
+{
+	BuddyPageAllocator *allocator = new BuddyPageAllocator();
+	if (!allocator->init(sys.mm().pgalloc().page_descriptors(), nr_pages)) {
+		fprintf(stderr, "buddy-bench: init failed\n");
+		exit(1);
+	}
+
+	// lay out the free lists now, rather than in the first call timed
+	allocator->finish_init();
+	return allocator;
+}
+
+/**
+ * Prints the free-list lengths, checks the allocator's consistency, and destroys it.
+ */
+static void finish(BuddyPageAllocator *allocator)
+{
+	printf("%28s", "free lists:");
+	for (int order = 0; order <= MAX_ORDER; order++) {
+		printf(" %lu", (unsigned long)allocator->nr_free_blocks(order));
+	}
+	printf("\n");
+
+	if (!allocator->verify_free_lists()) {
+		printf("%28s\n", "FREE LISTS INCONSISTENT");
+		failed = true;
+	}
+
+	delete allocator;
+}
+
+/**
+ * Allocates single pages until a quarter of memory is in use, then frees them, either most
+ * recently allocated first (LIFO) or in the order they were allocated (FIFO).
+ */
+static void bench_order0(bool lifo)
+{
+	BuddyPageAllocator *allocator = create_allocator();
+	Latencies alloc, free;
+
+	std::vector<PageDescriptor *> pages;
+	for (int round = 0; round < 4; round++) {
+		while (pages.size() < nr_pages / 4) {
+			PageDescriptor *pgd = alloc.time([&] { return allocator->alloc_pages(0); });
+			if (!pgd) {
+				break;
+			}
+			pages.push_back(pgd);
+		}
+
+		if (lifo) {
+			std::reverse(pages.begin(), pages.end());
+		}
+
+		for (PageDescriptor *pgd : pages) {
+			free.time_void([&] { allocator->free_pages(pgd, 0); });
+		}
+		pages.clear();
+	}
+
+	alloc.report(lifo ? "order-0 lifo: alloc" : "order-0 fifo: alloc");
+	free.report(lifo ? "order-0 lifo: free" : "order-0 fifo: free");
+	finish(allocator);
+}
+
+/**
+ * Picks an order from a mix skewed towards small blocks, as real workloads are: mostly single
+ * pages, some small blocks, and the occasional large one.
+ */
+static int random_order(unsigned int max_order)
+{
+	unsigned int r = rand() % 100;
+	int order;
+	if (r < 70) {
+		order = 0;
+	} else if (r < 95) {
+		order = 1 + rand() % 3;
+	} else {
+		order = 4 + rand() % 6;
+	}
+
+	return (unsigned int)order > max_order ? max_order : order;
+}
+
+/**
+ * Randomly interleaves allocations of a random mix of orders with frees of random live
+ * blocks, keeping around half of memory in use.
+ */
+static void bench_random_mix()
+{
+	BuddyPageAllocator *allocator = create_allocator();
+	Latencies alloc, free;
+
+	struct Block {
+		PageDescriptor *pgd;
+		int order;
+	};
+
+	std::vector<Block> live;
+	uint64_t live_pages = 0;
+
+	srand(1);
+	for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+		bool do_alloc = live.empty() || (live_pages < nr_pages / 2 && rand() % 2);
+		if (do_alloc) {
+			int order = random_order(MAX_ORDER);
+			PageDescriptor *pgd = alloc.time([&] { return allocator->alloc_pages(order); });
+			if (pgd) {
+				live.push_back({ pgd, order });
+				live_pages += 1ull << order;
+			}
+		} else {
+			size_t idx = rand() % live.size();
+			Block block = live[idx];
+			live[idx] = live.back();
+			live.pop_back();
+
+			free.time_void([&] { allocator->free_pages(block.pgd, block.order); });
+			live_pages -= 1ull << block.order;
+		}
+	}
+
+	alloc.report("random mix: alloc");
+	free.report("random mix: free");
+
+	for (const Block& block : live) {
+		allocator->free_pages(block.pgd, block.order);
+	}
+	finish(allocator);
+}
+
+/**
+ * Fills memory with single pages, frees every other one so that no two free pages are
+ * buddies, then times allocations of each larger order, which all have to fail.  The rest
+ * of the pages are then freed, and the large allocations timed again now that they can
+ * succeed.
+ */
+static void bench_fragmented()
+{
+	BuddyPageAllocator *allocator = create_allocator();
+	Latencies fill, fragmented, recovered;
+
+	std::vector<PageDescriptor *> pages;
+	while (PageDescriptor *pgd = fill.time([&] { return allocator->alloc_pages(0); })) {
+		pages.push_back(pgd);
+	}
+
+	std::sort(pages.begin(), pages.end());
+	for (size_t i = 0; i < pages.size(); i += 2) {
+		allocator->free_pages(pages[i], 0);
+	}
+
+	unsigned int successes = 0;
+	for (int i = 0; i < 1000; i++) {
+		int order = 1 + i % 10;
+		PageDescriptor *pgd = fragmented.time([&] { return allocator->alloc_pages(order); });
+		if (pgd) {
+			successes++;
+			allocator->free_pages(pgd, order);
+		}
+	}
+
+	for (size_t i = 1; i < pages.size(); i += 2) {
+		allocator->free_pages(pages[i], 0);
+	}
+
+	unsigned int recovered_successes = 0;
+	std::vector<std::pair<PageDescriptor *, int>> large;
+	for (int i = 0; i < 1000; i++) {
+		int order = 1 + i % 10;
+		PageDescriptor *pgd = recovered.time([&] { return allocator->alloc_pages(order); });
+		if (pgd) {
+			recovered_successes++;
+			large.push_back({ pgd, order });
+		}
+	}
+
+	fill.report("fragment: fill order-0");
+	fragmented.report("fragment: large alloc");
+	printf("%28s %u of 1000 succeeded\n", "", successes);
+	recovered.report("fragment: after free");
+	printf("%28s %u of 1000 succeeded\n", "", recovered_successes);
+
+	for (auto& block : large) {
+		allocator->free_pages(block.first, block.second);
+	}
+	finish(allocator);
+}
+
+/**
+ * Allocates and frees batches of single pages with the bulk interfaces.
+ */
+static void bench_bulk()
+{
+	BuddyPageAllocator *allocator = create_allocator();
+	Latencies alloc, free;
+
+	PageDescriptor *batch[64];
+	for (int i = 0; i < 20000; i++) {
+		unsigned int nr = alloc.time([&] { return allocator->alloc_pages_bulk(batch, 64); });
+		free.time_void([&] { allocator->free_pages_bulk(batch, nr); });
+	}
+
+	alloc.report("bulk x64: alloc");
+	free.report("bulk x64: free");
+	finish(allocator);
+}
+
+int main(int argc, char **argv)
+{
+	nr_pages = argc > 1 ? strtoull(argv[1], NULL, 0) : BENCH_NR_PAGES;
+	host_memory_init(nr_pages);
+
+	printf("%lu pages\n", (unsigned long)nr_pages);
+	printf("%-28s %10s %10s %8s %8s\n", "benchmark", "calls", "ns/call", "p50 ns", "p99 ns");
+
+	bench_order0(true);
+	bench_order0(false);
+	bench_random_mix();
+	bench_fragmented();
+	bench_bulk();
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * Multi-threaded stress test for the buddy page allocator.
+ *
+ * Usage: buddy-stress [nr-threads [ops-per-thread [nr-pages]]]
+ *
+ * Worker threads stand in for CPUs, two or more to each of the allocator's per-CPU caches,
+ * and hammer the single-page, higher-order, bulk and reserve paths at random, while a
+ * controller thread concurrently changes the cache watermarks, reserves ranges of pages and
+ * checks the free lists.  Every page handed out is claimed in an ownership map, so a page
+ * given to two owners at once is caught as soon as it happens.  Once the workers have freed
+ * everything, the free lists are checked again, every free page must be obtainable as a single
+ * page from one CPU (including those left in the other CPUs' caches), and every page must be
+ * accounted for.
+ *
+ * Before the allocator is first used, the top pages of memory are reserved, as the kernel
+ * reserves firmware regions after initialising the allocator, and must come through untouched.
+ */
+#include <infos/define.h>
+
+// Run the allocator with four per-CPU caches, and let each thread say which one it is on.
+static thread_local unsigned int thread_cpu;
+#define BUDDY_NR_CPUS		4
+#define BUDDY_CURRENT_CPU()	thread_cpu
+
+#include "../buddy.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Defaults: eight threads, each making this many calls, over 256 MiB of 4 KiB pages.
+#define STRESS_NR_THREADS	8
+#define STRESS_OPS		200000
+#define STRESS_NR_PAGES		(1 << 16)
+
+// Owner recorded for a page that has been reserved.
+#define OWNER_RESERVED		0xff
+
+// Number of pages at the top of memory reserved before first use (at most a quarter of
+// memory, so that the metadata below them stays clear of the lower half), and the byte they hold.
+#define STRESS_FIRMWARE_PAGES	64
+#define STRESS_FIRMWARE_BYTE	0xa5
+
+static uint64_t nr_pages;
+static BuddyPageAllocator *allocator;
+
+static std::atomic<uint8_t> *owners;
+static std::atomic<uint64_t> nr_reserved;
+static std::atomic<unsigned int> nr_running;
+static std::atomic<bool> failed;
+
+static void fail(const char *fmt, uint64_t pfn)
+{
+	fprintf(stderr, "buddy-stress: ");
+	fprintf(stderr, fmt, (unsigned long)pfn);
+	fprintf(stderr, "\n");
+	failed = true;
+}
+
+/**
+ * Claims the pages of a block that has just been handed to the given owner.  They must not
+ * belong to anybody else.
+ */
+static void claim(PageDescriptor *pgd, int order, uint8_t owner)
+{
+	uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+	if (pfn & ((1ull << order) - 1)) {
+		fail("block at pfn %lx is misaligned", pfn);
+	}
+
+	for (uint64_t i = pfn; i < pfn + (1ull << order); i++) {
+		uint8_t expected = 0;
+		if (!owners[i].compare_exchange_strong(expected, owner)) {
+			fail("pfn %lx handed out while still owned", i);
+		}
+	}
+}
+
+/**
+ * Gives up the pages of a block.  This must happen before the block is freed, as another
+ * thread may be handed it straight afterwards.
+ */
+static void release(PageDescriptor *pgd, int order, uint8_t owner)
+{
+	uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+	for (uint64_t i = pfn; i < pfn + (1ull << order); i++) {
+		uint8_t expected = owner;
+		if (!owners[i].compare_exchange_strong(expected, 0)) {
+			fail("pfn %lx changed owner while allocated", i);
+		}
+	}
+}
+
+struct Held {
+	PageDescriptor *pgd;
+	int order;
+};
+
+static void worker(unsigned int id, uint64_t nr_ops)
+{
+	thread_cpu = id;
+	uint8_t owner = id + 1;
+	std::mt19937_64 rng(id);
+
+	// keep every thread within its share of memory, so that allocations mostly succeed
+	uint64_t budget = nr_pages / (2 * nr_running);
+	uint64_t held_pages = 0;
+	std::vector<Held> held;
+	PageDescriptor *batch[64];
+
+	for (uint64_t op = 0; op < nr_ops && !failed; op++) {
+		unsigned int r = rng() % 100;
+
+		if (r < 45 && held_pages < budget) {
+			PageDescriptor *pgd = allocator->alloc_pages(0);
+			if (pgd) {
+				claim(pgd, 0, owner);
+				held.push_back({ pgd, 0 });
+				held_pages++;
+			}
+		} else if (r < 55 && held_pages < budget) {
+			int order = 1 + rng() % 5;
+			MigrateType::MigrateType mt = (MigrateType::MigrateType)(rng() % NR_MIGRATE_TYPES);
+			PageDescriptor *pgd = allocator->alloc_pages(order, mt);
+			if (pgd) {
+				claim(pgd, order, owner);
+				held.push_back({ pgd, order });
+				held_pages += 1ull << order;
+			}
+		} else if (r < 60 && held_pages < budget) {
+			unsigned int nr = 1 + rng() % ARRAY_SIZE(batch);
+			unsigned int got = allocator->alloc_pages_bulk(batch, nr);
+			for (unsigned int i = 0; i < got; i++) {
+				claim(batch[i], 0, owner);
+				held.push_back({ batch[i], 0 });
+			}
+			held_pages += got;
+		} else if (r < 64) {
+			// bulk-free a handful of this thread's single pages
+			unsigned int nr = 0;
+			for (size_t i = held.size(); i > 0 && nr < ARRAY_SIZE(batch); i--) {
+				if (held[i - 1].order == 0) {
+					batch[nr++] = held[i - 1].pgd;
+					release(held[i - 1].pgd, 0, owner);
+					held[i - 1] = held.back();
+					held.pop_back();
+				}
+			}
+			allocator->free_pages_bulk(batch, nr);
+			held_pages -= nr;
+		} else if (r < 65) {
+			// reserve a page somewhere in the lower half of memory, away from the metadata
+			PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(rng() % (nr_pages / 2));
+			if (allocator->reserve_page(pgd)) {
+				claim(pgd, 0, OWNER_RESERVED);
+				nr_reserved++;
+			}
+		} else if (!held.empty()) {
+			size_t i = rng() % held.size();
+			Held block = held[i];
+			held[i] = held.back();
+			held.pop_back();
+
+			release(block.pgd, block.order, owner);
+			allocator->free_pages(block.pgd, block.order);
+			held_pages -= 1ull << block.order;
+		}
+	}
+
+	for (const Held& block : held) {
+		release(block.pgd, block.order, owner);
+		allocator->free_pages(block.pgd, block.order);
+	}
+
+	nr_running--;
+}
+
+/**
+ * Runs alongside the workers, on the first cache, exercising the operations that lock every
+ * cache at once.
+ */
+static void controller()
+{
+	thread_cpu = 0;
+	std::mt19937_64 rng(~0ull);
+	uint64_t nr_checks = 0;
+
+	while (nr_running > 0 && !failed) {
+		switch (rng() % 3) {
+		case 0: {
+			unsigned int low = 1 + rng() % 32;
+			allocator->set_pcp_watermarks(low, low + rng() % (4 * low));
+			break;
+		}
+
+		case 1:
+			// which pages were reserved isn't reported, so they only show up in the final count
+			nr_reserved += allocator->reserve_range(rng() % (nr_pages / 2), 1 + rng() % 8);
+			break;
+
+		case 2:
+			if (!allocator->verify_free_lists()) {
+				fail("free lists inconsistent after %lu checks", nr_checks);
+			}
+			nr_checks++;
+			break;
+		}
+
+		std::this_thread::yield();
+	}
+
+	printf("controller: %lu concurrent consistency checks\n", (unsigned long)nr_checks);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_threads = argc > 1 ? strtoul(argv[1], NULL, 0) : STRESS_NR_THREADS;
+	uint64_t nr_ops = argc > 2 ? strtoull(argv[2], NULL, 0) : STRESS_OPS;
+	nr_pages = argc > 3 ? strtoull(argv[3], NULL, 0) : STRESS_NR_PAGES;
+
+	if (nr_threads < 1 || nr_threads >= OWNER_RESERVED) {
+		fprintf(stderr, "buddy-stress: between 1 and %d threads\n", OWNER_RESERVED - 1);
+		return 1;
+	}
+
+	host_memory_init(nr_pages);
+	owners = new std::atomic<uint8_t>[nr_pages]();
+
+	allocator = new BuddyPageAllocator();
+	if (!allocator->init(sys.mm().pgalloc().page_descriptors(), nr_pages)) {
+		fprintf(stderr, "buddy-stress: init failed\n");
+		return 1;
+	}
+
+	// the allocator places its metadata once it is first used, and must keep it clear of pages
+	// reserved before then
+	uint64_t nr_firmware = nr_pages / 4 < STRESS_FIRMWARE_PAGES ? nr_pages / 4 : STRESS_FIRMWARE_PAGES;
+	uint64_t firmware = nr_pages - nr_firmware;
+	uint8_t *firmware_data = (uint8_t *)sys.mm().pgalloc().pgd_to_vpa(sys.mm().pgalloc().pfn_to_pgd(firmware));
+	memset(firmware_data, STRESS_FIRMWARE_BYTE, nr_firmware << 12);
+	nr_reserved += allocator->reserve_range(firmware, nr_firmware);
+	for (uint64_t pfn = firmware; pfn < nr_pages; pfn++) {
+		owners[pfn] = OWNER_RESERVED;
+	}
+
+	allocator->finish_init();
+	for (uint64_t i = 0; i < nr_firmware << 12; i++) {
+		if (firmware_data[i] != STRESS_FIRMWARE_BYTE) {
+			fail("reserved page %lx overwritten by init", firmware + (i >> 12));
+			break;
+		}
+	}
+
+	// nothing is cached yet, so whatever isn't on the free lists or reserved is the allocator's
+	// metadata
+	uint64_t nr_metadata = nr_pages - nr_reserved;
+	for (int order = 0; order <= MAX_ORDER; order++) {
+		nr_metadata -= allocator->nr_free_blocks(order) << order;
+	}
+
+	printf("%u threads on %u caches, %lu calls each, %lu pages\n", nr_threads, BUDDY_NR_CPUS,
+		(unsigned long)nr_ops, (unsigned long)nr_pages);
+
+	nr_running = nr_threads;
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		threads.emplace_back(worker, i, nr_ops);
+	}
+	std::thread checker(controller);
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	checker.join();
+
+	if (!allocator->verify_free_lists()) {
+		fail("free lists inconsistent after %lu threads finished", nr_threads);
+	}
+
+	// exhaust memory from one CPU, which must also get at the pages the others have cached
+	thread_cpu = 1;
+	std::vector<PageDescriptor *> pages;
+	while (PageDescriptor *pgd = allocator->alloc_pages(0)) {
+		pages.push_back(pgd);
+	}
+
+	printf("%lu single pages allocated from one CPU\n", (unsigned long)pages.size());
+	if (pages.size() + nr_metadata + nr_reserved != nr_pages) {
+		fail("%lu free pages could not be allocated", nr_pages - nr_metadata - nr_reserved - pages.size());
+	}
+
+	thread_cpu = 2;
+	for (PageDescriptor *pgd : pages) {
+		allocator->free_pages(pgd, 0);
+	}
+
+	// everything has been freed, so every page that wasn't reserved along the way must now be
+	// free (the allocator's metadata counts as free here, as reserve_range reports it)
+	uint64_t nr_free = allocator->reserve_range(0, nr_pages);
+	printf("%lu pages reserved during the run, %lu free at the end\n",
+		(unsigned long)nr_reserved.load(), (unsigned long)nr_free);
+	if (nr_free + nr_reserved != nr_pages) {
+		fail("%lu pages unaccounted for", nr_pages - nr_free - nr_reserved);
+	}
+
+	if (failed) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("ok\n");
+	return 0;
+}
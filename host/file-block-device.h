@@ -0,0 +1,94 @@
+/*
+ * A block device backed by a file on the host, for mounting file-system images.
+ */
+#pragma once
+
+#include <infos/drivers/block/block-device.h>
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Serves reads from an image file, in blocks of a configurable size.  A trailing partial block
+ * reads as if padded with zeros.  Each device request can be made to take a given time, to
+ * stand in for a slower device, and every request is counted.
+ */
+class FileBlockDevice : public infos::drivers::block::BlockDevice
+{
+public:
+	/**
+	 * Opens an image file.
+	 * @param path The path of the image.
+	 * @param block_size The size of the device's blocks.
+	 * @param latency_ns The time each request takes, on top of reading the file.
+	 */
+	FileBlockDevice(const char *path, size_t block_size, uint64_t latency_ns = 0)
+	: _block_size(block_size), _nr_blocks(0), _latency_ns(latency_ns), _nr_reads(0), _blocks_read(0)
+	{
+		_fd = open(path, O_RDONLY);
+
+		struct stat st;
+		if (_fd < 0 || fstat(_fd, &st) < 0) {
+			perror(path);
+			return;
+		}
+
+		_nr_blocks = (st.st_size + block_size - 1) / block_size;
+	}
+
+	~FileBlockDevice()
+	{
+		if (_fd >= 0) {
+			close(_fd);
+		}
+	}
+
+	bool is_open() const { return _fd >= 0; }
+
+	size_t block_size() const override { return _block_size; }
+	size_t block_count() const override { return _nr_blocks; }
+
+	bool read_blocks(void *buffer, size_t offset, size_t count) override
+	{
+		uint64_t start = now_ns();
+
+		_nr_reads++;
+		_blocks_read += count;
+
+		if (offset > _nr_blocks || count > _nr_blocks - offset) {
+			return false;
+		}
+
+		size_t length = count * _block_size;
+		ssize_t rc = pread(_fd, buffer, length, offset * _block_size);
+		if (rc < 0) {
+			return false;
+		}
+
+		memset((uint8_t *)buffer + rc, 0, length - rc);
+
+		// spin rather than sleep, as sleeps are far coarser than the latencies of interest
+		while (now_ns() - start < _latency_ns);
+
+		return true;
+	}
+
+	bool write_blocks(const void *buffer, size_t offset, size_t count) override
+	{
+		return false;
+	}
+
+	uint64_t nr_reads() const { return _nr_reads; }
+	uint64_t blocks_read() const { return _blocks_read; }
+
+private:
+	int _fd;
+	size_t _block_size, _nr_blocks;
+	uint64_t _latency_ns;
+
+	uint64_t _nr_reads, _blocks_read;
+};
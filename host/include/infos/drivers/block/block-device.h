@@ -0,0 +1,42 @@
+/*
+ * Host stand-in for <infos/drivers/block/block-device.h>.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace drivers
+	{
+		class DeviceClass
+		{
+		public:
+			bool is(const DeviceClass& other) const { return this == &other; }
+		};
+
+		class Device
+		{
+		public:
+			virtual ~Device() { }
+			virtual const DeviceClass& device_class() const = 0;
+		};
+
+		namespace block
+		{
+			class BlockDevice : public Device
+			{
+			public:
+				static const DeviceClass BlockDeviceClass;
+
+				const DeviceClass& device_class() const override { return BlockDeviceClass; }
+
+				virtual size_t block_size() const = 0;
+				virtual size_t block_count() const = 0;
+
+				virtual bool read_blocks(void *buffer, size_t offset, size_t count) = 0;
+				virtual bool write_blocks(const void *buffer, size_t offset, size_t count) = 0;
+			};
+		}
+	}
+}
@@ -0,0 +1,26 @@
+/*
+ * Host stand-in for <infos/fs/directory.h>.
+ */
+#pragma once
+
+#include <infos/util/string.h>
+
+namespace infos
+{
+	namespace fs
+	{
+		struct DirectoryEntry {
+			infos::util::String name;
+			unsigned int size;
+		};
+
+		class Directory
+		{
+		public:
+			virtual ~Directory() { }
+
+			virtual bool read_entry(DirectoryEntry& entry) = 0;
+			virtual void close() = 0;
+		};
+	}
+}
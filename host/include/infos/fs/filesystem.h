@@ -0,0 +1,60 @@
+/*
+ * Host stand-in for <infos/fs/filesystem.h>.
+ */
+#pragma once
+
+#include <infos/fs/file.h>
+#include <infos/fs/directory.h>
+#include <infos/drivers/block/block-device.h>
+#include <infos/util/string.h>
+
+namespace infos
+{
+	namespace fs
+	{
+		class Filesystem;
+		class VirtualFilesystem;
+
+		class PFSNode
+		{
+		public:
+			PFSNode(PFSNode *parent, Filesystem& owner) : _parent(parent), _owner(owner) { }
+			virtual ~PFSNode() { }
+
+			virtual File *open() = 0;
+			virtual Directory *opendir() = 0;
+			virtual PFSNode *get_child(const infos::util::String& name) = 0;
+			virtual PFSNode *mkdir(const infos::util::String& name) = 0;
+
+			PFSNode *parent() const { return _parent; }
+			Filesystem& owner() const { return _owner; }
+
+		private:
+			PFSNode *_parent;
+			Filesystem& _owner;
+		};
+
+		class Filesystem
+		{
+		public:
+			virtual ~Filesystem() { }
+
+			virtual PFSNode *mount() = 0;
+			virtual const char *name() const = 0;
+		};
+
+		class BlockBasedFilesystem : public Filesystem
+		{
+		public:
+			BlockBasedFilesystem(infos::drivers::block::BlockDevice& block_device) : _block_device(block_device) { }
+
+			infos::drivers::block::BlockDevice& block_device() const { return _block_device; }
+
+		private:
+			infos::drivers::block::BlockDevice& _block_device;
+		};
+	}
+}
+
+// File-systems register themselves with the kernel; a host program creates them itself.
+#define RegisterFilesystem(name, create) static infos::fs::Filesystem *(*const registered_filesystem_##name)(infos::fs::VirtualFilesystem&, infos::drivers::Device *) __attribute__((unused)) = create
@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for <infos/kernel/kernel.h>.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <infos/mm/mm.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Kernel
+		{
+		public:
+			infos::mm::MemoryManager& mm() { return _mm; }
+
+		private:
+			infos::mm::MemoryManager _mm;
+		};
+
+		extern Kernel sys;
+	}
+}
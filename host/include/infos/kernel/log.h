@@ -0,0 +1,27 @@
+/*
+ * Host stand-in for <infos/kernel/log.h>.  Messages are printed to stderr when the
+ * INFOS_LOG environment variable is set, and dropped otherwise.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace LogLevel
+		{
+			enum LogLevel { DEBUG, INFO, WARNING, ERROR, FATAL };
+		}
+
+		class ComponentLog
+		{
+		public:
+			void messagef(LogLevel::LogLevel level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+		};
+
+		extern ComponentLog syslog;
+		extern ComponentLog mm_log;
+	}
+}
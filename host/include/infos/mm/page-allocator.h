@@ -0,0 +1,68 @@
+/*
+ * Host stand-in for <infos/mm/page-allocator.h>.  The page allocator core only converts
+ * between page descriptors, page-frame-numbers and addresses, over a descriptor array and a
+ * block of "physical" memory set up by the host program with host_memory_init.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		typedef uint64_t pfn_t;
+		typedef uintptr_t virt_addr_t;
+
+		struct PageDescriptor {
+			PageDescriptor *next_free;
+		};
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *alloc_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual bool reserve_page(PageDescriptor *pgd) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator
+		{
+		public:
+			PageAllocator() : _descriptors(NULL), _memory(NULL), _nr_pages(0) { }
+
+			void setup(PageDescriptor *descriptors, uint8_t *memory, uint64_t nr_pages)
+			{
+				_descriptors = descriptors;
+				_memory = memory;
+				_nr_pages = nr_pages;
+			}
+
+			pfn_t pgd_to_pfn(const PageDescriptor *pgd) const { return pgd - _descriptors; }
+			PageDescriptor *pfn_to_pgd(pfn_t pfn) const { return &_descriptors[pfn]; }
+			virt_addr_t pgd_to_vpa(const PageDescriptor *pgd) const { return (virt_addr_t)&_memory[pgd_to_pfn(pgd) << 12]; }
+
+			PageDescriptor *page_descriptors() const { return _descriptors; }
+			uint64_t nr_pages() const { return _nr_pages; }
+
+		private:
+			PageDescriptor *_descriptors;
+			uint8_t *_memory;
+			uint64_t _nr_pages;
+		};
+	}
+}
+
+// Allocators register themselves with the kernel; a host program instantiates them itself.
+#define RegisterPageAllocator(type) typedef type registered_page_allocator_t
+
+/**
+ * Sets up nr_pages page descriptors, and the 4 KiB pages they describe, for the page allocator
+ * core to hand out.  The memory is only reserved, so untouched pages cost nothing.
+ */
+void host_memory_init(uint64_t nr_pages);
@@ -0,0 +1,41 @@
+/*
+ * Host stand-in for <infos/util/lock.h>.  There are no interrupts to disable on the host, and
+ * a mutex is a host mutex, so that threads can stand in for concurrent callers.
+ */
+#pragma once
+
+#include <mutex>
+
+namespace infos
+{
+	namespace util
+	{
+		class UniqueIRQLock
+		{
+		public:
+			UniqueIRQLock() { }
+			~UniqueIRQLock() { }
+		};
+
+		class Mutex
+		{
+		public:
+			void lock() { _mutex.lock(); }
+			void unlock() { _mutex.unlock(); }
+
+		private:
+			std::mutex _mutex;
+		};
+
+		template<typename T>
+		class UniqueLock
+		{
+		public:
+			UniqueLock(T& lock) : _lock(lock) { _lock.lock(); }
+			~UniqueLock() { _lock.unlock(); }
+
+		private:
+			T& _lock;
+		};
+	}
+}
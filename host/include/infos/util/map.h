@@ -0,0 +1,4 @@
+/*
+ * Host stand-in for <infos/util/map.h>.  Nothing that is built on the host uses Map.
+ */
+#pragma once
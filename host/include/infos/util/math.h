@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for <infos/util/math.h>.
+ */
+#pragma once
+
+#include <infos/define.h>
@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for <infos/util/printf.h>, using the C library's snprintf.
+ */
+#pragma once
+
+#include <stdio.h>
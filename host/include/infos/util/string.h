@@ -0,0 +1,39 @@
+/*
+ * Host stand-in for <infos/util/string.h>, covering the parts of String the drivers use.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <string>
+
+namespace infos
+{
+	namespace util
+	{
+		class String
+		{
+		public:
+			String() { }
+			String(const char *str) : _str(str) { }
+			String(const char *str, size_t len) : _str(str, len) { }
+
+			const char *c_str() const { return _str.c_str(); }
+			size_t length() const { return _str.length(); }
+
+			unsigned int get_hash() const
+			{
+				unsigned int hash = 0;
+				for (char c : _str) {
+					hash = hash * 31 + (unsigned char)c;
+				}
+				return hash;
+			}
+
+			bool operator==(const String& other) const { return _str == other._str; }
+			bool operator!=(const String& other) const { return _str != other._str; }
+
+		private:
+			std::string _str;
+		};
+	}
+}
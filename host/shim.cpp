@@ -0,0 +1,49 @@
+/*
+ * Host stand-ins for the few kernel objects that the drivers and allocators refer to.
+ */
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/drivers/block/block-device.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+
+Kernel infos::kernel::sys;
+ComponentLog infos::kernel::syslog;
+ComponentLog infos::kernel::mm_log;
+
+const infos::drivers::DeviceClass infos::drivers::block::BlockDevice::BlockDeviceClass;
+
+void ComponentLog::messagef(LogLevel::LogLevel level, const char *format, ...)
+{
+	static const bool enabled = getenv("INFOS_LOG") != NULL;
+	if (!enabled && level < LogLevel::ERROR) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+void host_memory_init(uint64_t nr_pages)
+{
+	size_t descriptors_size = nr_pages * sizeof(PageDescriptor);
+	size_t memory_size = nr_pages << 12;
+
+	void *descriptors = mmap(NULL, descriptors_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	void *memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (descriptors == MAP_FAILED || memory == MAP_FAILED) {
+		fprintf(stderr, "host: unable to map %lu pages\n", (unsigned long)nr_pages);
+		exit(1);
+	}
+
+	sys.mm().pgalloc().setup((PageDescriptor *)descriptors, (uint8_t *)memory, nr_pages);
+}
@@ -0,0 +1,252 @@
+/*
+ * Tests for the word-at-a-time TAR header parsers, against straightforward byte-at-a-time
+ * versions of the same thing.
+ *
+ * Usage: tar-header-test
+ */
+#include "../tarfs-header.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <random>
+
+using namespace tarfs;
+
+static unsigned int nr_checks, nr_failures;
+
+#define CHECK(cond, ...) do {							\
+		nr_checks++;							\
+		if (!(cond)) {							\
+			nr_failures++;						\
+			printf("%s:%d: %s: ", __FILE__, __LINE__, #cond);	\
+			printf(__VA_ARGS__);					\
+			printf("\n");						\
+		}								\
+	} while (0)
+
+union Block {
+	uint8_t bytes[TAR_BLOCK_SIZE];
+	uint64_t words[TAR_BLOCK_SIZE / 8];
+	struct posix_header header;
+};
+
+/**
+ * Sums a header block a byte at a time, with the checksum field counted as spaces.
+ */
+static int64_t reference_checksum(const Block& block, bool is_signed)
+{
+	int64_t sum = 0;
+	for (unsigned int i = 0; i < TAR_BLOCK_SIZE; i++) {
+		bool in_chksum = i >= offsetof(posix_header, chksum) && i < offsetof(posix_header, chksum) + 8;
+		uint8_t c = in_chksum ? ' ' : block.bytes[i];
+		sum += is_signed ? (int64_t)(int8_t) c : (int64_t) c;
+	}
+
+	return sum;
+}
+
+/**
+ * Stores a checksum in the way GNU tar does: six octal digits, a NUL and a space.
+ */
+static void store_checksum(Block& block, int64_t sum)
+{
+	char field[24];
+	snprintf(field, sizeof(field), "%06llo", (unsigned long long) sum);
+	memcpy(block.header.chksum, field, 6);
+	block.header.chksum[6] = 0;
+	block.header.chksum[7] = ' ';
+}
+
+/**
+ * Checks that a block carrying each of its two sums verifies, and that near misses don't.
+ */
+static void check_checksums(Block& block, const char *what)
+{
+	int64_t sum = reference_checksum(block, false);
+	int64_t signed_sum = reference_checksum(block, true);
+
+	store_checksum(block, sum);
+	CHECK(tar_verify_checksum(block.bytes), "%s: unsigned sum %lld rejected", what, (long long) sum);
+
+	store_checksum(block, sum + 1);
+	CHECK(!tar_verify_checksum(block.bytes) || sum + 1 == signed_sum, "%s: sum %lld accepted for %lld", what, (long long) sum + 1, (long long) sum);
+
+	if (sum >= 256) {
+		store_checksum(block, sum - 256);
+		CHECK(!tar_verify_checksum(block.bytes) || sum - 256 == signed_sum, "%s: sum %lld accepted for %lld", what, (long long) sum - 256, (long long) sum);
+	}
+
+	if (signed_sum >= 0) {
+		store_checksum(block, signed_sum);
+		CHECK(tar_verify_checksum(block.bytes), "%s: signed sum %lld rejected", what, (long long) signed_sum);
+	}
+}
+
+static void test_checksum()
+{
+	Block block;
+
+	// a typical header: a short name, mostly zeros
+	memset(&block, 0, sizeof(block));
+	strcpy(block.header.name, "hello.txt");
+	memcpy(block.header.mode, "0000644", 8);
+	memcpy(block.header.magic, "ustar", 6);
+	memcpy(block.header.version, "00", 2);
+	check_checksums(block, "short header");
+
+	// a header whose sum only just fits in sixteen bits, and one whose sum doesn't
+	memset(&block, 0x7f, sizeof(block));
+	check_checksums(block, "all 0x7f");
+	CHECK(reference_checksum(block, false) < 65536, "all 0x7f sums to %lld", (long long) reference_checksum(block, false));
+
+	memset(&block, 0x82, sizeof(block));
+	check_checksums(block, "all 0x82");
+	CHECK(reference_checksum(block, false) > 65535, "all 0x82 sums to %lld", (long long) reference_checksum(block, false));
+
+	// every byte at its largest: the biggest sum there is, and 504 bytes with their top bit set
+	memset(&block, 0xff, sizeof(block));
+	check_checksums(block, "all 0xff");
+
+	// long UTF-8 names (every byte of "é" has its top bit set) filling the name and prefix
+	memset(&block, 0, sizeof(block));
+	for (unsigned int i = 0; i + 2 <= sizeof(block.header.name); i += 2) {
+		memcpy(&block.header.name[i], "\xc3\xa9", 2);
+	}
+	for (unsigned int i = 0; i + 2 <= sizeof(block.header.prefix); i += 2) {
+		memcpy(&block.header.prefix[i], "\xc3\xa9", 2);
+	}
+	memcpy(block.header.magic, "ustar", 6);
+	check_checksums(block, "UTF-8 names");
+
+	// random blocks, with a spread of densities of high bytes
+	std::mt19937 rng(1);
+	for (unsigned int round = 0; round < 10000; round++) {
+		unsigned int mask = (round % 4 == 0) ? 0x7f : 0xff;
+		for (unsigned int i = 0; i < TAR_BLOCK_SIZE; i++) {
+			block.bytes[i] = rng() & mask;
+		}
+
+		char what[32];
+		snprintf(what, sizeof(what), "random block %u", round);
+		check_checksums(block, what);
+	}
+
+	// a checksum field that isn't octal never verifies
+	memset(&block, 0, sizeof(block));
+	memcpy(block.header.chksum, "0000x00", 8);
+	CHECK(!tar_verify_checksum(block.bytes), "non-octal checksum accepted");
+}
+
+/**
+ * Parses an octal field a character at a time.
+ */
+static bool reference_octal(const char *field, size_t width, uint64_t& value)
+{
+	size_t i = 0;
+	while (i < width && field[i] == ' ') i++;
+
+	value = 0;
+	for (; i < width && field[i] != 0 && field[i] != ' '; i++) {
+		if (field[i] < '0' || field[i] > '7') {
+			return false;
+		}
+		value = value * 8 + (field[i] - '0');
+	}
+
+	return true;
+}
+
+static void check_octal(const char *field, size_t width)
+{
+	uint64_t expected = 0, value = 0;
+	bool expected_ok = reference_octal(field, width, expected);
+	bool ok = tar_parse_octal(field, width, value);
+
+	CHECK(ok == expected_ok, "\"%.*s\": parsed %d, expected %d", (int) width, field, ok, expected_ok);
+	if (ok && expected_ok) {
+		CHECK(value == expected, "\"%.*s\": %llo, expected %llo", (int) width, field, (unsigned long long) value, (unsigned long long) expected);
+	}
+}
+
+static void test_octal()
+{
+	check_octal("0000644", 8);
+	check_octal("0000644\0", 8);
+	check_octal("    644 ", 8);
+	check_octal("644     ", 8);
+	check_octal("        ", 8);
+	check_octal("\0\0\0\0\0\0\0\0", 8);
+	check_octal("00000001234", 12);
+	check_octal("77777777777\0", 12);
+	check_octal("777777777777", 12);
+	check_octal("0000000000000000", 16);
+	check_octal("7777777777777777", 16);
+	check_octal("0009", 4);
+	check_octal("12 34", 5);
+	check_octal("1-2", 3);
+
+	uint64_t value;
+	CHECK(tar_parse_number("00000001750\0", 12, value) && value == 01750, "octal number");
+}
+
+static void test_base256()
+{
+	uint64_t value;
+
+	// 8 GiB, which doesn't fit in eleven octal digits
+	const char size[12] = { (char) 0x80, 0, 0, 0, 0, 0, 0, 0x02, 0, 0, 0, 0 };
+	CHECK(tar_parse_number(size, sizeof(size), value) && value == 0x200000000ull, "8 GiB");
+
+	const char max[12] = { (char) 0x80, 0, 0, 0, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff };
+	CHECK(tar_parse_number(max, sizeof(max), value) && value == ~0ull, "largest 64-bit value");
+
+	const char big[12] = { (char) 0x80, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+	CHECK(!tar_parse_number(big, sizeof(big), value), "65-bit value accepted");
+
+	const char negative[12] = { (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff };
+	CHECK(!tar_parse_number(negative, sizeof(negative), value), "negative value accepted");
+}
+
+static void test_zero_block()
+{
+	Block block;
+	memset(&block, 0, sizeof(block));
+	CHECK(tar_is_zero_block(block.bytes, sizeof(block)), "zero block");
+
+	for (unsigned int i = 0; i < TAR_BLOCK_SIZE; i += 37) {
+		block.bytes[i] = 1;
+		CHECK(!tar_is_zero_block(block.bytes, sizeof(block)), "byte %u set", i);
+		block.bytes[i] = 0;
+	}
+}
+
+static void test_compression_format()
+{
+	Block block;
+	memset(&block, 0, sizeof(block));
+	CHECK(tar_compression_format(block.bytes) == NULL, "zero block");
+
+	memcpy(block.bytes, "\x1f\x8b", 2);
+	CHECK(tar_compression_format(block.bytes) && !strcmp(tar_compression_format(block.bytes), "gzip"), "gzip");
+
+	memcpy(block.bytes, "BZh9", 4);
+	CHECK(tar_compression_format(block.bytes) && !strcmp(tar_compression_format(block.bytes), "bzip2"), "bzip2");
+
+	memcpy(block.bytes, "\xfd" "7zXZ\0", 6);
+	CHECK(tar_compression_format(block.bytes) && !strcmp(tar_compression_format(block.bytes), "xz"), "xz");
+
+	memcpy(block.bytes, "\x28\xb5\x2f\xfd", 4);
+	CHECK(tar_compression_format(block.bytes) && !strcmp(tar_compression_format(block.bytes), "zstd"), "zstd");
+}
+
+int main()
+{
+	test_checksum();
+	test_octal();
+	test_base256();
+	test_zero_block();
+	test_compression_format();
+
+	printf("tar-header-test: %u checks, %u failed\n", nr_checks, nr_failures);
+	return nr_failures ? 1 : 0;
+}
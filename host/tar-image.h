@@ -0,0 +1,264 @@
+/*
+ * Helpers for building trees of files on the host, and archiving them with GNU tar, for the
+ * TarFS tests and benchmarks.
+ */
+#pragma once
+
+#include "../tarfs-header.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * Creates a temporary directory to build trees and archives in.
+ */
+static inline std::string make_temp_dir(const char *prefix)
+{
+	std::string path = std::string("/tmp/") + prefix + ".XXXXXX";
+	if (!mkdtemp(&path[0])) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	return path;
+}
+
+/**
+ * Removes a temporary directory and everything in it.
+ */
+static inline void remove_temp_dir(const std::string& path)
+{
+	std::string command = "rm -rf '" + path + "'";
+	if (system(command.c_str()) != 0) {
+		fprintf(stderr, "unable to remove %s\n", path.c_str());
+	}
+}
+
+/**
+ * Returns the contents a file of the given size and seed is filled with: a pattern that differs
+ * from file to file and from block to block, so misplaced data doesn't go unnoticed.
+ */
+static inline std::string file_contents(size_t size, unsigned int seed)
+{
+	std::string data(size, 0);
+	uint32_t x = seed * 2654435761u + 1;
+	for (size_t i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = (char) x;
+	}
+
+	return data;
+}
+
+static inline void make_dir(const std::string& path)
+{
+	if (mkdir(path.c_str(), 0755) < 0) {
+		perror(path.c_str());
+		exit(1);
+	}
+}
+
+static inline void write_file(const std::string& path, const std::string& data)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fclose(f) != 0) {
+		perror(path.c_str());
+		exit(1);
+	}
+}
+
+static inline std::string read_file(const std::string& path)
+{
+	std::string data;
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return data;
+	}
+
+	char buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		data.append(buffer, n);
+	}
+
+	fclose(f);
+	return data;
+}
+
+/**
+ * Archives members of a directory with GNU tar.
+ * @param archive The path of the archive to write.
+ * @param format The archive format, as given to tar's --format option.
+ * @param dir The directory the members are in.
+ * @param members The members, in the order they are to be archived.  The contents of
+ * directories are archived in name order.
+ * @param options Any further options for tar, such as for compression.
+ */
+static inline void make_archive(const std::string& archive, const char *format, const std::string& dir,
+	const std::vector<std::string>& members, const char *options = "")
+{
+	std::string command = std::string("tar --format=") + format + " --sort=name --owner=0 --group=0 " + options
+		+ " -cf '" + archive + "' -C '" + dir + "'";
+	for (const std::string& member : members) {
+		command += " '" + member + "'";
+	}
+
+	if (system(command.c_str()) != 0) {
+		fprintf(stderr, "failed: %s\n", command.c_str());
+		exit(1);
+	}
+}
+
+/**
+ * Compresses a file with gzip, keeping the original.
+ * @param path The file to compress.
+ * @param compressed The path of the compressed copy to write.
+ * @param options Any further options for gzip, such as the compression level.
+ */
+static inline void gzip_file(const std::string& path, const std::string& compressed, const char *options = "")
+{
+	std::string command = std::string("gzip -c ") + options + " '" + path + "' > '" + compressed + "'";
+	if (system(command.c_str()) != 0) {
+		fprintf(stderr, "failed: %s\n", command.c_str());
+		exit(1);
+	}
+}
+
+/**
+ * Fills in the checksum of a header block the way GNU tar does: six octal digits, a NUL and a
+ * space, over the block with the checksum field counted as spaces.
+ */
+static inline void set_header_checksum(tarfs::posix_header *header)
+{
+	memset(header->chksum, ' ', sizeof(header->chksum));
+
+	unsigned int sum = 0;
+	for (unsigned int i = 0; i < TAR_BLOCK_SIZE; i++) {
+		sum += ((const uint8_t *) header)[i];
+	}
+
+	snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+	header->chksum[7] = ' ';
+}
+
+/**
+ * Writes a copy of an archive with a TARFS_INDEX_NAME member in front, listing every member as
+ * the driver's scan would find it.  Only GNU long names and ustar prefixes are understood, not
+ * PAX headers, so the archive should be in the gnu or ustar format.
+ * @param archive The archive to index.
+ * @param indexed The path of the copy to write.
+ * @param tamper If given, called with the index data before it is written, to damage it.
+ */
+static inline void index_archive(const std::string& archive, const std::string& indexed,
+	const std::function<void(std::string&)>& tamper = nullptr)
+{
+	using namespace tarfs;
+
+	struct Member {
+		std::string path;
+		uint32_t header_block;
+		uint64_t size, mtime, mode;
+		char typeflag;
+	};
+
+	std::string tar = read_file(archive);
+	std::vector<Member> members;
+	std::string long_name;
+
+	size_t block = 0;
+	while ((block + 1) * TAR_BLOCK_SIZE <= tar.size()) {
+		const posix_header *header = (const posix_header *) &tar[block * TAR_BLOCK_SIZE];
+		if (tar_is_zero_block((const uint8_t *) header, TAR_BLOCK_SIZE)) {
+			break;
+		}
+
+		Member member = { "", (uint32_t) block, 0, 0, 0, header->typeflag };
+		tar_parse_number(header->size, sizeof(header->size), member.size);
+		tar_parse_number(header->mtime, sizeof(header->mtime), member.mtime);
+		tar_parse_number(header->mode, sizeof(header->mode), member.mode);
+
+		const char *data = &tar[(block + 1) * TAR_BLOCK_SIZE];
+		block += 1 + (member.size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+
+		if (member.typeflag == TAR_TYPE_GNU_LONGNAME) {
+			long_name.assign(data, strnlen(data, member.size));
+			continue;
+		}
+
+		if (!long_name.empty()) {
+			member.path = long_name;
+		} else {
+			if (header->prefix[0] && memcmp(header->magic, TAR_MAGIC_POSIX, sizeof(header->magic)) == 0) {
+				member.path.assign(header->prefix, strnlen(header->prefix, sizeof(header->prefix)));
+				member.path += "/";
+			}
+			member.path.append(header->name, strnlen(header->name, sizeof(header->name)));
+		}
+
+		if (member.typeflag != TAR_TYPE_GNU_LONGLINK) {
+			members.push_back(member);
+		}
+		long_name.clear();
+	}
+
+	std::stable_sort(members.begin(), members.end(), [](const Member& a, const Member& b) { return a.path < b.path; });
+
+	std::string strtab;
+	for (const Member& member : members) {
+		strtab += member.path;
+		strtab += '\0';
+	}
+
+	// Every header moves down by the index member's own header and data blocks.
+	size_t index_size = sizeof(tarfs_index_header) + members.size() * sizeof(tarfs_index_entry) + strtab.size();
+	uint32_t shift = 1 + (index_size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+
+	std::string index(index_size, 0);
+	tarfs_index_header *index_header = (tarfs_index_header *) &index[0];
+	memcpy(index_header->magic, TARFS_INDEX_MAGIC, sizeof(index_header->magic));
+	index_header->version = TARFS_INDEX_VERSION;
+	index_header->nr_entries = members.size();
+	index_header->strtab_size = strtab.size();
+
+	tarfs_index_entry *entries = (tarfs_index_entry *) &index_header[1];
+	uint32_t name_offset = 0;
+	for (size_t i = 0; i < members.size(); i++) {
+		entries[i].name_offset = name_offset;
+		entries[i].header_block = members[i].header_block + shift;
+		entries[i].size = members[i].size;
+		entries[i].mtime = members[i].mtime;
+		entries[i].mode = members[i].mode;
+		entries[i].typeflag = members[i].typeflag;
+		name_offset += members[i].path.size() + 1;
+	}
+	memcpy(&entries[members.size()], strtab.data(), strtab.size());
+
+	if (tamper) {
+		tamper(index);
+	}
+
+	std::string header_block(TAR_BLOCK_SIZE, 0);
+	posix_header *header = (posix_header *) &header_block[0];
+	strcpy(header->name, TARFS_INDEX_NAME);
+	memcpy(header->mode, "0000644", 8);
+	memcpy(header->uid, "0000000", 8);
+	memcpy(header->gid, "0000000", 8);
+	snprintf(header->size, sizeof(header->size), "%011lo", (unsigned long) index.size());
+	memcpy(header->mtime, "00000000000", 12);
+	header->typeflag = TAR_TYPE_REGULAR;
+	memcpy(header->magic, TAR_MAGIC_POSIX, sizeof(header->magic));
+	memcpy(header->version, "00", 2);
+	set_header_checksum(header);
+
+	index.resize((shift - 1) * TAR_BLOCK_SIZE, 0);
+	write_file(indexed, header_block + index + tar);
+}
@@ -0,0 +1,381 @@
+/*
+ * Host benchmarks for the TAR file-system driver.
+ *
+ * Usage: tarfs-bench [-l latency-us] [archive]
+ *
+ * The archive is mounted from a file-backed block device, optionally with every device
+ * request made to take the given number of microseconds.  Without an archive, a tree of
+ * thousands of small files and a few large ones is built and archived with GNU tar first.
+ * The benchmarks are then run again on a gzip-compressed copy of the archive, mounted through
+ * a TarFSGzipDevice, where mounting includes building the checkpoint index, and the device
+ * requests counted are those made for the compressed image.
+ *
+ * Each benchmark runs against a freshly mounted file system, so its caches start cold, and
+ * reports the mean cost per call along with the median and 99th percentile latencies,
+ * followed by the device requests and blocks each call cost, and the throughput of reads.
+ * Setting INFOS_LOG shows the driver's own I/O statistics as each file system is unmounted.
+ */
+#include "../tarfs.h"
+#include "../tarfs-header.h"
+#include "../tarfs-gzip.h"
+#include "bench.h"
+#include "file-block-device.h"
+#include "tar-image.h"
+
+#include <random>
+
+using namespace infos::fs;
+using namespace infos::util;
+using namespace tarfs;
+
+// Shape of the generated archive: directories of small files, and a few large files.
+#define BENCH_NR_DIRS		40
+#define BENCH_FILES_PER_DIR	100
+#define BENCH_SMALL_MAX		16384
+#define BENCH_NR_LARGE		4
+#define BENCH_LARGE_SIZE	(8 << 20)
+
+// Number of mounts timed, size of sequential reads, and number and size of random reads.  Each
+// random read of a gzip image inflates half a checkpoint span on average, so fewer are made.
+#define BENCH_MOUNTS		10
+#define BENCH_SEQ_CHUNK		65536
+#define BENCH_RANDOM_READS	20000
+#define BENCH_GZIP_RANDOM_READS	1000
+#define BENCH_RANDOM_SIZE	4096
+
+// Vocabulary that the generated files are written in, so that they compress about as well as
+// text does.
+static const char *const bench_words[] = {
+	"the", "kernel", "page", "block", "device", "file", "system", "read", "write", "cache", "lock", "tree",
+	"node", "entry", "archive", "header", "mount", "offset", "buffer", "request", "queue", "index", "table", "sched"
+};
+
+static std::string archive, image;
+static bool compressed;
+static uint64_t latency_ns;
+
+struct FileInfo {
+	std::string path;
+	uint64_t size;
+};
+
+static std::vector<FileInfo> files;
+static std::vector<std::string> dirs;
+
+/**
+ * Mounts the image on a new device, so that nothing is cached, through a TarFSGzipDevice if
+ * the image is compressed.
+ */
+class Mount
+{
+public:
+	Mount() : device(image.c_str(), TAR_BLOCK_SIZE, latency_ns), fs(NULL), root(NULL)
+	{
+	}
+
+	~Mount()
+	{
+		delete fs;
+	}
+
+	bool mount()
+	{
+		if (!compressed) {
+			fs = new TarFS(device);
+		} else {
+			TarFSGzipDevice *gzip = new TarFSGzipDevice(device, TARFS_GZIP_CHECKPOINT_SPAN);
+			if (!gzip->build_index()) {
+				delete gzip;
+				return false;
+			}
+
+			fs = new TarFS(*gzip, gzip);
+		}
+
+		root = fs->mount();
+		return root != NULL;
+	}
+
+	TarFSNode *resolve(const std::string& path)
+	{
+		PFSNode *node = root;
+		size_t start = 0;
+		while (node && start < path.size()) {
+			size_t end = path.find('/', start);
+			if (end == std::string::npos) {
+				end = path.size();
+			}
+
+			node = node->get_child(String(path.c_str() + start, end - start));
+			start = end + 1;
+		}
+
+		return (TarFSNode *) node;
+	}
+
+	FileBlockDevice device;
+	TarFS *fs;
+	PFSNode *root;
+};
+
+/**
+ * Counts the device requests made by each call of a benchmark.
+ */
+class DeviceCounts
+{
+public:
+	DeviceCounts(const FileBlockDevice& device) : _device(device), _reads(device.nr_reads()), _blocks(device.blocks_read())
+	{
+	}
+
+	void report(const Latencies& latencies, uint64_t bytes = 0)
+	{
+		double calls = latencies.nr_calls() ? latencies.nr_calls() : 1;
+		printf("%28s %.2f requests, %.1f blocks per call", "device I/O:",
+			(_device.nr_reads() - _reads) / calls, (_device.blocks_read() - _blocks) / calls);
+		if (bytes) {
+			printf(", %.1f MiB/s", (double) bytes / (1 << 20) / (latencies.total_ns() / 1e9));
+		}
+		printf("\n");
+	}
+
+private:
+	const FileBlockDevice& _device;
+	uint64_t _reads, _blocks;
+};
+
+/**
+ * Returns the contents of a generated file: words from the vocabulary, chosen at random.
+ */
+static std::string text_contents(size_t size, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::string data;
+	while (data.size() < size) {
+		data += bench_words[rng() % ARRAY_SIZE(bench_words)];
+		data += (rng() % 12 == 0) ? '\n' : ' ';
+	}
+
+	data.resize(size);
+	return data;
+}
+
+/**
+ * Builds and archives a tree of files to benchmark against.
+ */
+static std::string generate_archive(const std::string& tmp)
+{
+	std::string src = tmp + "/src";
+	make_dir(src);
+	make_dir(src + "/small");
+	make_dir(src + "/large");
+
+	std::mt19937 rng(1);
+	for (unsigned int d = 0; d < BENCH_NR_DIRS; d++) {
+		std::string dir = src + "/small/d" + std::to_string(d);
+		make_dir(dir);
+
+		for (unsigned int f = 0; f < BENCH_FILES_PER_DIR; f++) {
+			write_file(dir + "/f" + std::to_string(f), text_contents(rng() % BENCH_SMALL_MAX, d * BENCH_FILES_PER_DIR + f));
+		}
+	}
+
+	for (unsigned int i = 0; i < BENCH_NR_LARGE; i++) {
+		write_file(src + "/large/l" + std::to_string(i), text_contents(BENCH_LARGE_SIZE, 100000 + i));
+	}
+
+	std::string path = tmp + "/bench.tar";
+	make_archive(path, "gnu", src, { "small", "large" });
+	return path;
+}
+
+/**
+ * Lists the files and directories in the archive.
+ */
+static void walk(Mount& mount, TarFSNode *node, const std::string& path)
+{
+	Directory *dir = node->opendir();
+	DirectoryEntry entry;
+	while (dir->read_entry(entry)) {
+		std::string child_path = path.empty() ? entry.name.c_str() : path + "/" + entry.name.c_str();
+		TarFSNode *child = (TarFSNode *) node->get_child(entry.name);
+
+		char type = child->metadata().type;
+		if (type == TAR_TYPE_DIRECTORY) {
+			dirs.push_back(child_path);
+			walk(mount, child, child_path);
+		} else if (type == TAR_TYPE_REGULAR || type == TAR_TYPE_AREGULAR || type == TAR_TYPE_CONTIGUOUS) {
+			files.push_back({ child_path, child->size() });
+		}
+	}
+
+	delete dir;
+}
+
+static void bench_mount()
+{
+	Latencies latencies;
+	uint64_t reads = 0, blocks = 0;
+
+	for (unsigned int i = 0; i < BENCH_MOUNTS; i++) {
+		Mount mount;
+		if (!latencies.time([&] { return mount.mount(); })) {
+			fprintf(stderr, "tarfs-bench: mount failed\n");
+			exit(1);
+		}
+
+		reads += mount.device.nr_reads();
+		blocks += mount.device.blocks_read();
+	}
+
+	latencies.report("mount");
+	printf("%28s %.2f requests, %.1f blocks per call\n", "device I/O:", (double) reads / BENCH_MOUNTS, (double) blocks / BENCH_MOUNTS);
+}
+
+/**
+ * Lists every directory twice.  Listings are read from the entry table without creating nodes,
+ * so the second pass only differs by what the CPU has cached.
+ */
+static void bench_opendir()
+{
+	Mount mount;
+	mount.mount();
+
+	for (int pass = 0; pass < 2; pass++) {
+		Latencies latencies;
+		DeviceCounts counts(mount.device);
+
+		for (const std::string& path : dirs) {
+			TarFSNode *node = mount.resolve(path);
+			latencies.time_void([&] {
+				Directory *dir = node->opendir();
+				DirectoryEntry entry;
+				while (dir->read_entry(entry));
+				delete dir;
+			});
+		}
+
+		latencies.report(pass == 0 ? "opendir: first listing" : "opendir: listed again");
+		counts.report(latencies);
+	}
+}
+
+/**
+ * Reads files from start to end in fixed-size preads, either the large files or the small
+ * files, each of which is read in one go.
+ */
+static void bench_sequential(bool large)
+{
+	Mount mount;
+	mount.mount();
+
+	Latencies latencies;
+	DeviceCounts counts(mount.device);
+	std::vector<uint8_t> buffer(BENCH_SEQ_CHUNK);
+	uint64_t bytes = 0;
+
+	for (const FileInfo& info : files) {
+		if ((info.size > BENCH_SEQ_CHUNK) != large) {
+			continue;
+		}
+
+		File *file = mount.resolve(info.path)->open();
+		for (uint64_t offset = 0; offset < info.size; offset += BENCH_SEQ_CHUNK) {
+			bytes += latencies.time([&] { return file->pread(buffer.data(), BENCH_SEQ_CHUNK, offset); });
+		}
+		delete file;
+	}
+
+	latencies.report(large ? "pread: sequential, large" : "pread: whole small files");
+	counts.report(latencies, bytes);
+}
+
+/**
+ * Reads small chunks at random offsets in random files.
+ */
+static void bench_random(unsigned int nr_reads)
+{
+	Mount mount;
+	mount.mount();
+
+	std::vector<File *> open_files;
+	for (const FileInfo& info : files) {
+		open_files.push_back(info.size ? mount.resolve(info.path)->open() : NULL);
+	}
+
+	Latencies latencies;
+	DeviceCounts counts(mount.device);
+	std::vector<uint8_t> buffer(BENCH_RANDOM_SIZE);
+	std::mt19937_64 rng(2);
+	uint64_t bytes = 0;
+
+	for (unsigned int i = 0; i < nr_reads; i++) {
+		unsigned int idx = rng() % files.size();
+		if (!open_files[idx]) {
+			continue;
+		}
+
+		uint64_t offset = rng() % files[idx].size;
+		bytes += latencies.time([&] { return open_files[idx]->pread(buffer.data(), BENCH_RANDOM_SIZE, offset); });
+	}
+
+	latencies.report("pread: random 4 KiB");
+	counts.report(latencies, bytes);
+
+	for (File *file : open_files) {
+		delete file;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		if (opt == 'l') {
+			latency_ns = strtoull(optarg, NULL, 0) * 1000;
+		} else {
+			fprintf(stderr, "usage: tarfs-bench [-l latency-us] [archive]\n");
+			return 1;
+		}
+	}
+
+	std::string tmp = make_temp_dir("tarfs-bench");
+	archive = optind < argc ? argv[optind] : generate_archive(tmp);
+	image = archive;
+
+	{
+		Mount mount;
+		if (!mount.mount()) {
+			fprintf(stderr, "tarfs-bench: unable to mount %s\n", archive.c_str());
+			return 1;
+		}
+		walk(mount, (TarFSNode *) mount.root, "");
+	}
+
+	printf("%s: %zu files, %zu directories, %lu us per device request\n", archive.c_str(), files.size(), dirs.size(),
+		(unsigned long) (latency_ns / 1000));
+	printf("%-28s %10s %10s %8s %8s\n", "benchmark", "calls", "ns/call", "p50 ns", "p99 ns");
+
+	bench_mount();
+	bench_opendir();
+	bench_sequential(true);
+	bench_sequential(false);
+	bench_random(BENCH_RANDOM_READS);
+
+	image = tmp + "/bench.tar.gz";
+	compressed = true;
+	gzip_file(archive, image);
+
+	printf("\n%s: %zu bytes, gzip-compressed from %zu, checkpoints every %u bytes\n", image.c_str(), read_file(image).size(),
+		read_file(archive).size(), TARFS_GZIP_CHECKPOINT_SPAN);
+	printf("%-28s %10s %10s %8s %8s\n", "benchmark", "calls", "ns/call", "p50 ns", "p99 ns");
+
+	bench_mount();
+	bench_opendir();
+	bench_sequential(true);
+	bench_sequential(false);
+	bench_random(BENCH_GZIP_RANDOM_READS);
+
+	remove_temp_dir(tmp);
+	return 0;
+}
@@ -0,0 +1,762 @@
+/*
+ * Tests for the TAR file-system driver, against archives written by GNU tar.
+ *
+ * Usage: tarfs-test
+ *
+ * A tree of files is built in a temporary directory, with files of assorted sizes, hundreds
+ * of files in one directory, long and UTF-8 names, and symbolic links, and is archived by
+ * GNU tar in each of the ustar, gnu and pax formats.  Each archive is mounted from a file-
+ * backed block device, and every directory listing, every file read whole, and reads and
+ * preads at random offsets are compared with the tree on disk, as are whole pages filled with
+ * read_pages and the extents behind them.  Threads then pread the same
+ * files at once, through the mount's shared caches, and look up the same names at once on a
+ * fresh mount, where every lookup creates nodes.
+ *
+ * Archives with a .tarfs-index member in front are mounted from the index when it is valid,
+ * and by scanning when it is corrupt, of another version, or points past the archive, and
+ * either way must match the tree on disk.
+ *
+ * Directory listings are also checked on an archive whose directories mostly have no entries
+ * of their own, with names that sort between a directory and the paths below it.
+ *
+ * gzip-compressed copies of an archive are mounted through a TarFSGzipDevice, and checked
+ * like the others, as are the blocks it presents, read in every order, against the archive
+ * itself.  Damaged and truncated copies must fail to index.
+ *
+ * Two of the members exercise header corner cases: the first member's name starts with the
+ * bzip2 magic, and one of the ustar headers sums to more than 65535, with a member after it
+ * that has to be found.  Archives that must be refused (with the wrong block size, corrupt
+ * gzip images, or compressed images mounted directly) are checked too, so the driver logs a
+ * few errors along the way.
+ */
+#include "../tarfs.h"
+#include "../tarfs-header.h"
+#include "../tarfs-gzip.h"
+#include "file-block-device.h"
+#include "tar-image.h"
+
+#include <dirent.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <thread>
+
+using namespace infos::fs;
+using namespace infos::util;
+using namespace tarfs;
+
+static unsigned int nr_checks, nr_failures;
+
+#define CHECK(cond, ...) do {							\
+		nr_checks++;							\
+		if (!(cond)) {							\
+			nr_failures++;						\
+			printf("%s:%d: %s: ", __FILE__, __LINE__, #cond);	\
+			printf(__VA_ARGS__);					\
+			printf("\n");						\
+		}								\
+	} while (0)
+
+// Size of the pages read_pages fills, and the most filled at once.
+#define PAGE_TEST_SIZE		4096
+#define PAGE_TEST_PAGES		8u
+
+// Amount of output between the checkpoints of gzip images, kept small so that even the test
+// archives have plenty of them.
+#define GZIP_TEST_SPAN		65536
+// Number of runs of blocks read straight from a gzip device.
+#define GZIP_TEST_READS		2000
+
+// Number of threads reading at once, the preads each makes, and the largest of them.
+#define CONCURRENT_THREADS	4
+#define CONCURRENT_READS	5000
+#define CONCURRENT_READ_MAX	20000
+
+// U+FFFD, whose UTF-8 encoding has nothing but high bytes.
+#define REPLACEMENT_CHAR	"\xef\xbf\xbd"
+
+static std::string repeat(const char *str, unsigned int count)
+{
+	std::string result;
+	for (unsigned int i = 0; i < count; i++) {
+		result += str;
+	}
+
+	return result;
+}
+
+/**
+ * Builds the tree to be archived, and returns its top-level members in the order they are to
+ * be archived.  The members under "long" don't fit in a ustar header, so they come last.
+ */
+static std::vector<std::string> build_tree(const std::string& src)
+{
+	make_dir(src);
+	write_file(src + "/BZh-first.txt", "BZh91AY&SY, but not really\n");
+
+	// a symbolic link whose prefix, name and link name are all high bytes, split over two
+	// directories so that tar can still fit the path into the prefix and name fields
+	std::string high_dir = src + "/high/" + repeat(REPLACEMENT_CHAR, 33);
+	make_dir(src + "/high");
+	make_dir(high_dir);
+	high_dir += "/" + repeat(REPLACEMENT_CHAR, 16);
+	make_dir(high_dir);
+	if (symlink(repeat(REPLACEMENT_CHAR, 33).c_str(), (high_dir + "/" + repeat(REPLACEMENT_CHAR, 33)).c_str()) < 0) {
+		perror("symlink");
+		exit(1);
+	}
+	write_file(src + "/after-high.txt", "found after the high header\n");
+
+	static const size_t sizes[] = { 0, 1, 511, 512, 513, 4095, 4096, 4097, 65537, 1048583 };
+	make_dir(src + "/sizes");
+	for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++) {
+		write_file(src + "/sizes/" + std::to_string(sizes[i]), file_contents(sizes[i], i));
+	}
+
+	make_dir(src + "/dir");
+	make_dir(src + "/dir/empty");
+	make_dir(src + "/dir/sub");
+	make_dir(src + "/dir/sub/deeper");
+	write_file(src + "/dir/sub/deeper/file.txt", "deep\n");
+	write_file(src + "/dir/sub/other.bin", file_contents(20000, 100));
+	if (symlink("sub/other.bin", (src + "/dir/link").c_str()) < 0) {
+		perror("symlink");
+		exit(1);
+	}
+
+	make_dir(src + "/many");
+	for (unsigned int i = 0; i < 300; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "/many/file-%03u", i);
+		write_file(src + name, file_contents(i * 37, 1000 + i));
+	}
+
+	std::string a(100, 'a'), b(100, 'b'), c(100, 'c');
+	make_dir(src + "/long");
+	make_dir(src + "/long/" + a);
+	make_dir(src + "/long/" + a + "/" + b);
+	write_file(src + "/long/" + a + "/" + b + "/" + c + ".txt", file_contents(3000, 2000));
+	write_file(src + "/long/" + std::string(150, 'n'), file_contents(700, 2001));
+	write_file(src + "/long/" + repeat("\xc3\xa9", 120), file_contents(5000, 2002));
+
+	return { "BZh-first.txt", "high", "after-high.txt", "sizes", "dir", "many", "long" };
+}
+
+/**
+ * Finds the node at a path, one component at a time.
+ */
+static PFSNode *resolve(PFSNode *root, const std::string& path)
+{
+	PFSNode *node = root;
+	size_t start = 0;
+	while (node && start < path.size()) {
+		size_t end = path.find('/', start);
+		if (end == std::string::npos) {
+			end = path.size();
+		}
+
+		node = node->get_child(String(path.c_str() + start, end - start));
+		start = end + 1;
+	}
+
+	return node;
+}
+
+/**
+ * Checks a file read back whole, in chunks of random sizes, and with preads and seeks at random.
+ */
+static void check_file(PFSNode *node, const std::string& path, const std::string& expected, std::mt19937& rng)
+{
+	File *file = node->open();
+	CHECK(file, "%s: can't be opened", path.c_str());
+	if (!file) {
+		return;
+	}
+
+	std::vector<char> buffer(expected.size() + 70000);
+	std::string data;
+	int rc;
+	while ((rc = file->read(buffer.data(), 1 + rng() % 65536)) > 0) {
+		data.append(buffer.data(), rc);
+	}
+	CHECK(data == expected, "%s: read %zu bytes, expected %zu", path.c_str(), data.size(), expected.size());
+
+	for (unsigned int i = 0; i < 20 && !expected.empty(); i++) {
+		size_t offset = rng() % expected.size();
+		size_t length = rng() % (expected.size() - offset + 1000);
+		size_t wanted = std::min(length, expected.size() - offset);
+
+		rc = file->pread(buffer.data(), length, offset);
+		CHECK(rc == (int) wanted && !memcmp(buffer.data(), &expected[offset], wanted),
+			"%s: pread of %zu at %zu returned %d, expected %zu", path.c_str(), length, offset, rc, wanted);
+	}
+
+	if (expected.size() > 1) {
+		size_t offset = rng() % expected.size();
+		file->seek(offset, File::SeekAbsolute);
+		rc = file->read(buffer.data(), 1);
+		CHECK(rc == 1 && buffer[0] == expected[offset], "%s: read after seeking to %zu", path.c_str(), offset);
+	}
+
+	file->close();
+	delete file;
+}
+
+/**
+ * Checks a directory's listing against the directory on disk, and then everything in it.
+ */
+static void check_dir(PFSNode *root, const std::string& src, const std::string& path, const std::vector<std::string>& skip, std::mt19937& rng)
+{
+	PFSNode *node = path.empty() ? root : resolve(root, path);
+	CHECK(node, "%s: missing", path.c_str());
+	if (!node) {
+		return;
+	}
+
+	std::map<std::string, unsigned int> listed;
+	Directory *dir = node->opendir();
+	DirectoryEntry entry;
+	while (dir->read_entry(entry)) {
+		CHECK(listed.count(entry.name.c_str()) == 0, "%s: %s listed twice", path.c_str(), entry.name.c_str());
+		listed[entry.name.c_str()] = entry.size;
+	}
+	dir->close();
+	delete dir;
+
+	std::map<std::string, struct stat> on_disk;
+	DIR *host_dir = opendir((src + "/" + path).c_str());
+	while (struct dirent *de = readdir(host_dir)) {
+		std::string name = de->d_name;
+		if (name == "." || name == ".." || (path.empty() && std::find(skip.begin(), skip.end(), name) != skip.end())) {
+			continue;
+		}
+
+		struct stat st;
+		lstat((src + "/" + path + "/" + name).c_str(), &st);
+		on_disk[name] = st;
+	}
+	closedir(host_dir);
+
+	CHECK(listed.size() == on_disk.size(), "%s: %zu entries listed, expected %zu", path.c_str(), listed.size(), on_disk.size());
+
+	for (const auto& disk_entry : on_disk) {
+		const std::string& name = disk_entry.first;
+		const struct stat& st = disk_entry.second;
+		std::string child_path = path.empty() ? name : path + "/" + name;
+
+		CHECK(listed.count(name), "%s: not listed", child_path.c_str());
+
+		if (S_ISDIR(st.st_mode)) {
+			check_dir(root, src, child_path, skip, rng);
+		} else if (S_ISREG(st.st_mode)) {
+			CHECK(listed[name] == st.st_size, "%s: listed with size %u, expected %lu", child_path.c_str(), listed[name], (unsigned long) st.st_size);
+
+			PFSNode *child = resolve(root, child_path);
+			CHECK(child, "%s: missing", child_path.c_str());
+			if (child) {
+				check_file(child, child_path, read_file(src + "/" + child_path), rng);
+			}
+		} else {
+			CHECK(listed[name] == 0, "%s: link listed with size %u", child_path.c_str(), listed[name]);
+			CHECK(resolve(root, child_path), "%s: missing", child_path.c_str());
+		}
+	}
+
+	CHECK(!resolve(root, path.empty() ? "no-such-file" : path + "/no-such-file"), "%s: found a file that doesn't exist", path.c_str());
+}
+
+/**
+ * Fills pages of files with read_pages, at page offsets throughout each file and past its end,
+ * and checks them against the file, with zeros after the end.  Offsets that aren't page-aligned
+ * must be refused.  Each file's extent must start at its data and run to its end.
+ */
+static void check_read_pages(PFSNode *root, const std::string& src)
+{
+	static const size_t sizes[] = { 0, 1, 4095, 4096, 4097, 65537, 1048583 };
+	std::vector<char> pages(PAGE_TEST_PAGES * PAGE_TEST_SIZE);
+
+	for (size_t size : sizes) {
+		std::string path = "sizes/" + std::to_string(size);
+		std::string expected = read_file(src + "/" + path);
+		TarFSNode *node = (TarFSNode *) resolve(root, path);
+		TarFSFile *file = node ? (TarFSFile *) node->open() : NULL;
+		CHECK(file, "%s: can't be opened", path.c_str());
+		if (!file) {
+			continue;
+		}
+
+		for (uint64_t offset = 0; offset <= size + PAGE_TEST_SIZE; offset += PAGE_TEST_SIZE * (1 + offset / 65536)) {
+			for (unsigned int nr_pages : { 1u, 3u, PAGE_TEST_PAGES }) {
+				memset(pages.data(), 0x5a, pages.size());
+				int64_t rc = file->read_pages(offset, pages.data(), nr_pages);
+
+				size_t length = (size_t) nr_pages * PAGE_TEST_SIZE;
+				size_t valid = offset < size ? std::min<size_t>(size - offset, length) : 0;
+				bool ok = rc == (int64_t) valid && !memcmp(pages.data(), &expected[std::min<size_t>(offset, size)], valid);
+				for (size_t i = valid; ok && i < length; i++) {
+					ok = pages[i] == 0;
+				}
+				for (size_t i = length; ok && i < pages.size(); i++) {
+					ok = pages[i] == 0x5a;
+				}
+				CHECK(ok, "%s: read_pages of %u at %lu returned %ld, expected %zu", path.c_str(), nr_pages,
+					(unsigned long) offset, (long) rc, valid);
+			}
+		}
+
+		CHECK(file->read_pages(1, pages.data(), 1) == -1, "%s: read_pages at offset 1 accepted", path.c_str());
+		CHECK(file->read_pages(PAGE_TEST_SIZE + 512, pages.data(), 1) == -1, "%s: read_pages at a block offset accepted", path.c_str());
+
+		TarFSExtent extent;
+		CHECK(!file->extent(size, extent), "%s: extent at the end of the file", path.c_str());
+		if (size > 5000) {
+			bool found = file->extent(5000, extent);
+			CHECK(found && extent.device_block == node->metadata().data_block + 5000 / TAR_BLOCK_SIZE
+				&& extent.offset_in_block == 5000 % TAR_BLOCK_SIZE && extent.length == size - 5000
+				&& extent.nr_blocks == (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE - 5000 / TAR_BLOCK_SIZE,
+				"%s: extent at 5000 is %u+%u blocks, %lu bytes", path.c_str(), extent.device_block, extent.nr_blocks,
+				(unsigned long) extent.length);
+		}
+
+		delete file;
+	}
+}
+
+/**
+ * Reads files from several threads at once, each with its own open files, so that they all
+ * go through the mount's block cache and request queue together.
+ */
+static void check_concurrent_reads(PFSNode *root, const std::string& src)
+{
+	std::vector<std::string> paths = { "sizes/4097", "sizes/65537", "sizes/1048583", "dir/sub/other.bin", "many/file-299" };
+	std::vector<std::string> contents;
+	for (const std::string& path : paths) {
+		contents.push_back(read_file(src + "/" + path));
+	}
+
+	std::vector<unsigned int> mismatches(CONCURRENT_THREADS);
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < CONCURRENT_THREADS; t++) {
+		threads.emplace_back([&, t] {
+			std::mt19937 rng(100 + t);
+			std::vector<File *> files;
+			for (const std::string& path : paths) {
+				files.push_back(resolve(root, path)->open());
+			}
+
+			std::vector<char> buffer(CONCURRENT_READ_MAX);
+			for (unsigned int i = 0; i < CONCURRENT_READS; i++) {
+				unsigned int idx = rng() % paths.size();
+				const std::string& expected = contents[idx];
+				size_t offset = rng() % expected.size();
+				size_t length = 1 + rng() % CONCURRENT_READ_MAX;
+				size_t wanted = std::min(length, expected.size() - offset);
+
+				int rc = files[idx]->pread(buffer.data(), length, offset);
+				if (rc != (int) wanted || memcmp(buffer.data(), &expected[offset], wanted)) {
+					mismatches[t]++;
+				}
+			}
+
+			for (File *file : files) {
+				delete file;
+			}
+		});
+	}
+
+	for (unsigned int t = 0; t < CONCURRENT_THREADS; t++) {
+		threads[t].join();
+		CHECK(mismatches[t] == 0, "thread %u: %u of %u concurrent preads wrong", t, mismatches[t], CONCURRENT_READS);
+	}
+}
+
+/**
+ * Looks up the same files from several threads at once, in different orders, on a mount that
+ * hasn't created their nodes yet.  Every thread must find the same node for each name.
+ */
+static void check_concurrent_lookups(const std::string& archive, const char *format)
+{
+	FileBlockDevice device(archive.c_str(), TAR_BLOCK_SIZE);
+	TarFS fs(device);
+	PFSNode *root = fs.mount();
+	if (!root) {
+		return;
+	}
+
+	std::vector<std::vector<PFSNode *>> found(CONCURRENT_THREADS, std::vector<PFSNode *>(300));
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < CONCURRENT_THREADS; t++) {
+		threads.emplace_back([&, t] {
+			std::vector<unsigned int> order(300);
+			for (unsigned int i = 0; i < order.size(); i++) {
+				order[i] = i;
+			}
+			std::shuffle(order.begin(), order.end(), std::mt19937(200 + t));
+
+			for (unsigned int i : order) {
+				char path[32];
+				snprintf(path, sizeof(path), "many/file-%03u", i);
+				found[t][i] = resolve(root, path);
+			}
+		});
+	}
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	unsigned int mismatches = 0;
+	for (unsigned int i = 0; i < 300; i++) {
+		for (unsigned int t = 0; t < CONCURRENT_THREADS; t++) {
+			if (!found[t][i] || found[t][i] != found[0][i]) {
+				mismatches++;
+			}
+		}
+	}
+	CHECK(mismatches == 0, "%s: %u concurrent lookups found a missing or different node", format, mismatches);
+	CHECK(((TarFSNode *) resolve(root, "many"))->nr_children() == 300, "%s: many has %u nodes after concurrent lookups",
+		format, ((TarFSNode *) resolve(root, "many"))->nr_children());
+}
+
+/**
+ * Returns the largest unsigned byte sum of any ustar header in an archive.
+ */
+static unsigned int largest_header_sum(const std::string& archive)
+{
+	std::string data = read_file(archive);
+	unsigned int largest = 0;
+	for (size_t offset = 0; offset + TAR_BLOCK_SIZE <= data.size(); offset += TAR_BLOCK_SIZE) {
+		const struct posix_header *header = (const struct posix_header *) &data[offset];
+		if (memcmp(header->magic, TAR_MAGIC_POSIX, sizeof(header->magic)) != 0) {
+			continue;
+		}
+
+		unsigned int sum = 0;
+		for (unsigned int i = 0; i < TAR_BLOCK_SIZE; i++) {
+			sum += (uint8_t) data[offset + i];
+		}
+		largest = std::max(largest, sum);
+	}
+
+	return largest;
+}
+
+static void test_format(const std::string& tmp, const std::string& src, const std::vector<std::string>& members, const char *format)
+{
+	// ustar can't hold the long names, and tar refuses to archive them
+	std::vector<std::string> archived = members, skip;
+	if (!strcmp(format, "ustar")) {
+		archived.pop_back();
+		skip.push_back(members.back());
+	}
+
+	std::string archive = tmp + "/" + format + ".tar";
+	make_archive(archive, format, src, archived);
+
+	// pax archives start with the first member's extended header instead
+	if (strcmp(format, "pax")) {
+		CHECK(read_file(archive).compare(0, 3, "BZh") == 0, "%s: first member isn't named BZh...", format);
+	}
+	if (!strcmp(format, "ustar")) {
+		unsigned int sum = largest_header_sum(archive);
+		CHECK(sum > 65535, "%s: largest header sums to %u", format, sum);
+	}
+
+	FileBlockDevice device(archive.c_str(), TAR_BLOCK_SIZE);
+	TarFS *fs = new TarFS(device);
+	PFSNode *root = fs->mount();
+	CHECK(root, "%s: mount failed", format);
+	if (root) {
+		std::mt19937 rng(1);
+		check_dir(root, src, "", skip, rng);
+		check_read_pages(root, src);
+		check_concurrent_reads(root, src);
+	}
+
+	printf("%-6s: %lu device requests, %lu blocks\n", format, (unsigned long) device.nr_reads(), (unsigned long) device.blocks_read());
+	delete fs;
+
+	check_concurrent_lookups(archive, format);
+
+	// only 512-byte blocks hold one tar record each, and other sizes are refused
+	FileBlockDevice large_blocks(archive.c_str(), 2 * TAR_BLOCK_SIZE);
+	fs = new TarFS(large_blocks);
+	CHECK(!fs->mount(), "%s: mounted with %u-byte blocks", format, 2 * TAR_BLOCK_SIZE);
+	delete fs;
+}
+
+/**
+ * Mounts a copy of an archive with an index in front, damaged by tamper if it is given, and
+ * checks whether the index was used, and that the tree matches the one on disk either way.
+ */
+static void check_index(const std::string& archive, const std::string& src, const std::vector<std::string>& skip,
+	const char *what, bool expect_used, const std::function<void(std::string&)>& tamper = nullptr)
+{
+	std::string indexed = archive + "." + what;
+	index_archive(archive, indexed, tamper);
+
+	FileBlockDevice device(indexed.c_str(), TAR_BLOCK_SIZE);
+	TarFS fs(device);
+	PFSNode *root = fs.mount();
+	CHECK(root, "%s index: mount failed", what);
+	if (!root) {
+		return;
+	}
+
+	// a mount from the index reads the index member's header, and then the index itself
+	bool used = device.nr_reads() <= 2;
+	CHECK(used == expect_used, "%s index: %s, in %lu device requests", what, used ? "used" : "not used", (unsigned long) device.nr_reads());
+
+	std::mt19937 rng(3);
+	check_dir(root, src, "", skip, rng);
+}
+
+static void test_index(const std::string& tmp, const std::string& src, const std::vector<std::string>& members)
+{
+	std::vector<std::string> archived = { "sizes", "dir", "many" }, skip;
+	for (const std::string& member : members) {
+		if (std::find(archived.begin(), archived.end(), member) == archived.end()) {
+			skip.push_back(member);
+		}
+	}
+
+	std::string archive = tmp + "/index.tar";
+	make_archive(archive, "gnu", src, archived);
+
+	check_index(archive, src, skip, "valid", true);
+
+	check_index(archive, src, skip, "corrupt", false, [](std::string& index) {
+		tarfs_index_header *header = (tarfs_index_header *) &index[0];
+		tarfs_index_entry *entries = (tarfs_index_entry *) &header[1];
+		entries[header->nr_entries / 2].name_offset = header->strtab_size + 100;
+	});
+
+	check_index(archive, src, skip, "stale", false, [](std::string& index) {
+		((tarfs_index_header *) &index[0])->version = TARFS_INDEX_VERSION - 1;
+	});
+
+	check_index(archive, src, skip, "overrun", false, [](std::string& index) {
+		tarfs_index_header *header = (tarfs_index_header *) &index[0];
+		tarfs_index_entry *entries = (tarfs_index_entry *) &header[1];
+		entries[header->nr_entries - 1].size = 1ull << 40;
+	});
+}
+
+/**
+ * Lists a directory with read_entries, a few entries at a time, and checks the listing against
+ * the expected names and sizes, and that listing it created no nodes.
+ */
+static void check_listing(PFSNode *root, const std::string& path, const std::map<std::string, unsigned int>& expected)
+{
+	TarFSNode *node = (TarFSNode *) resolve(root, path);
+	CHECK(node, "%s: missing", path.c_str());
+	if (!node) {
+		return;
+	}
+
+	unsigned int nr_nodes = node->nr_children();
+	TarFSDirectory *dir = (TarFSDirectory *) node->opendir();
+
+	std::map<std::string, unsigned int> listed;
+	DirectoryEntry entries[3];
+	unsigned int n;
+	while ((n = dir->read_entries(entries, ARRAY_SIZE(entries))) > 0) {
+		for (unsigned int i = 0; i < n; i++) {
+			CHECK(listed.count(entries[i].name.c_str()) == 0, "%s: %s listed twice", path.c_str(), entries[i].name.c_str());
+			listed[entries[i].name.c_str()] = entries[i].size;
+		}
+	}
+	CHECK(dir->read_entries(entries, ARRAY_SIZE(entries)) == 0, "%s: entries after the end", path.c_str());
+	delete dir;
+
+	CHECK(listed == expected, "%s: %zu entries listed, expected %zu", path.c_str(), listed.size(), expected.size());
+	CHECK(node->nr_children() == nr_nodes, "%s: listing created %u nodes", path.c_str(), node->nr_children() - nr_nodes);
+}
+
+/**
+ * Checks listings where directories have no entries of their own, and where siblings such as
+ * "a.txt" sort between a directory "a" and the paths below it, "a/...".
+ */
+static void test_listing(const std::string& tmp)
+{
+	std::string src = tmp + "/listing-src";
+	make_dir(src);
+	make_dir(src + "/top");
+	make_dir(src + "/top/a");
+	make_dir(src + "/top/a/deeper");
+	make_dir(src + "/top/a-b");
+	write_file(src + "/top/a/x", "x\n");
+	write_file(src + "/top/a/deeper/z", "zz\n");
+	write_file(src + "/top/a.txt", "a.txt\n");
+	write_file(src + "/top/a-b/y", "yyy\n");
+	write_file(src + "/top/a-b.c", "a-b.c\n");
+	write_file(src + "/top/b", file_contents(1000, 1));
+
+	// only a-b has an entry of its own, and a-b.c sorts between it and a-b/y; top, a and
+	// a/deeper exist only as parts of longer paths
+	std::string archive = tmp + "/listing.tar";
+	make_archive(archive, "gnu", src, { "top/a/x", "top/a.txt", "top/a-b", "top/a-b/y", "top/a-b.c", "top/b", "top/a/deeper/z" },
+		"--no-recursion");
+
+	FileBlockDevice device(archive.c_str(), TAR_BLOCK_SIZE);
+	TarFS fs(device);
+	PFSNode *root = fs.mount();
+	CHECK(root, "listing: mount failed");
+	if (!root) {
+		return;
+	}
+
+	check_listing(root, "", { { "top", 0 } });
+	check_listing(root, "top", { { "a", 0 }, { "a.txt", 6 }, { "a-b", 0 }, { "a-b.c", 6 }, { "b", 1000 } });
+	check_listing(root, "top/a", { { "x", 2 }, { "deeper", 0 } });
+	check_listing(root, "top/a/deeper", { { "z", 3 } });
+	check_listing(root, "top/a-b", { { "y", 4 } });
+	check_listing(root, "top/b", { });
+
+	CHECK(resolve(root, "top/a/deeper/z"), "listing: top/a/deeper/z missing");
+	CHECK(!resolve(root, "top/a/deeper/y"), "listing: found top/a/deeper/y");
+}
+
+/**
+ * Reads runs of blocks from a gzip device, forwards, backwards and at random, and compares them
+ * with the archive it was compressed from.
+ */
+static void check_gzip_blocks(TarFSGzipDevice& device, const std::string& tar, const char *what)
+{
+	size_t nr_blocks = (tar.size() + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+	CHECK(device.size() == tar.size() && device.block_count() == nr_blocks, "%s: %lu bytes in %zu blocks, expected %zu in %zu",
+		what, (unsigned long) device.size(), device.block_count(), tar.size(), nr_blocks);
+
+	std::string padded = tar;
+	padded.resize(nr_blocks * TAR_BLOCK_SIZE, 0);
+
+	std::mt19937 rng(4);
+	std::vector<char> buffer;
+	size_t offset = 0;
+	for (unsigned int i = 0; i < GZIP_TEST_READS; i++) {
+		// carry on from the previous read, go back a little, or jump anywhere
+		unsigned int choice = rng() % 3;
+		if (choice == 1) {
+			offset -= std::min<size_t>(offset, rng() % 256);
+		} else if (choice == 2) {
+			offset = rng() % nr_blocks;
+		}
+
+		size_t count = std::min<size_t>(1 + rng() % 300, nr_blocks - offset);
+		buffer.assign(count * TAR_BLOCK_SIZE, 0x5a);
+		bool ok = device.read_blocks(buffer.data(), offset, count);
+		CHECK(ok && !memcmp(buffer.data(), &padded[offset * TAR_BLOCK_SIZE], buffer.size()),
+			"%s: blocks %zu+%zu differ from the archive", what, offset, count);
+
+		offset = (offset + count) % nr_blocks;
+	}
+
+	buffer.resize(TAR_BLOCK_SIZE);
+	CHECK(!device.read_blocks(buffer.data(), nr_blocks, 1), "%s: read past the end", what);
+	CHECK(device.nr_restores() > 0, "%s: no reads went back to a checkpoint", what);
+}
+
+/**
+ * Mounts gzip-compressed archives through a TarFSGzipDevice, on image devices with assorted
+ * block sizes, and checks them against the tree on disk, and the blocks it presents against the
+ * uncompressed archive.  Damaged images must fail to index.
+ */
+static void test_gzip(const std::string& tmp, const std::string& src, const std::vector<std::string>& members)
+{
+	std::string archive = tmp + "/gzip.tar";
+	make_archive(archive, "gnu", src, members);
+	std::string tar = read_file(archive);
+
+	static const struct {
+		const char *options;
+		unsigned int image_block_size;
+	} variants[] = { { "-6", TAR_BLOCK_SIZE }, { "-1", 4096 }, { "-9", 1024 } };
+
+	for (const auto& variant : variants) {
+		std::string compressed = archive + variant.options + ".gz";
+		gzip_file(archive, compressed, variant.options);
+
+		char what[32];
+		snprintf(what, sizeof(what), "gzip %s", variant.options);
+
+		FileBlockDevice image(compressed.c_str(), variant.image_block_size);
+		CHECK(TarFSGzipDevice::detect(image), "%s: not detected", what);
+
+		TarFSGzipDevice *device = new TarFSGzipDevice(image, GZIP_TEST_SPAN);
+		CHECK(device->build_index(), "%s: index not built", what);
+		// checkpoints wait for the end of a deflate block, which can be tens of kilobytes on
+		CHECK(device->nr_checkpoints() > tar.size() / (2 * GZIP_TEST_SPAN), "%s: only %u checkpoints", what, device->nr_checkpoints());
+		check_gzip_blocks(*device, tar, what);
+
+		// the mount owns the device it is given
+		TarFS *fs = new TarFS(*device, device);
+		PFSNode *root = fs->mount();
+		CHECK(root, "%s: mount failed", what);
+		if (root) {
+			std::mt19937 rng(5);
+			check_dir(root, src, "", { }, rng);
+			check_read_pages(root, src);
+			check_concurrent_reads(root, src);
+		}
+
+		printf("%-6s: %lu image requests, %lu blocks of %u bytes\n", what, (unsigned long) image.nr_reads(),
+			(unsigned long) image.blocks_read(), variant.image_block_size);
+		delete fs;
+	}
+
+	// archives are long enough that gzip always sends its own codes, but short streams use the
+	// fixed ones, and the device doesn't mind what it is inflating
+	std::string text = tmp + "/short.txt";
+	write_file(text, "hello hello hello hello world\n");
+	gzip_file(text, text + ".gz");
+
+	FileBlockDevice short_image((text + ".gz").c_str(), TAR_BLOCK_SIZE);
+	TarFSGzipDevice short_device(short_image, GZIP_TEST_SPAN);
+	CHECK(short_device.build_index(), "short gzip stream: index not built");
+	check_gzip_blocks(short_device, read_file(text), "short gzip stream");
+
+	FileBlockDevice plain(archive.c_str(), TAR_BLOCK_SIZE);
+	CHECK(!TarFSGzipDevice::detect(plain), "uncompressed archive detected as gzip");
+
+	// a flipped byte in the deflate stream, and a missing trailer
+	std::string gz = read_file(archive + "-6.gz");
+	std::string damaged = gz;
+	damaged[damaged.size() / 2] ^= 0x10;
+	write_file(tmp + "/damaged.tar.gz", damaged);
+	write_file(tmp + "/truncated.tar.gz", gz.substr(0, gz.size() - 8));
+
+	for (const char *name : { "damaged", "truncated" }) {
+		std::string path = tmp + "/" + name + ".tar.gz";
+		FileBlockDevice image(path.c_str(), TAR_BLOCK_SIZE);
+		TarFSGzipDevice device(image, GZIP_TEST_SPAN);
+		CHECK(!device.build_index(), "%s gzip image indexed", name);
+	}
+}
+
+int main()
+{
+	std::string tmp = make_temp_dir("tarfs-test");
+	std::string src = tmp + "/src";
+	std::vector<std::string> members = build_tree(src);
+
+	test_format(tmp, src, members, "ustar");
+	test_format(tmp, src, members, "gnu");
+	test_format(tmp, src, members, "pax");
+	test_index(tmp, src, members);
+	test_listing(tmp);
+	test_gzip(tmp, src, members);
+
+	// a compressed archive is refused rather than mounted as garbage, unless it is read
+	// through a device that inflates it
+	std::string compressed = tmp + "/compressed.tar.gz";
+	make_archive(compressed, "gnu", src, { "dir" }, "-z");
+	FileBlockDevice device(compressed.c_str(), TAR_BLOCK_SIZE);
+	TarFS *fs = new TarFS(device);
+	CHECK(!fs->mount(), "gzip-compressed archive mounted");
+	delete fs;
+
+	remove_temp_dir(tmp);
+
+	printf("tarfs-test: %u checks, %u failed\n", nr_checks, nr_failures);
+	return nr_failures ? 1 : 0;
+}
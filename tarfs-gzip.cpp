@@ -0,0 +1,782 @@
+/*
+ * TAR File-system Driver
+ * Random access to gzip-compressed images
+ */
+#include "tarfs-gzip.h"
+#include "tarfs-header.h"
+#include <infos/kernel/log.h>
+
+using namespace infos::drivers::block;
+using namespace infos::kernel;
+using namespace infos::util;
+using namespace tarfs;
+
+// Amount of the compressed image read per device request.
+#define TARFS_GZIP_INPUT_SIZE		32768
+// Initial size of the checkpoint table, which doubles as the image is indexed.
+#define TARFS_GZIP_CHECKPOINTS_INITIAL	16
+
+// Flags in the gzip member header (RFC 1952).
+#define GZIP_FLAG_HCRC		0x02
+#define GZIP_FLAG_EXTRA		0x04
+#define GZIP_FLAG_NAME		0x08
+#define GZIP_FLAG_COMMENT	0x10
+#define GZIP_FLAG_RESERVED	0xe0
+
+// The lengths and distances that the length and distance symbols stand for, and the number of
+// extra bits added to each (RFC 1951, 3.2.5).
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distance_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577
+};
+static const uint8_t distance_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// The order that the lengths of the code length code are sent in.
+static const uint8_t code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/**
+ * Constructs a device presenting the archive inside a gzip-compressed image.  Nothing can be
+ * read from it until the index has been built.
+ * @param image The device holding the compressed image.
+ * @param checkpoint_span The amount of output between checkpoints.  Each checkpoint costs
+ * TARFS_GZIP_WINDOW bytes, and a read inflates up to this much before getting to its data.
+ */
+TarFSGzipDevice::TarFSGzipDevice(BlockDevice& image, unsigned int checkpoint_span)
+: _image(image),
+_image_block_size(image.block_size()),
+_image_nr_blocks(image.block_count()),
+_checkpoint_span(checkpoint_span),
+_input_start(0),
+_input_end(0),
+_input_pos(0),
+_input_overrun(false),
+_bit_buffer(0),
+_nr_bits(0),
+_mode(FAILED),
+_last_block(false),
+_stored_remaining(0),
+_lengths(NULL),
+_distances(NULL),
+_copy_remaining(0),
+_copy_distance(0),
+_out_pos(0),
+_size(0),
+_checkpoints(NULL),
+_nr_checkpoints(0),
+_max_checkpoints(0),
+_nr_restores(0),
+_bytes_inflated(0)
+{
+	_input_blocks = TARFS_GZIP_INPUT_SIZE / _image_block_size;
+	if (_input_blocks == 0) {
+		_input_blocks = 1;
+	}
+
+	_input = new uint8_t[_input_blocks * _image_block_size];
+	_window = new uint8_t[TARFS_GZIP_WINDOW];
+
+	// The fixed codes of RFC 1951, 3.2.6.  Distance symbols 30 and 31 never turn up, so the
+	// distance code is left incomplete without them.
+	uint8_t lengths[288];
+	for (unsigned int i = 0; i < 288; i++) {
+		lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	}
+	build_code(_fixed_lengths, lengths, 288);
+
+	for (unsigned int i = 0; i < 30; i++) {
+		lengths[i] = 5;
+	}
+	build_code(_fixed_distances, lengths, 30);
+}
+
+TarFSGzipDevice::~TarFSGzipDevice()
+{
+	for (unsigned int i = 0; i < _nr_checkpoints; i++) {
+		delete[] _checkpoints[i].window;
+	}
+
+	delete[] _checkpoints;
+	delete[] _window;
+	delete[] _input;
+}
+
+/**
+ * Determines whether a device holds a gzip-compressed image.  As when mounting, the magic is
+ * only looked for when the first block isn't a valid tar header.
+ * @param image The device to look at.
+ * @return Returns true if the image is gzip-compressed, or false otherwise.
+ */
+bool TarFSGzipDevice::detect(BlockDevice& image)
+{
+	size_t block_size = image.block_size();
+	if (block_size < TAR_BLOCK_SIZE || image.block_count() == 0) {
+		return false;
+	}
+
+	uint8_t *block = new uint8_t[block_size];
+	const char *compression = NULL;
+	if (image.read_blocks(block, 0, 1) && !tar_verify_checksum(block)) {
+		compression = tar_compression_format(block);
+	}
+	delete[] block;
+
+	return compression && strcmp(compression, "gzip") == 0;
+}
+
+size_t TarFSGzipDevice::block_size() const
+{
+	return TAR_BLOCK_SIZE;
+}
+
+/**
+ * Returns the number of blocks in the archive, the last of which is padded with zeros if the
+ * archive doesn't fill it.
+ */
+size_t TarFSGzipDevice::block_count() const
+{
+	return (_size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+}
+
+/**
+ * Returns the next byte of the compressed image, reading the run of blocks it is in if it
+ * isn't already in the input buffer.  Past the end of the image, or if the image can't be
+ * read, zeros are returned, and the stream is failed by the inflater.
+ */
+uint8_t TarFSGzipDevice::next_input_byte()
+{
+	if (_input_pos < _input_start || _input_pos >= _input_end) {
+		uint64_t block = _input_pos / _image_block_size;
+		uint64_t nr_blocks = _image_nr_blocks > block ? _image_nr_blocks - block : 0;
+		if (nr_blocks > _input_blocks) {
+			nr_blocks = _input_blocks;
+		}
+
+		if (nr_blocks == 0 || !_image.read_blocks(_input, block, nr_blocks)) {
+			_input_start = _input_end = 0;
+			_input_overrun = true;
+			_input_pos++;
+			return 0;
+		}
+
+		_input_start = block * _image_block_size;
+		_input_end = _input_start + nr_blocks * _image_block_size;
+	}
+
+	return _input[_input_pos++ - _input_start];
+}
+
+/**
+ * Moves the input to a bit of the compressed image, dropping any bits already taken.  The
+ * input buffer is kept, in case the bit is in it.
+ */
+void TarFSGzipDevice::seek_input(uint64_t bit)
+{
+	_input_pos = bit / 8;
+	_input_overrun = false;
+	_bit_buffer = 0;
+	_nr_bits = 0;
+
+	bits(bit % 8);
+}
+
+/**
+ * Takes bytes from the input until the bit buffer holds at least the given number of bits.
+ */
+inline void TarFSGzipDevice::need_bits(unsigned int nr_bits)
+{
+	while (_nr_bits < nr_bits) {
+		_bit_buffer |= (uint64_t) next_input_byte() << _nr_bits;
+		_nr_bits += 8;
+	}
+}
+
+/**
+ * Takes bits from the input, least significant first.
+ * @param nr_bits The number of bits, at most 32.
+ */
+inline unsigned int TarFSGzipDevice::bits(unsigned int nr_bits)
+{
+	need_bits(nr_bits);
+
+	unsigned int value = _bit_buffer & ((1ull << nr_bits) - 1);
+	_bit_buffer >>= nr_bits;
+	_nr_bits -= nr_bits;
+
+	return value;
+}
+
+/**
+ * Reads the header of the gzip member at the start of the image, leaving the input at the
+ * start of the deflate stream.
+ * @return Returns true if the header is one that can be inflated, or false otherwise.
+ */
+bool TarFSGzipDevice::parse_gzip_header()
+{
+	// magic, and deflate as the compression method
+	if (bits(8) != 0x1f || bits(8) != 0x8b || bits(8) != 8) {
+		return false;
+	}
+
+	unsigned int flags = bits(8);
+	if (flags & GZIP_FLAG_RESERVED) {
+		return false;
+	}
+
+	// modification time, extra flags and operating system
+	for (unsigned int i = 0; i < 6; i++) {
+		bits(8);
+	}
+
+	if (flags & GZIP_FLAG_EXTRA) {
+		unsigned int len = bits(16);
+		while (len-- > 0 && !_input_overrun) {
+			bits(8);
+		}
+	}
+
+	if (flags & GZIP_FLAG_NAME) {
+		while (bits(8) != 0 && !_input_overrun);
+	}
+
+	if (flags & GZIP_FLAG_COMMENT) {
+		while (bits(8) != 0 && !_input_overrun);
+	}
+
+	if (flags & GZIP_FLAG_HCRC) {
+		bits(16);
+	}
+
+	return !_input_overrun;
+}
+
+/**
+ * Builds a canonical Huffman code from the lengths of each symbol's code.
+ * @param code The code to build.
+ * @param lengths The length of each symbol's code, or zero for symbols that aren't used.
+ * @param nr_symbols The number of symbols.
+ * @return Returns false if there are more codes of some length than the code has room for.
+ * Codes that don't use all the room are allowed, and fail when a missing code turns up.
+ */
+bool TarFSGzipDevice::build_code(TarFSHuffman& code, const uint8_t *lengths, unsigned int nr_symbols)
+{
+	memset(code.count, 0, sizeof(code.count));
+	for (unsigned int s = 0; s < nr_symbols; s++) {
+		code.count[lengths[s]]++;
+	}
+
+	int left = 1;
+	for (unsigned int len = 1; len <= TARFS_GZIP_MAX_BITS; len++) {
+		left = (left << 1) - code.count[len];
+		if (left < 0) {
+			return false;
+		}
+	}
+
+	// Symbols are ordered by the length of their code, and by value within a length.
+	uint16_t offsets[TARFS_GZIP_MAX_BITS + 1];
+	offsets[1] = 0;
+	for (unsigned int len = 1; len < TARFS_GZIP_MAX_BITS; len++) {
+		offsets[len + 1] = offsets[len] + code.count[len];
+	}
+
+	for (unsigned int s = 0; s < nr_symbols; s++) {
+		if (lengths[s]) {
+			code.symbol[offsets[lengths[s]]++] = s;
+		}
+	}
+
+	// Codes are sent most significant bit first, but come out of the bit buffer least
+	// significant first, so each short code fills every fast entry that starts with its
+	// bits reversed.
+	memset(code.fast, 0, sizeof(code.fast));
+
+	unsigned int first = 0, index = 0;
+	for (unsigned int len = 1; len <= TARFS_GZIP_FAST_BITS; len++) {
+		for (unsigned int i = 0; i < code.count[len]; i++) {
+			unsigned int value = first + i, reversed = 0;
+			for (unsigned int bit = 0; bit < len; bit++) {
+				reversed |= ((value >> bit) & 1) << (len - 1 - bit);
+			}
+
+			uint16_t entry = (code.symbol[index + i] << 4) | len;
+			for (unsigned int fill = reversed; fill < (1u << TARFS_GZIP_FAST_BITS); fill += 1u << len) {
+				code.fast[fill] = entry;
+			}
+		}
+
+		index += code.count[len];
+		first = (first + code.count[len]) << 1;
+	}
+
+	return true;
+}
+
+/**
+ * Decodes a symbol from the input.
+ * @return Returns the symbol, or -1 if the input holds a code that isn't in use.
+ */
+inline int TarFSGzipDevice::decode(const TarFSHuffman& code)
+{
+	need_bits(TARFS_GZIP_FAST_BITS);
+
+	uint16_t entry = code.fast[_bit_buffer & ((1u << TARFS_GZIP_FAST_BITS) - 1)];
+	if (entry & 0xf) {
+		_bit_buffer >>= entry & 0xf;
+		_nr_bits -= entry & 0xf;
+		return entry >> 4;
+	}
+
+	// The code is longer than the fast table covers: walk the canonical code a bit at a time,
+	// where the codes of each length follow on from the first code of that length.
+	need_bits(TARFS_GZIP_MAX_BITS);
+
+	int value = 0, first = 0, index = 0;
+	for (unsigned int len = 1; len <= TARFS_GZIP_MAX_BITS; len++) {
+		value |= (_bit_buffer >> (len - 1)) & 1;
+
+		int count = code.count[len];
+		if (value - first < count) {
+			_bit_buffer >>= len;
+			_nr_bits -= len;
+			return code.symbol[index + value - first];
+		}
+
+		index += count;
+		first = (first + count) << 1;
+		value <<= 1;
+	}
+
+	return -1;
+}
+
+/**
+ * Reads the codes of a dynamic block, which are themselves sent with a Huffman code.
+ * @return Returns true if the codes are well formed, or false otherwise.
+ */
+bool TarFSGzipDevice::read_dynamic_codes()
+{
+	unsigned int nr_lengths = bits(5) + 257;
+	unsigned int nr_distances = bits(5) + 1;
+	unsigned int nr_code_lengths = bits(4) + 4;
+	if (nr_lengths > 286 || nr_distances > 30) {
+		return false;
+	}
+
+	// The code length code is built in the distance code, which isn't needed until after it.
+	uint8_t lengths[286 + 30];
+	for (unsigned int i = 0; i < 19; i++) {
+		lengths[code_length_order[i]] = i < nr_code_lengths ? bits(3) : 0;
+	}
+
+	TarFSHuffman& code_lengths = _dynamic_distances;
+	if (!build_code(code_lengths, lengths, 19)) {
+		return false;
+	}
+
+	// Symbols 16 to 18 repeat the previous length, or a zero length, a number of times.
+	unsigned int i = 0;
+	while (i < nr_lengths + nr_distances) {
+		int symbol = decode(code_lengths);
+		if (symbol < 0) {
+			return false;
+		}
+
+		if (symbol < 16) {
+			lengths[i++] = symbol;
+			continue;
+		}
+
+		uint8_t len = 0;
+		unsigned int repeat;
+		if (symbol == 16) {
+			if (i == 0) {
+				return false;
+			}
+
+			len = lengths[i - 1];
+			repeat = 3 + bits(2);
+		} else if (symbol == 17) {
+			repeat = 3 + bits(3);
+		} else {
+			repeat = 11 + bits(7);
+		}
+
+		if (repeat > nr_lengths + nr_distances - i) {
+			return false;
+		}
+
+		while (repeat-- > 0) {
+			lengths[i++] = len;
+		}
+	}
+
+	// Without a code for the end of the block, the block could never end.
+	if (lengths[256] == 0) {
+		return false;
+	}
+
+	return build_code(_dynamic_lengths, lengths, nr_lengths)
+		&& build_code(_dynamic_distances, &lengths[nr_lengths], nr_distances);
+}
+
+/**
+ * Reads the header of the next deflate block, and the codes of a dynamic block.
+ * @return Returns true if the block header is well formed, or false otherwise.
+ */
+bool TarFSGzipDevice::start_block()
+{
+	if (_last_block) {
+		_mode = DONE;
+		return true;
+	}
+
+	_last_block = bits(1);
+	switch (bits(2)) {
+	case 0:
+		// A stored block starts at the next byte, with its length and the length's complement.
+		bits(_nr_bits % 8);
+		_stored_remaining = bits(16);
+		if (bits(16) != (~_stored_remaining & 0xffff)) {
+			return false;
+		}
+
+		_mode = STORED;
+		break;
+
+	case 1:
+		_lengths = &_fixed_lengths;
+		_distances = &_fixed_distances;
+		_mode = CODES;
+		break;
+
+	case 2:
+		if (!read_dynamic_codes()) {
+			return false;
+		}
+
+		_lengths = &_dynamic_lengths;
+		_distances = &_dynamic_distances;
+		_mode = CODES;
+		break;
+
+	default:
+		return false;
+	}
+
+	return !_input_overrun;
+}
+
+/**
+ * Adds a byte of output to the window, and to the caller's buffer if there is one.
+ */
+#define EMIT(byte) do {									\
+		uint8_t emitted = (byte);						\
+		_window[_out_pos++ & (TARFS_GZIP_WINDOW - 1)] = emitted;		\
+		if (out) out[produced] = emitted;					\
+		produced++;								\
+	} while (0)
+
+/**
+ * Inflates the stream from where it is up to.
+ * @param out The buffer to inflate into, or NULL to skip output.
+ * @param max The most output to produce.
+ * @param stop_at_block Whether to stop at the end of a deflate block, so that a checkpoint
+ * can be taken there.
+ * @return Returns the amount of output produced, which is less than asked for only at the
+ * end of the stream, at a block boundary when stopping at them, or when the stream is
+ * corrupt, in which case the inflater is left FAILED.
+ */
+size_t TarFSGzipDevice::inflate(uint8_t *out, size_t max, bool stop_at_block)
+{
+	size_t produced = 0;
+
+	while (produced < max) {
+		if (_input_overrun) {
+			_mode = FAILED;
+		}
+
+		if (_mode == BLOCK_HEADER) {
+			if (stop_at_block && produced > 0) {
+				break;
+			}
+
+			if (!start_block()) {
+				_mode = FAILED;
+			}
+		} else if (_mode == STORED) {
+			while (_stored_remaining > 0 && produced < max) {
+				EMIT(bits(8));
+				_stored_remaining--;
+			}
+
+			if (_stored_remaining == 0) {
+				_mode = BLOCK_HEADER;
+			}
+		} else if (_mode == CODES) {
+			// Finish any match cut short by the end of the previous call, then decode symbols
+			// until the block ends or the output is full.
+			while (_copy_remaining > 0 && produced < max) {
+				EMIT(_window[(_out_pos - _copy_distance) & (TARFS_GZIP_WINDOW - 1)]);
+				_copy_remaining--;
+			}
+
+			while (produced < max && !_input_overrun) {
+				int symbol = decode(*_lengths);
+				if (symbol < 256) {
+					if (symbol < 0) {
+						_mode = FAILED;
+						break;
+					}
+
+					EMIT(symbol);
+					continue;
+				}
+
+				if (symbol == 256) {
+					_mode = BLOCK_HEADER;
+					break;
+				}
+
+				// A match: its length, with the extra bits that come before the distance code,
+				// and then its distance.
+				symbol -= 257;
+				if (symbol >= 29) {
+					_mode = FAILED;
+					break;
+				}
+
+				_copy_remaining = length_base[symbol] + bits(length_extra[symbol]);
+
+				int distance_symbol = decode(*_distances);
+				if (distance_symbol < 0 || distance_symbol >= 30) {
+					_mode = FAILED;
+					break;
+				}
+
+				_copy_distance = distance_base[distance_symbol] + bits(distance_extra[distance_symbol]);
+				if (_copy_distance > _out_pos || _copy_distance > TARFS_GZIP_WINDOW) {
+					_mode = FAILED;
+					break;
+				}
+
+				while (_copy_remaining > 0 && produced < max) {
+					EMIT(_window[(_out_pos - _copy_distance) & (TARFS_GZIP_WINDOW - 1)]);
+					_copy_remaining--;
+				}
+			}
+		} else {
+			break;
+		}
+	}
+
+	_bytes_inflated += produced;
+	return produced;
+}
+
+#undef EMIT
+
+/**
+ * Records a checkpoint where the inflater is, which must be at the start of a block.
+ */
+void TarFSGzipDevice::add_checkpoint()
+{
+	if (_nr_checkpoints == _max_checkpoints) {
+		unsigned int new_max = _max_checkpoints ? _max_checkpoints * 2 : TARFS_GZIP_CHECKPOINTS_INITIAL;
+		Checkpoint *checkpoints = new Checkpoint[new_max];
+		if (_nr_checkpoints) {
+			memcpy(checkpoints, _checkpoints, _nr_checkpoints * sizeof(Checkpoint));
+		}
+
+		delete[] _checkpoints;
+		_checkpoints = checkpoints;
+		_max_checkpoints = new_max;
+	}
+
+	Checkpoint& checkpoint = _checkpoints[_nr_checkpoints++];
+	checkpoint.offset = _out_pos;
+	checkpoint.input_bit = input_bit();
+	checkpoint.window = new uint8_t[TARFS_GZIP_WINDOW];
+	memcpy(checkpoint.window, _window, TARFS_GZIP_WINDOW);
+}
+
+/**
+ * Puts the inflater back to a checkpoint.  The window is stored as it was, so it lines up
+ * with the output offset just as it did then.
+ */
+void TarFSGzipDevice::restore(const Checkpoint& checkpoint)
+{
+	memcpy(_window, checkpoint.window, TARFS_GZIP_WINDOW);
+	_out_pos = checkpoint.offset;
+	seek_input(checkpoint.input_bit);
+
+	_mode = BLOCK_HEADER;
+	_last_block = false;
+	_stored_remaining = 0;
+	_copy_remaining = 0;
+
+	_nr_restores++;
+}
+
+/**
+ * Finds the last checkpoint at or before an offset in the archive.  The first checkpoint is
+ * always at the start.
+ */
+const TarFSGzipDevice::Checkpoint& TarFSGzipDevice::find_checkpoint(uint64_t offset) const
+{
+	unsigned int lo = 0, hi = _nr_checkpoints;
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (_checkpoints[mid].offset <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return _checkpoints[lo];
+}
+
+/**
+ * Inflates the whole image, checking it against the CRC and size in its trailer, and records
+ * a checkpoint at the first block boundary after every checkpoint span of output.
+ * @return Returns true if the image is a well-formed gzip member, or false otherwise.
+ */
+bool TarFSGzipDevice::build_index()
+{
+	UniqueLock<Mutex> l(_lock);
+
+	uint32_t crc_table[256];
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (unsigned int bit = 0; bit < 8; bit++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+
+	seek_input(0);
+	if (!parse_gzip_header()) {
+		syslog.messagef(LogLevel::ERROR, "tarfs: image doesn't start with a gzip header that can be inflated");
+		return false;
+	}
+
+	_mode = BLOCK_HEADER;
+	_last_block = false;
+	_copy_remaining = 0;
+	_out_pos = 0;
+
+	// The output is only kept long enough to be added to the CRC.
+	uint8_t *chunk = new uint8_t[TARFS_GZIP_WINDOW];
+	uint32_t crc = 0xffffffff;
+	uint64_t next_checkpoint = 0;
+
+	while (_mode != DONE && _mode != FAILED) {
+		// After the last block, there's only the trailer to restart from.
+		if (_mode == BLOCK_HEADER && !_last_block && _out_pos >= next_checkpoint) {
+			add_checkpoint();
+			next_checkpoint = _out_pos + _checkpoint_span;
+		}
+
+		size_t n = inflate(chunk, TARFS_GZIP_WINDOW, true);
+		for (size_t i = 0; i < n; i++) {
+			crc = crc_table[(crc ^ chunk[i]) & 0xff] ^ (crc >> 8);
+		}
+	}
+
+	delete[] chunk;
+
+	bool valid = _mode == DONE;
+	if (valid) {
+		// The trailer starts at the next byte: the CRC of the output, then its size modulo 2^32.
+		bits(_nr_bits % 8);
+		uint32_t stored_crc = bits(16);
+		stored_crc |= bits(16) << 16;
+		uint32_t stored_size = bits(16);
+		stored_size |= bits(16) << 16;
+
+		valid = !_input_overrun && stored_crc == ~crc && stored_size == (uint32_t) _out_pos;
+	}
+
+	if (!valid) {
+		syslog.messagef(LogLevel::ERROR, "tarfs: gzip image is corrupt");
+		return false;
+	}
+
+	_size = _out_pos;
+	_nr_restores = 0;
+	_bytes_inflated = 0;
+
+	syslog.messagef(LogLevel::INFO, "tarfs: gzip image of %lu bytes holds %lu bytes, with %u checkpoints",
+		(unsigned long) (_image_nr_blocks * _image_block_size), (unsigned long) _size, _nr_checkpoints);
+	return true;
+}
+
+/**
+ * Reads blocks of the archive, by inflating from the inflater's current position if no
+ * checkpoint lies between it and the first block, or from the last checkpoint before the first
+ * block otherwise.
+ * @param buffer The buffer to read into.
+ * @param offset The first block.
+ * @param count The number of blocks.
+ * @return Returns true if the blocks were read, or false if they are past the end of the
+ * archive, or the image couldn't be read.
+ */
+bool TarFSGzipDevice::read_blocks(void *buffer, size_t offset, size_t count)
+{
+	UniqueLock<Mutex> l(_lock);
+
+	size_t nr_blocks = block_count();
+	if (offset > nr_blocks || count > nr_blocks - offset) {
+		return false;
+	}
+
+	if (count == 0) {
+		return true;
+	}
+
+	uint64_t start = (uint64_t) offset * TAR_BLOCK_SIZE;
+	uint64_t length = (uint64_t) count * TAR_BLOCK_SIZE;
+
+	const Checkpoint& checkpoint = find_checkpoint(start);
+	if (_mode == FAILED || _out_pos > start || _out_pos < checkpoint.offset) {
+		restore(checkpoint);
+	}
+
+	uint64_t skip = start - _out_pos;
+	while (skip > 0) {
+		size_t n = inflate(NULL, skip, false);
+		if (n == 0) {
+			return false;
+		}
+		skip -= n;
+	}
+
+	// Only the last block can run past the end of the archive, and is padded with zeros.
+	uint8_t *out = (uint8_t *) buffer;
+	uint64_t wanted = _size - start < length ? _size - start : length;
+	uint64_t done = 0;
+	while (done < wanted) {
+		size_t n = inflate(&out[done], wanted - done, false);
+		if (n == 0) {
+			return false;
+		}
+		done += n;
+	}
+
+	// Bits past the end of the image, or that couldn't be read, were taken as zeros.
+	if (_input_overrun) {
+		_mode = FAILED;
+		return false;
+	}
+
+	memset(&out[wanted], 0, length - wanted);
+	return true;
+}
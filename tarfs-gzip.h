@@ -0,0 +1,121 @@
+/*
+ * TAR File-system Driver
+ * Random access to gzip-compressed images
+ */
+#pragma once
+
+#include <infos/drivers/block/block-device.h>
+#include <infos/util/lock.h>
+
+namespace tarfs
+{
+	// Size of the history that deflate matches can reach back into, which is also the size of
+	// the window kept with each checkpoint.
+	#define TARFS_GZIP_WINDOW		32768
+	// Amount of output between checkpoints, when a mount doesn't choose its own.
+	#define TARFS_GZIP_CHECKPOINT_SPAN	(1 << 20)
+
+	// A Huffman code, decoded a table lookup at a time for codes of up to TARFS_GZIP_FAST_BITS
+	// bits, and a bit at a time, canonically, for longer ones.
+	#define TARFS_GZIP_MAX_BITS		15
+	#define TARFS_GZIP_FAST_BITS	9
+
+	struct TarFSHuffman {
+		uint16_t count[TARFS_GZIP_MAX_BITS + 1];
+		uint16_t symbol[288];
+		// Indexed by the next TARFS_GZIP_FAST_BITS bits of input: the symbol in the top twelve
+		// bits, and the length of its code in the bottom four, or zero if the code is longer.
+		uint16_t fast[1 << TARFS_GZIP_FAST_BITS];
+	};
+
+	/**
+	 * Presents the tar archive inside a gzip-compressed image as a device of 512-byte blocks,
+	 * so that TarFS can mount it unchanged.  Building the index inflates the whole image once,
+	 * checking it, and records a checkpoint every so often at the start of a deflate block: the
+	 * position in the compressed stream, and the window of output before it.  A read then
+	 * inflates from the nearest checkpoint before it, or carries on from where the previous read
+	 * stopped, if that is nearer.
+	 */
+	class TarFSGzipDevice : public infos::drivers::block::BlockDevice
+	{
+	public:
+		TarFSGzipDevice(infos::drivers::block::BlockDevice& image, unsigned int checkpoint_span);
+		virtual ~TarFSGzipDevice();
+
+		static bool detect(infos::drivers::block::BlockDevice& image);
+		bool build_index();
+
+		size_t block_size() const override;
+		size_t block_count() const override;
+
+		bool read_blocks(void *buffer, size_t offset, size_t count) override;
+		bool write_blocks(const void *buffer, size_t offset, size_t count) override { return false; }
+
+		uint64_t size() const { return _size; }
+		unsigned int nr_checkpoints() const { return _nr_checkpoints; }
+		uint64_t nr_restores() const { return _nr_restores; }
+		uint64_t bytes_inflated() const { return _bytes_inflated; }
+
+	private:
+		enum Mode { BLOCK_HEADER, STORED, CODES, DONE, FAILED };
+
+		struct Checkpoint {
+			uint64_t offset;
+			uint64_t input_bit;
+			uint8_t *window;
+		};
+
+		uint8_t next_input_byte();
+		void seek_input(uint64_t bit);
+		uint64_t input_bit() const { return _input_pos * 8 - _nr_bits; }
+
+		void need_bits(unsigned int nr_bits);
+		unsigned int bits(unsigned int nr_bits);
+
+		bool parse_gzip_header();
+		bool build_code(TarFSHuffman& code, const uint8_t *lengths, unsigned int nr_symbols);
+		int decode(const TarFSHuffman& code);
+		bool read_dynamic_codes();
+		bool start_block();
+		size_t inflate(uint8_t *out, size_t max, bool stop_at_block);
+
+		void add_checkpoint();
+		void restore(const Checkpoint& checkpoint);
+		const Checkpoint& find_checkpoint(uint64_t offset) const;
+
+		infos::drivers::block::BlockDevice& _image;
+		unsigned int _image_block_size;
+		size_t _image_nr_blocks;
+		unsigned int _checkpoint_span;
+
+		// Serialises reads, which all move the one inflater.
+		infos::util::Mutex _lock;
+
+		// Compressed input, read from the image a run of blocks at a time, and the bits taken
+		// from it but not yet used.
+		uint8_t *_input;
+		unsigned int _input_blocks;
+		uint64_t _input_start, _input_end, _input_pos;
+		bool _input_overrun;
+		uint64_t _bit_buffer;
+		unsigned int _nr_bits;
+
+		// The inflater: where it is in the stream, the codes of the current block, the rest of
+		// a stored block or of a match, and the window of output that matches copy from.
+		Mode _mode;
+		bool _last_block;
+		uint32_t _stored_remaining;
+		const TarFSHuffman *_lengths, *_distances;
+		TarFSHuffman _fixed_lengths, _fixed_distances;
+		TarFSHuffman _dynamic_lengths, _dynamic_distances;
+		unsigned int _copy_remaining, _copy_distance;
+		uint8_t *_window;
+		uint64_t _out_pos;
+
+		uint64_t _size;
+		Checkpoint *_checkpoints;
+		unsigned int _nr_checkpoints, _max_checkpoints;
+
+		uint64_t _nr_restores, _bytes_inflated;
+	};
+}
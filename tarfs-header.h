@@ -0,0 +1,272 @@
+/*
+ * TAR File-system Driver
+ * Header block decoding
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace tarfs
+{
+	// Size of a TAR header, and of the records that member data is padded out to.
+	#define TAR_BLOCK_SIZE			512
+
+	// Values of the typeflag field.
+	#define TAR_TYPE_REGULAR		'0'
+	#define TAR_TYPE_AREGULAR		'\0'
+	#define TAR_TYPE_LINK			'1'
+	#define TAR_TYPE_SYMLINK		'2'
+	#define TAR_TYPE_CHAR			'3'
+	#define TAR_TYPE_BLOCK			'4'
+	#define TAR_TYPE_DIRECTORY		'5'
+	#define TAR_TYPE_FIFO			'6'
+	#define TAR_TYPE_CONTIGUOUS		'7'
+	#define TAR_TYPE_PAX_EXTENDED	'x'
+	#define TAR_TYPE_PAX_GLOBAL		'g'
+	#define TAR_TYPE_GNU_LONGNAME	'L'
+	#define TAR_TYPE_GNU_LONGLINK	'K'
+	#define TAR_TYPE_GNU_VOLUME		'V'
+
+	// The magic field of a POSIX archive.  GNU archives have "ustar " followed by a space and a
+	// NUL in the magic and version fields instead, and use the prefix field for other things.
+	#define TAR_MAGIC_POSIX			"ustar"
+
+	// The TAR header structure, with fields defined according to the standard, as listed
+	// in the TAR file format description.
+	struct posix_header {         /* byte offset */
+		char name[100];               /*   0 */
+		char mode[8];                 /* 100 */
+		char uid[8];                  /* 108 */
+		char gid[8];                  /* 116 */
+		char size[12];                /* 124 */
+		char mtime[12];               /* 136 */
+		char chksum[8];               /* 148 */
+		char typeflag;                /* 156 */
+		char linkname[100];           /* 157 */
+		char magic[6];                /* 257 */
+		char version[2];              /* 263 */
+		char uname[32];               /* 265 */
+		char gname[32];               /* 297 */
+		char devmajor[8];             /* 329 */
+		char devminor[8];             /* 337 */
+		char prefix[155];             /* 345 */
+		                              /* 500 */
+	} __packed;
+
+	/*
+	 * An archive may optionally start with a member named TARFS_INDEX_NAME, so that it can be
+	 * mounted without scanning every header.  The member's data is a tarfs_index_header,
+	 * followed by nr_entries tarfs_index_entry records sorted by path, followed by a table of
+	 * NUL-terminated paths that the entries refer to by offset.  Header block numbers are
+	 * absolute within the archive, and all fields are little-endian.  The index is produced
+	 * offline when the image is built, and must be regenerated whenever the archive changes.
+	 */
+	#define TARFS_INDEX_NAME		".tarfs-index"
+	#define TARFS_INDEX_MAGIC		"TARFSIDX"
+	#define TARFS_INDEX_VERSION		3
+
+	struct tarfs_index_header {
+		char magic[8];                /* TARFS_INDEX_MAGIC */
+		uint32_t version;             /* TARFS_INDEX_VERSION */
+		uint32_t nr_entries;
+		uint32_t strtab_size;
+		uint32_t reserved;
+	} __packed;
+
+	struct tarfs_index_entry {
+		uint32_t name_offset;         /* into the path table */
+		uint32_t header_block;
+		uint64_t size;
+		uint64_t mtime;
+		uint32_t mode;
+		char typeflag;
+		char reserved[3];
+	} __packed;
+
+	/*
+	 * The parsers below work on whole 64-bit words rather than one character at a time.
+	 * Words are loaded little-endian, so the first character of a field lands in the lowest
+	 * byte.  Header blocks are always read into word-aligned buffers.
+	 */
+
+	/**
+	 * Converts eight ASCII octal digits into their value.
+	 * @param word The digits, with the most significant digit in the lowest byte.
+	 * @param value Set to the value of the digits.
+	 * @return Returns true if all eight bytes were octal digits, or false otherwise.
+	 */
+	static inline bool tar_octal8(uint64_t word, uint32_t& value)
+	{
+		// A byte is a digit from '0' to '7' exactly when its top five bits are 00110.
+		if (((word & 0xf8f8f8f8f8f8f8f8ull) ^ 0x3030303030303030ull) != 0) {
+			return false;
+		}
+
+		// Combine neighbouring digits, then neighbouring pairs, then neighbouring quads.  The
+		// more significant half of each lane is always the lower one.
+		uint64_t v = word & 0x0707070707070707ull;
+		v = ((v & 0x00ff00ff00ff00ffull) << 3) | ((v >> 8) & 0x00ff00ff00ff00ffull);
+		v = ((v & 0x0000ffff0000ffffull) << 6) | ((v >> 16) & 0x0000ffff0000ffffull);
+		v = ((v & 0x00000000ffffffffull) << 12) | (v >> 32);
+
+		value = (uint32_t) v;
+		return true;
+	}
+
+	/**
+	 * Parses a fixed-width octal field.  The digits may be preceded by spaces, and end at
+	 * the first NUL or space, or at the end of the field.
+	 * @param field The field.
+	 * @param width The width of the field, which must be at most 16.
+	 * @param value Set to the value of the field.  An empty field is zero.
+	 * @return Returns true if the field was well formed, or false otherwise.
+	 */
+	static inline bool tar_parse_octal(const char *field, size_t width, uint64_t& value)
+	{
+		size_t start = 0;
+		while (start < width && field[start] == ' ') start++;
+
+		size_t end = start;
+		while (end < width && field[end] != 0 && field[end] != ' ') end++;
+
+		// Right-align the digits in sixteen zeros, and convert them eight at a time.
+		union {
+			char chars[16];
+			uint64_t words[2];
+		} digits;
+
+		digits.words[0] = 0x3030303030303030ull;
+		digits.words[1] = 0x3030303030303030ull;
+
+		size_t len = end - start;
+		for (size_t i = 0; i < len; i++) {
+			digits.chars[16 - len + i] = field[start + i];
+		}
+
+		uint32_t hi, lo;
+		if (!tar_octal8(digits.words[0], hi) || !tar_octal8(digits.words[1], lo)) {
+			return false;
+		}
+
+		value = ((uint64_t) hi << 24) | lo;
+		return true;
+	}
+
+	/**
+	 * Parses a numeric field, which is either octal or, when the top bit of its first byte
+	 * is set, the GNU base-256 encoding used for values that don't fit in octal, such as
+	 * the sizes of files of 8GiB and over.
+	 * @param field The field.
+	 * @param width The width of the field, which must be at most 16.
+	 * @param value Set to the value of the field.
+	 * @return Returns true if the field was well formed and fits in 64 bits, or false
+	 * otherwise.
+	 */
+	static inline bool tar_parse_number(const char *field, size_t width, uint64_t& value)
+	{
+		const uint8_t *bytes = (const uint8_t *) field;
+		if (!(bytes[0] & 0x80)) {
+			return tar_parse_octal(field, width, value);
+		}
+
+		// Base-256 values are big-endian two's complement in the remaining bits.  None of
+		// the fields parsed here can be negative.
+		if (bytes[0] & 0x40) {
+			return false;
+		}
+
+		value = bytes[0] & 0x3f;
+		for (size_t i = 1; i < width; i++) {
+			if (value >> 56) {
+				return false;
+			}
+
+			value = (value << 8) | bytes[i];
+		}
+
+		return true;
+	}
+
+	/**
+	 * Verifies the checksum of a header block.  The checksum is the sum of every byte in the
+	 * block, with the checksum field itself counted as spaces.  Some old implementations
+	 * summed signed characters, so either sum is accepted.
+	 * @param block The header block, which must be word-aligned.
+	 * @return Returns true if the checksum matches, or false otherwise.
+	 */
+	static inline bool tar_verify_checksum(const uint8_t *block)
+	{
+		const uint64_t *words = (const uint64_t *) block;
+
+		// Sum bytes in four 16-bit lanes, and count bytes with their top bit set in eight
+		// 8-bit lanes.  Neither can overflow over a single block, but their totals (up to
+		// 512 * 255 and 512) can, so the lanes are widened before being added together.
+		uint64_t sum_lanes = 0, high_lanes = 0;
+		for (unsigned int i = 0; i < TAR_BLOCK_SIZE / 8; i++) {
+			uint64_t w = words[i];
+			sum_lanes += (w & 0x00ff00ff00ff00ffull) + ((w >> 8) & 0x00ff00ff00ff00ffull);
+			high_lanes += (w >> 7) & 0x0101010101010101ull;
+		}
+
+		sum_lanes = (sum_lanes & 0x0000ffff0000ffffull) + ((sum_lanes >> 16) & 0x0000ffff0000ffffull);
+		high_lanes = (high_lanes & 0x00ff00ff00ff00ffull) + ((high_lanes >> 8) & 0x00ff00ff00ff00ffull);
+
+		int64_t sum = (int64_t) ((sum_lanes & 0xffffffffull) + (sum_lanes >> 32));
+		int64_t high = (int64_t) ((high_lanes * 0x0001000100010001ull) >> 48);
+
+		const struct posix_header *header = (const struct posix_header *) block;
+		for (unsigned int i = 0; i < sizeof(header->chksum); i++) {
+			uint8_t c = (uint8_t) header->chksum[i];
+			sum += ' ' - c;
+			high -= c >> 7;
+		}
+
+		uint64_t stored;
+		if (!tar_parse_octal(header->chksum, sizeof(header->chksum), stored)) {
+			return false;
+		}
+
+		return (int64_t) stored == sum || (int64_t) stored == sum - 256 * high;
+	}
+
+	/**
+	 * Determines whether a block is entirely zero, as the blocks marking the end of an
+	 * archive are.
+	 * @param block The block, which must be word-aligned.
+	 * @param size The size of the block, which must be a multiple of eight.
+	 * @return Returns true if every byte of the block is zero, or false otherwise.
+	 */
+	static inline bool tar_is_zero_block(const uint8_t *block, size_t size)
+	{
+		const uint64_t *words = (const uint64_t *) block;
+
+		uint64_t bits = 0;
+		for (size_t i = 0; i < size / 8; i++) {
+			bits |= words[i];
+		}
+
+		return bits == 0;
+	}
+
+	/**
+	 * Recognises the magic numbers of the compression formats that tar images are commonly
+	 * wrapped in.
+	 * @param block The first block of the image.
+	 * @return Returns the name of the compression format, or NULL if the block doesn't
+	 * start with a known one.
+	 */
+	static inline const char *tar_compression_format(const uint8_t *block)
+	{
+		if (block[0] == 0x1f && block[1] == 0x8b) {
+			return "gzip";
+		} else if (block[0] == 0x28 && block[1] == 0xb5 && block[2] == 0x2f && block[3] == 0xfd) {
+			return "zstd";
+		} else if (block[0] == 0xfd && block[1] == '7' && block[2] == 'z' && block[3] == 'X' && block[4] == 'Z' && block[5] == 0) {
+			return "xz";
+		} else if (block[0] == 'B' && block[1] == 'Z' && block[2] == 'h') {
+			return "bzip2";
+		}
+
+		return NULL;
+	}
+}
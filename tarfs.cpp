@@ -7,6 +7,8 @@
  * STUDENT NUMBER: s1735009
  */
 #include "tarfs.h"
+#include "tarfs-header.h"
+#include "tarfs-gzip.h"
 #include <infos/kernel/log.h>
 
 using namespace infos::fs;
@@ -16,188 +18,1690 @@ using namespace infos::kernel;
 using namespace infos::util;
 using namespace tarfs;
 
+// Number of device blocks held by the block cache of each mount.  Must be a power of two.
+#define TARFS_CACHE_BLOCKS		256
+// Read-ahead window bounds, in blocks.  The window starts at the minimum on the first sequential
+// read of a file, and doubles on each read that carries on where the previous one ended.
+#define TARFS_READAHEAD_MIN		4
+#define TARFS_READAHEAD_MAX		64
+// Number of reads the request queue holds before it has to issue them, and the size of its
+// bounce buffer in blocks, which must be at least TARFS_READAHEAD_MAX.
+#define TARFS_QUEUE_DEPTH		16
+#define TARFS_QUEUE_BOUNCE_BLOCKS	128
+// Size of the pages filled by TarFSFile::read_pages.
+#define TARFS_PAGE_SIZE			4096
+// Smallest and largest number of blocks read per device request while scanning headers at
+// mount time.
+#define TARFS_SCAN_BATCH_MIN	2
+#define TARFS_SCAN_BATCH		64
+// Largest GNU long name or PAX extended header that will be read, in bytes.
+#define TARFS_MAX_EXTENDED_HEADER	65536
+// Initial sizes of the entry table and its path pool, which double as the archive is scanned.
+#define TARFS_ENTRIES_INITIAL	256
+#define TARFS_PATHS_INITIAL		8192
+// Number of buckets in a directory's children table when its first child is added.
+#define TARFS_CHILD_BUCKETS_INITIAL	8
+// Size of the chunks the node arena allocates from, and the alignment of everything in it.
+#define TARFS_ARENA_CHUNK		16384
+#define TARFS_ARENA_ALIGN		16
+// Allocator bookkeeping assumed per heap allocation, for the footprint comparison.
+#define TARFS_HEAP_OVERHEAD		16
+
+// Define to create every node of the tree at mount time, rather than as paths are looked up.
+// #define TARFS_EAGER_TREE
+
+TarFSArena::TarFSArena()
+: _chunks(NULL),
+_next(NULL),
+_end(NULL),
+_bytes_requested(0),
+_bytes_reserved(0),
+_nr_allocs(0),
+_nr_chunks(0)
+{
+}
+
+TarFSArena::~TarFSArena()
+{
+	while (_chunks) {
+		Chunk *next = _chunks->next;
+		delete[] (uint8_t *) _chunks;
+		_chunks = next;
+	}
+}
+
+/**
+ * Allocates memory from the arena, by bumping a pointer through the current chunk, and
+ * starting a new chunk when it runs out.  Memory is only freed when the arena is.
+ * @param size The number of bytes to allocate.
+ * @return Returns a pointer to the memory, aligned to TARFS_ARENA_ALIGN bytes.
+ */
+void *TarFSArena::alloc(size_t size)
+{
+	size_t aligned_size = (size + TARFS_ARENA_ALIGN - 1) & ~(size_t) (TARFS_ARENA_ALIGN - 1);
+
+	if (!_next || (size_t) (_end - _next) < aligned_size) {
+		size_t header_size = (sizeof(Chunk) + TARFS_ARENA_ALIGN - 1) & ~(size_t) (TARFS_ARENA_ALIGN - 1);
+		size_t chunk_size = header_size + aligned_size;
+		if (chunk_size < TARFS_ARENA_CHUNK) {
+			chunk_size = TARFS_ARENA_CHUNK;
+		}
+
+		Chunk *chunk = (Chunk *) new uint8_t[chunk_size];
+		chunk->next = _chunks;
+		chunk->size = chunk_size;
+		_chunks = chunk;
+
+		_next = (uint8_t *) chunk + header_size;
+		_end = (uint8_t *) chunk + chunk_size;
+
+		_bytes_reserved += chunk_size;
+		_nr_chunks++;
+	}
+
+	void *ptr = _next;
+	_next += aligned_size;
+
+	_bytes_requested += size;
+	_nr_allocs++;
+
+	return ptr;
+}
+
+/**
+ * Copies a string into the arena.
+ * @param str The string to copy.
+ * @param len The length of the string.
+ * @return Returns the NUL-terminated copy.
+ */
+const char *TarFSArena::copy_string(const char *str, size_t len)
+{
+	char *copy = (char *) alloc(len + 1);
+	memcpy(copy, str, len);
+	copy[len] = 0;
+
+	return copy;
+}
+
+/**
+ * Constructs a block cache.
+ * @param block_size The size of the blocks being cached.
+ * @param nr_entries The number of blocks to cache, which must be a power of two.
+ */
+TarFSBlockCache::TarFSBlockCache(unsigned int block_size, unsigned int nr_entries)
+: _block_size(block_size),
+_nr_entries(nr_entries),
+_lru_head(NULL),
+_lru_tail(NULL),
+_nr_hits(0),
+_nr_misses(0),
+_blocks_filled(0)
+{
+	_entries = new Entry[_nr_entries];
+	_buckets = new Entry *[_nr_entries];
+	_data = new uint8_t[_nr_entries * _block_size];
+
+	// Every entry starts out invalid, and on the LRU list ready to be reused.
+	for (unsigned int i = 0; i < _nr_entries; i++) {
+		_buckets[i] = NULL;
+
+		_entries[i].block = 0;
+		_entries[i].valid = false;
+		_entries[i].hash_next = NULL;
+		_entries[i].data = &_data[i * _block_size];
+		push_lru(&_entries[i]);
+	}
+}
+
+TarFSBlockCache::~TarFSBlockCache()
+{
+	delete[] _data;
+	delete[] _buckets;
+	delete[] _entries;
+}
+
+/**
+ * Looks up a block in the cache.
+ * @param block The device block number.
+ * @return Returns the cache entry holding the block, or NULL if it is not cached.
+ */
+TarFSBlockCache::Entry *TarFSBlockCache::lookup(unsigned int block)
+{
+	for (Entry *entry = _buckets[block & (_nr_entries - 1)]; entry; entry = entry->hash_next) {
+		if (entry->block == block) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Removes an entry from the LRU list.
+ */
+void TarFSBlockCache::unlink_lru(Entry *entry)
+{
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		_lru_head = entry->lru_next;
+	}
+
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		_lru_tail = entry->lru_prev;
+	}
+}
+
+/**
+ * Pushes an entry onto the most-recently-used end of the LRU list.
+ */
+void TarFSBlockCache::push_lru(Entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = _lru_head;
+	if (_lru_head) {
+		_lru_head->lru_prev = entry;
+	} else {
+		_lru_tail = entry;
+	}
+	_lru_head = entry;
+}
+
+/**
+ * Removes a valid entry from its hash chain.
+ */
+void TarFSBlockCache::unlink_hash(Entry *entry)
+{
+	Entry **slot = &_buckets[entry->block & (_nr_entries - 1)];
+	while (*slot != entry) {
+		slot = &(*slot)->hash_next;
+	}
+	*slot = entry->hash_next;
+	entry->hash_next = NULL;
+}
+
+/**
+ * Caches a block that has just been read, recycling the least-recently-used entry.
+ * @param block The device block number.
+ * @param data The contents of the block.
+ * @return Returns the entry now holding the block.
+ */
+TarFSBlockCache::Entry *TarFSBlockCache::insert(unsigned int block, const uint8_t *data)
+{
+	Entry *entry = _lru_tail;
+	unlink_lru(entry);
+	if (entry->valid) {
+		unlink_hash(entry);
+	}
+
+	entry->block = block;
+	entry->valid = true;
+	memcpy(entry->data, data, _block_size);
+
+	Entry **bucket = &_buckets[block & (_nr_entries - 1)];
+	entry->hash_next = *bucket;
+	*bucket = entry;
+
+	push_lru(entry);
+	return entry;
+}
+
+/**
+ * Returns the contents of a device block if it is cached, and marks it most recently used.
+ * @param block The device block number.
+ * @return Returns a pointer to the block's contents, which stays valid until the next block
+ * is inserted, or NULL if the block is not cached.
+ */
+const uint8_t *TarFSBlockCache::find_block(unsigned int block)
+{
+	Entry *entry = lookup(block);
+	if (!entry) {
+		_nr_misses++;
+		return NULL;
+	}
+
+	unlink_lru(entry);
+	push_lru(entry);
+
+	_nr_hits++;
+	return entry->data;
+}
+
+/**
+ * Caches a run of blocks that have just been read from the device.  Blocks that are already
+ * cached are left alone.
+ * @param block The device block number of the first block.
+ * @param data The contents of the blocks.
+ * @param nr_blocks The number of blocks, which must not be more than the cache holds.
+ */
+void TarFSBlockCache::insert_blocks(unsigned int block, const uint8_t *data, unsigned int nr_blocks)
+{
+	// Cache the later blocks first, so the first block ends up most recently used.
+	for (unsigned int i = nr_blocks; i > 0; i--) {
+		if (!lookup(block + i - 1)) {
+			insert(block + i - 1, &data[(i - 1) * _block_size]);
+			_blocks_filled++;
+		}
+	}
+}
+
+/**
+ * Constructs a request queue over the given block device.
+ * @param block_device The device to read from.
+ * @param depth The number of requests that can be queued before the queue flushes itself.
+ * @param bounce_blocks The number of blocks in the bounce buffer, which bounds requests without
+ * a buffer of their own, and the runs they are merged into.
+ */
+TarFSRequestQueue::TarFSRequestQueue(BlockDevice& block_device, unsigned int depth, unsigned int bounce_blocks)
+: _block_device(block_device),
+_block_size(block_device.block_size()),
+_depth(depth),
+_bounce_blocks(bounce_blocks),
+_nr_pending(0),
+_nr_submitted(0),
+_nr_issued(0),
+_blocks_bounced(0)
+{
+	_pending = new Request[_depth];
+	_bounce = new uint8_t[_bounce_blocks * _block_size];
+}
+
+TarFSRequestQueue::~TarFSRequestQueue()
+{
+	delete[] _bounce;
+	delete[] _pending;
+}
+
+/**
+ * Queues a read of a run of device blocks.  Nothing is read until the queue is flushed, either
+ * explicitly or because it is full.
+ * @param block The device block number of the first block.
+ * @param nr_blocks The number of blocks to read.
+ * @param buffer The buffer to read the blocks into, or NULL to read them into the bounce buffer,
+ * in which case there must be no more of them than the bounce buffer holds.
+ * @param complete Called once the read has finished, with the context, a pointer to the data,
+ * and whether the read succeeded.  Data in the bounce buffer is only valid during the call.
+ * @param context Passed to the completion.
+ */
+void TarFSRequestQueue::submit(unsigned int block, unsigned int nr_blocks, uint8_t *buffer, Completion complete, void *context)
+{
+	if (_nr_pending == _depth) {
+		flush();
+	}
+
+	Request& request = _pending[_nr_pending++];
+	request.block = block;
+	request.nr_blocks = nr_blocks;
+	request.buffer = buffer;
+	request.complete = complete;
+	request.context = context;
+
+	_nr_submitted++;
+}
+
+/**
+ * Issues every queued request, and calls their completions.  The requests are sorted by block,
+ * and each run of requests for neighbouring blocks becomes a single device request: straight
+ * into the first request's buffer when the requests have contiguous buffers of their own, or
+ * through the bounce buffer when none of them has a buffer, as long as the run fits in it.  A
+ * request with its own buffer is never merged into a bounced run, as that would cost it a copy;
+ * it is issued on its own instead, next to its bounced neighbours.
+ */
+void TarFSRequestQueue::flush()
+{
+	for (unsigned int i = 1; i < _nr_pending; i++) {
+		Request request = _pending[i];
+
+		unsigned int j = i;
+		while (j > 0 && _pending[j - 1].block > request.block) {
+			_pending[j] = _pending[j - 1];
+			j--;
+		}
+		_pending[j] = request;
+	}
+
+	unsigned int first = 0;
+	while (first < _nr_pending) {
+		const Request& head = _pending[first];
+		unsigned int nr_blocks = head.nr_blocks;
+		bool direct = head.buffer != NULL;
+
+		unsigned int end = first + 1;
+		while (end < _nr_pending && _pending[end].block == head.block + nr_blocks) {
+			const Request& next = _pending[end];
+
+			if (direct) {
+				if (next.buffer != head.buffer + (size_t) nr_blocks * _block_size) {
+					break;
+				}
+			} else if (next.buffer || nr_blocks + next.nr_blocks > _bounce_blocks) {
+				break;
+			}
+
+			nr_blocks += next.nr_blocks;
+			end++;
+		}
+
+		issue(first, end, nr_blocks, direct);
+		first = end;
+	}
+
+	_nr_pending = 0;
+}
+
+/**
+ * Reads a run of queued requests from the device with a single request, and completes them.
+ * @param first The index of the first request in the run.
+ * @param end The index after the last request in the run.
+ * @param nr_blocks The total number of blocks the run covers.
+ * @param direct True if the requests have contiguous buffers, so the blocks can be read straight
+ * into them, or false if none of them has a buffer, so they go through the bounce buffer.
+ */
+void TarFSRequestQueue::issue(unsigned int first, unsigned int end, unsigned int nr_blocks, bool direct)
+{
+	uint8_t *target = direct ? _pending[first].buffer : _bounce;
+	bool success = _block_device.read_blocks(target, _pending[first].block, nr_blocks);
+
+	_nr_issued++;
+	if (!direct) {
+		_blocks_bounced += nr_blocks;
+	}
+
+	size_t offset = 0;
+	for (unsigned int i = first; i < end; i++) {
+		const Request& request = _pending[i];
+
+		if (request.complete) {
+			request.complete(request.context, &target[offset], success);
+		}
+
+		offset += (size_t) request.nr_blocks * _block_size;
+	}
+}
+
+namespace tarfs {
+	/**
+	 * The device reads queued by a single pread.  Blocks are copied out of the block cache where
+	 * possible, and the rest are queued on the file system's request queue, either straight into
+	 * the caller's buffer or into the cache.  Once the queue has been flushed, the batch knows
+	 * how much of the caller's buffer was filled.
+	 */
+	class TarFSReadBatch
+	{
+	public:
+		TarFSReadBatch(TarFS& owner)
+		: _queue(owner.request_queue()),
+		_cache(owner.block_cache()),
+		_stats(owner.stats()),
+		_block_size(owner.block_device().block_size()),
+		_nr_reads(0),
+		_failed_at((size_t) -1)
+		{
+		}
+
+		/**
+		 * Reads part of a block.  On a cache miss, the block is read into the cache.
+		 * @param block The device block number.
+		 * @param start The offset within the block to copy from.
+		 * @param out Where to copy to.
+		 * @param len The number of bytes to copy.
+		 * @param out_offset The offset of 'out' within the caller's buffer.
+		 */
+		void read_partial(unsigned int block, unsigned int start, uint8_t *out, size_t len, size_t out_offset)
+		{
+			const uint8_t *data = _cache.find_block(block);
+			if (data) {
+				memcpy(out, &data[start], len);
+				return;
+			}
+
+			queue(block, 1, NULL, true, start, out, len, out_offset);
+		}
+
+		/**
+		 * Reads whole blocks.  Blocks at the start of the range that are cached, as those read
+		 * ahead for a sequential reader are, are copied, and the rest are read straight into the
+		 * caller's buffer with a single request.  Cached blocks further on are read again, as
+		 * that's cheaper than splitting the request around them.
+		 * @param block The device block number of the first block.
+		 * @param nr_blocks The number of blocks.
+		 * @param out Where to read the blocks to.
+		 * @param out_offset The offset of 'out' within the caller's buffer.
+		 */
+		void read_whole(unsigned int block, unsigned int nr_blocks, uint8_t *out, size_t out_offset)
+		{
+			unsigned int i = 0;
+			while (i < nr_blocks) {
+				const uint8_t *data = _cache.find_block(block + i);
+				if (!data) {
+					break;
+				}
+
+				memcpy(&out[(size_t) i * _block_size], data, _block_size);
+				i++;
+			}
+
+			if (i < nr_blocks) {
+				uint8_t *rest = &out[(size_t) i * _block_size];
+				queue(block + i, nr_blocks - i, rest, false, 0, rest, (size_t) (nr_blocks - i) * _block_size, out_offset + (size_t) i * _block_size);
+
+				_stats.direct_reads++;
+				_stats.direct_blocks += nr_blocks - i;
+			}
+		}
+
+		/**
+		 * Reads blocks into the cache that nobody has asked for yet.
+		 * @param block The device block number of the first block.
+		 * @param nr_blocks The number of blocks, which is capped at the size of the bounce buffer.
+		 */
+		void read_ahead(unsigned int block, unsigned int nr_blocks)
+		{
+			if (nr_blocks > _queue.bounce_blocks()) {
+				nr_blocks = _queue.bounce_blocks();
+			}
+
+			queue(block, nr_blocks, NULL, true, 0, NULL, 0, 0);
+		}
+
+		/**
+		 * Issues everything that has been queued, and waits for it to complete.
+		 * @return Returns the offset in the caller's buffer of the first byte that couldn't be
+		 * read, or (size_t) -1 if every read succeeded.
+		 */
+		size_t finish()
+		{
+			_queue.flush();
+			_nr_reads = 0;
+
+			return _failed_at;
+		}
+
+	private:
+		struct Read {
+			TarFSReadBatch *batch;
+			unsigned int block, nr_blocks;
+			bool cache;
+			unsigned int start;
+			uint8_t *out;
+			size_t len, out_offset;
+		};
+
+		void queue(unsigned int block, unsigned int nr_blocks, uint8_t *buffer, bool cache, unsigned int start, uint8_t *out, size_t len, size_t out_offset)
+		{
+			// Reads are only tracked until the queue is flushed, so a full batch can start again
+			// once everything in it has completed.
+			if (_nr_reads == TARFS_QUEUE_DEPTH) {
+				finish();
+			}
+
+			Read& read = _reads[_nr_reads++];
+			read.batch = this;
+			read.block = block;
+			read.nr_blocks = nr_blocks;
+			read.cache = cache;
+			read.start = start;
+			read.out = out;
+			read.len = len;
+			read.out_offset = out_offset;
+
+			_queue.submit(block, nr_blocks, buffer, complete, &read);
+		}
+
+		static void complete(void *context, const uint8_t *data, bool success)
+		{
+			Read *read = (Read *) context;
+			TarFSReadBatch *batch = read->batch;
+
+			if (!success) {
+				if (read->out && read->out_offset < batch->_failed_at) {
+					batch->_failed_at = read->out_offset;
+				}
+				return;
+			}
+
+			if (read->cache) {
+				batch->_cache.insert_blocks(read->block, data, read->nr_blocks);
+			}
+
+			if (read->out && read->out != data) {
+				memcpy(read->out, &data[read->start], read->len);
+			}
+		}
+
+		TarFSRequestQueue& _queue;
+		TarFSBlockCache& _cache;
+		TarFSStats& _stats;
+		unsigned int _block_size;
+
+		Read _reads[TARFS_QUEUE_DEPTH];
+		unsigned int _nr_reads;
+		size_t _failed_at;
+	};
+}
+
+/**
+ * Reads the contents of the file into the buffer, from the specified file offset.
+ * @param buffer The buffer to read the data into.
+ * @param size The size of the buffer, and hence the number of bytes to read.
+ * @param off The offset within the file.
+ * @return Returns the number of bytes read into the buffer.
+ */
+int TarFSFile::pread(void* buffer, size_t size, off_t off)
+{
+	uint64_t file_size = this->size();
+
+	// Nothing to read if the buffer is empty, or the offset is at or past the end of the file.
+	if (size == 0 || off < 0 || (uint64_t) off >= file_size) return 0;
+
+	// If buffer size exceeds file size, adjust buffer size to read to EOF only
+	if (size > file_size - off) {
+		size = file_size - off;
+	}
+
+	UniqueLock<Mutex> l(_owner.lock());
+
+	TarFSStats& stats = _owner.stats();
+	stats.nr_preads++;
+	stats.pread_bytes += size;
+
+	unsigned int block_size = _owner.block_device().block_size();
+	unsigned int first_block = off / block_size;
+	unsigned int last_block = (off + size - 1) / block_size;
+	unsigned int nr_file_blocks = (file_size + block_size - 1) / block_size;
+
+	// Grow the read-ahead window while the file is being read sequentially, and drop it as soon
+	// as the reader jumps around, so that random reads don't pull in blocks nobody wants.
+	if (off == _ra_prev_end) {
+		_ra_window = _ra_window ? _ra_window * 2 : TARFS_READAHEAD_MIN;
+		if (_ra_window > TARFS_READAHEAD_MAX) {
+			_ra_window = TARFS_READAHEAD_MAX;
+		}
+	} else {
+		_ra_window = 0;
+	}
+	_ra_prev_end = off + size;
+
+	// A partial first or last block goes through the block cache.  Every block in between is
+	// wholly wanted by the caller, so those the cache doesn't have are read straight into the
+	// caller's buffer.  All of it is queued together, so that the request queue can merge it
+	// into as few device requests as possible.
+	uint8_t *out = (uint8_t *) buffer;
+	TarFSReadBatch batch(_owner);
+	unsigned int block = first_block;
+
+	unsigned int head = off % block_size;
+	if (head != 0 || size < block_size) {
+		size_t len = block_size - head;
+		if (len > size) {
+			len = size;
+		}
+
+		batch.read_partial(_file_start_block + block, head, out, len, 0);
+		block++;
+	}
+
+	// The first block that the request doesn't cover completely.
+	unsigned int partial_block = (off + size) / block_size;
+	if (block < partial_block) {
+		size_t copied = (uint64_t) block * block_size - off;
+		batch.read_whole(_file_start_block + block, partial_block - block, &out[copied], copied);
+		block = partial_block;
+	}
+
+	size_t copied = (uint64_t) block * block_size - off;
+	if (copied < size) {
+		batch.read_partial(_file_start_block + block, 0, &out[copied], size - copied, copied);
+	}
+
+	// Read ahead of a sequential reader in the same batch, so that the read-ahead can share a
+	// device request with the blocks being read now.
+	unsigned int ra_block = last_block + 1;
+	if (_ra_window && ra_block < nr_file_blocks && !_owner.block_cache().contains(_file_start_block + ra_block)) {
+		unsigned int nr_blocks = _ra_window;
+		if (nr_blocks > nr_file_blocks - ra_block) {
+			nr_blocks = nr_file_blocks - ra_block;
+		}
+
+		batch.read_ahead(_file_start_block + ra_block, nr_blocks);
+	}
+
+	size_t failed_at = batch.finish();
+	return failed_at < size ? failed_at : size;
+}
+
+/**
+ * Describes where the file's contents live on the device, from the given offset to the end of
+ * the file.  A member's data is stored contiguously, so this is always a single extent, and a
+ * pager can use it to read file pages straight from the device, or to share pages between
+ * everything that maps the same blocks.
+ * @param offset The file offset the extent should start at.
+ * @param extent Filled in with the extent.  Its first block is the one containing the offset.
+ * @return Returns true if the offset is within the file, or false otherwise.
+ */
+bool TarFSFile::extent(uint64_t offset, TarFSExtent& extent) const
+{
+	if (offset >= size()) {
+		return false;
+	}
+
+	unsigned int block_size = _owner.block_device().block_size();
+	unsigned int first_block = offset / block_size;
+	unsigned int nr_file_blocks = (size() + block_size - 1) / block_size;
+
+	extent.device_block = _file_start_block + first_block;
+	extent.nr_blocks = nr_file_blocks - first_block;
+	extent.offset_in_block = offset % block_size;
+	extent.length = size() - offset;
+
+	return true;
+}
+
+/**
+ * Records whether a page fill's device read succeeded.
+ */
+static void complete_page_fill(void *context, const uint8_t *data, bool success)
+{
+	*(bool *) context = success;
+}
+
+/**
+ * Fills whole pages with the file's contents, for a pager that maps the file rather than
+ * reading it through pread.  The pages are filled by a single device read straight into
+ * them, bypassing the block cache, and anything past the end of the file is zeroed.
+ * @param offset The file offset of the first page, which must be page-aligned.
+ * @param pages The memory to fill.
+ * @param nr_pages The number of pages to fill.
+ * @return Returns the number of bytes of file data in the pages, or -1 if the offset is not
+ * page-aligned or the device read failed.
+ */
+int64_t TarFSFile::read_pages(uint64_t offset, void *pages, unsigned int nr_pages)
+{
+	unsigned int block_size = _owner.block_device().block_size();
+	if (offset % TARFS_PAGE_SIZE != 0 || TARFS_PAGE_SIZE % block_size != 0) {
+		return -1;
+	}
+
+	uint8_t *out = (uint8_t *) pages;
+	size_t length = (size_t) nr_pages * TARFS_PAGE_SIZE;
+	size_t valid = 0;
+
+	TarFSExtent ext;
+	if (extent(offset, ext)) {
+		UniqueLock<Mutex> l(_owner.lock());
+
+		valid = ext.length < length ? ext.length : length;
+
+		// Only read blocks that belong to this member, even if the pages go past its end.
+		unsigned int nr_blocks = (valid + block_size - 1) / block_size;
+
+		bool success = false;
+		TarFSRequestQueue& queue = _owner.request_queue();
+		queue.submit(ext.device_block, nr_blocks, out, complete_page_fill, &success);
+		queue.flush();
+
+		if (!success) {
+			return -1;
+		}
+
+		_owner.stats().page_fills++;
+		_owner.stats().page_fill_blocks += nr_blocks;
+	}
+
+	memset(&out[valid], 0, length - valid);
+	return valid;
+}
+
+/**
+ * Attributes of a member that come from the extended headers before it, rather than from its
+ * own header: a GNU long name, or PAX records.
+ */
+struct TarFSExtendedAttributes
+{
+	char *path;
+	size_t path_len;
+	bool has_size;
+	uint64_t size;
+	bool has_mtime;
+	uint64_t mtime;
+
+	TarFSExtendedAttributes() : path(NULL), path_len(0), has_size(false), size(0), has_mtime(false), mtime(0) { }
+	~TarFSExtendedAttributes() { delete[] path; }
+
+	void set_path(const char *value, size_t len)
+	{
+		delete[] path;
+		path = new char[len + 1];
+		memcpy(path, value, len);
+		path[len] = 0;
+		path_len = len;
+	}
+
+	void clear()
+	{
+		delete[] path;
+		path = NULL;
+		path_len = 0;
+		has_size = false;
+		has_mtime = false;
+	}
+};
+
+/**
+ * Parses the leading decimal digits of a PAX value.  Anything from the first non-digit on,
+ * such as the fractional part of a timestamp, is ignored.
+ * @param value The value.
+ * @param len The length of the value.
+ * @param result Set to the number.
+ * @return Returns true if there was at least one digit, and the number fits in 64 bits.
+ */
+static bool parse_pax_decimal(const char *value, size_t len, uint64_t& result)
+{
+	size_t i = 0;
+	result = 0;
+
+	while (i < len && value[i] >= '0' && value[i] <= '9') {
+		uint64_t digit = value[i++] - '0';
+		if (result > (~0ull - digit) / 10) {
+			return false;
+		}
+
+		result = result * 10 + digit;
+	}
+
+	return i > 0;
+}
+
+/**
+ * Parses the records of a PAX extended header.  Each record is "<length> <key>=<value>\n",
+ * where the length counts the whole record.  The path, size and mtime keys are used, and
+ * any others are ignored.
+ * @param data The data of the extended header member.
+ * @param len The length of the data.
+ * @param attributes The attributes to update.
+ * @return Returns true if the records were well formed, or false otherwise.
+ */
+static bool parse_pax_records(const char *data, size_t len, TarFSExtendedAttributes& attributes)
+{
+	size_t pos = 0;
+	while (pos < len && data[pos] != 0) {
+		size_t i = pos;
+		uint64_t record_len = 0;
+		while (i < len && data[i] >= '0' && data[i] <= '9') {
+			record_len = record_len * 10 + (data[i++] - '0');
+			if (record_len > len) {
+				return false;
+			}
+		}
+
+		if (i >= len || data[i] != ' ' || record_len <= i - pos || record_len > len - pos || data[pos + record_len - 1] != '\n') {
+			return false;
+		}
+
+		const char *key = &data[i + 1];
+		const char *end = &data[pos + record_len - 1];
+
+		const char *eq = key;
+		while (eq < end && *eq != '=') eq++;
+		if (eq == end) {
+			return false;
+		}
+
+		size_t key_len = eq - key;
+		const char *value = eq + 1;
+		size_t value_len = end - value;
+
+		if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+			attributes.set_path(value, value_len);
+		} else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+			attributes.has_size = parse_pax_decimal(value, value_len, attributes.size);
+		} else if (key_len == 5 && memcmp(key, "mtime", 5) == 0) {
+			attributes.has_mtime = parse_pax_decimal(value, value_len, attributes.mtime);
+		}
+
+		pos += record_len;
+	}
+
+	return true;
+}
+
+/**
+ * Reads blocks from the start of a TAR file for the mount-time header scan, in batches sized
+ * by how far apart the headers turn out to be.  A header that lands inside the current batch
+ * doubles the next batch, up to the largest size, so that runs of empty and tiny members cost
+ * one device request.  A header beyond the end of the batch means the data in between was
+ * skipped, and the next batch drops back to a couple of blocks, so that members with more
+ * data than that only cost their header, at the price of a request each.
+ */
+class TarFSHeaderScanner
+{
+public:
+	TarFSHeaderScanner(BlockDevice& block_device, unsigned int min_batch, unsigned int max_batch)
+	: _block_device(block_device),
+	_block_size(block_device.block_size()),
+	_min_batch(min_batch),
+	_max_batch(max_batch),
+	_batch_blocks(min_batch),
+	_start(0),
+	_count(0),
+	_landed_inside(false),
+	_nr_reads(0),
+	_bytes_read(0)
+	{
+		_buffer = new uint8_t[_max_batch * _block_size];
+	}
+
+	~TarFSHeaderScanner()
+	{
+		delete[] _buffer;
+	}
+
+	/**
+	 * Returns the contents of the given block, reading a new batch starting at that block if it
+	 * is not in the current one, and resizing the next batch by where the block lies.  Blocks
+	 * asked for in order, such as the data of an extended header, count as landing inside.
+	 * The returned pointer is only valid until the next call.
+	 * @param block The device block number.
+	 * @return Returns a pointer to the block's contents, or NULL if the device read failed.
+	 */
+	const uint8_t *block(unsigned int block)
+	{
+		if (block >= _block_device.block_count()) {
+			return NULL;
+		}
+
+		if (block >= _start && block < _start + _count) {
+			if (block > _start && !_landed_inside) {
+				_landed_inside = true;
+				grow_batch();
+			}
+		} else {
+			if (_count && block > _start + _count) {
+				_batch_blocks = _min_batch;
+			} else if (_count && block == _start + _count) {
+				grow_batch();
+			}
+
+			unsigned int count = _batch_blocks;
+			if (count > _block_device.block_count() - block) {
+				count = _block_device.block_count() - block;
+			}
+
+			_start = block;
+			_count = 0;
+			_landed_inside = false;
+
+			if (!_block_device.read_blocks(_buffer, block, count)) {
+				return NULL;
+			}
+
+			_count = count;
+			_nr_reads++;
+			_bytes_read += (uint64_t) count * _block_size;
+		}
+
+		return &_buffer[(block - _start) * _block_size];
+	}
+
+	/**
+	 * Copies member data that starts at the given block out of the archive.
+	 * @param block The device block number the data starts at.
+	 * @param size The number of bytes to copy.
+	 * @param out The buffer to copy into.
+	 * @return Returns true if the data was read, or false if a device read failed.
+	 */
+	bool read(unsigned int block, size_t size, char *out)
+	{
+		while (size > 0) {
+			const uint8_t *data = this->block(block++);
+			if (!data) {
+				return false;
+			}
+
+			size_t len = size < _block_size ? size : _block_size;
+			memcpy(out, data, len);
+
+			out += len;
+			size -= len;
+		}
+
+		return true;
+	}
+
+	unsigned int nr_reads() const { return _nr_reads; }
+	uint64_t bytes_read() const { return _bytes_read; }
+
+private:
+	void grow_batch()
+	{
+		_batch_blocks *= 2;
+		if (_batch_blocks > _max_batch) {
+			_batch_blocks = _max_batch;
+		}
+	}
+
+	BlockDevice& _block_device;
+	unsigned int _block_size;
+	unsigned int _min_batch, _max_batch;
+	// The size of the next batch to be read.
+	unsigned int _batch_blocks;
+
+	uint8_t *_buffer;
+	unsigned int _start, _count;
+	// Whether anything past the first block of the current batch has been asked for, which
+	// grows the next batch once.
+	bool _landed_inside;
+
+	unsigned int _nr_reads;
+	uint64_t _bytes_read;
+};
+
+/**
+ * Appends an entry to the mount's entry table.  The path is normalised on the way in,
+ * so that it has no leading, trailing or repeated slashes, and no "." components.
+ * @param path The path of the entry, as stored in the archive.
+ * @param max_len The longest the path can be, if it isn't NUL-terminated before then.
+ * @param metadata The entry's metadata, parsed from its header.
+ */
+void TarFS::add_entry(const char *path, size_t max_len, const TarFSMetadata& metadata)
+{
+	size_t len = strnlen(path, max_len);
+
+	// Grow the path pool and the entry table by doubling, so that appending is cheap.
+	if (_paths_size + len + 1 > _paths_capacity) {
+		size_t capacity = _paths_capacity ? _paths_capacity : TARFS_PATHS_INITIAL;
+		while (capacity < _paths_size + len + 1) {
+			capacity *= 2;
+		}
+
+		char *paths = new char[capacity];
+		memcpy(paths, _paths, _paths_size);
+		delete[] _paths;
+
+		_paths = paths;
+		_paths_capacity = capacity;
+	}
+
+	if (_nr_entries == _max_entries) {
+		unsigned int max_entries = _max_entries ? _max_entries * 2 : TARFS_ENTRIES_INITIAL;
+
+		TarFSEntry *entries = new TarFSEntry[max_entries];
+		memcpy(entries, _entries, _nr_entries * sizeof(*entries));
+		delete[] _entries;
+
+		_entries = entries;
+		_max_entries = max_entries;
+	}
+
+	char *out = &_paths[_paths_size];
+	size_t out_len = 0;
+
+	size_t i = 0;
+	while (i < len) {
+		while (i < len && path[i] == '/') i++;
+
+		size_t start = i;
+		while (i < len && path[i] != '/') i++;
+
+		size_t component_len = i - start;
+		if (component_len == 0 || (component_len == 1 && path[start] == '.')) {
+			continue;
+		}
+
+		if (out_len) {
+			out[out_len++] = '/';
+		}
+
+		memcpy(&out[out_len], &path[start], component_len);
+		out_len += component_len;
+	}
+
+	// An entry for the root directory itself tells us nothing.
+	if (out_len == 0) {
+		return;
+	}
+
+	out[out_len] = 0;
+
+	TarFSEntry& entry = _entries[_nr_entries++];
+	entry.path_offset = _paths_size;
+	entry.metadata = metadata;
+
+	_paths_size += out_len + 1;
+	if (out_len > _max_path_len) {
+		_max_path_len = out_len;
+	}
+}
+
+/**
+ * Determines whether one entry sorts before another: by path, and then in archive order,
+ * so that when a path appears more than once, the last occurrence sorts last.
+ */
+bool TarFS::entry_before(const TarFSEntry& a, const TarFSEntry& b) const
+{
+	int cmp = strcmp(&_paths[a.path_offset], &_paths[b.path_offset]);
+	return cmp < 0 || (cmp == 0 && a.path_offset < b.path_offset);
+}
+
 /**
- * TAR files contain header data encoded as octal values in ASCII.  This function
- * converts this terrible representation into a real unsigned integer.
- *
- * You DO NOT need to modify this function.
- *
- * @param data The (null-terminated) ASCII data containing an octal number.
- * @return Returns an unsigned integer number, corresponding to the input data.
+ * Sorts the entry table by path, with an in-place heapsort.  Tables that are already in
+ * order, such as those loaded from an index, are left alone.
  */
-static inline unsigned int octal2ui(const char *data)
+void TarFS::sort_entries()
 {
-	// Current working value.
-	unsigned int value = 0;
+	unsigned int i;
+	for (i = 1; i < _nr_entries; i++) {
+		if (entry_before(_entries[i], _entries[i - 1])) {
+			break;
+		}
+	}
 
-	// Length of the input data.
-	int len = strlen(data);
+	if (i >= _nr_entries) {
+		return;
+	}
 
-	// Starting at i = 1, with a factor of one.
-	int i = 1, factor = 1;
-	while (i < len) {
-		// Extract the current character we're working on (backwards from the end).
-		char ch = data[len - i];
+	// Build a max-heap, then repeatedly move the largest remaining entry to the end.
+	for (unsigned int start = _nr_entries / 2; start-- > 0;) {
+		sift_down(start, _nr_entries);
+	}
 
-		// Add the value of the character, multipled by the factor, to
-		// the working value.
-		value += factor * (ch - '0');
+	for (unsigned int end = _nr_entries - 1; end > 0; end--) {
+		TarFSEntry tmp = _entries[0];
+		_entries[0] = _entries[end];
+		_entries[end] = tmp;
 
-		// Increment the factor by multiplying it by eight.
-		factor *= 8;
+		sift_down(0, end);
+	}
+}
 
-		// Increment the current character position.
-		i++;
+/**
+ * Restores the heap property for the subtree rooted at the given entry.
+ * @param root The index of the subtree's root.
+ * @param end The number of entries in the heap.
+ */
+void TarFS::sift_down(unsigned int root, unsigned int end)
+{
+	while (2 * root + 1 < end) {
+		unsigned int child = 2 * root + 1;
+		if (child + 1 < end && entry_before(_entries[child], _entries[child + 1])) {
+			child++;
+		}
+
+		if (!entry_before(_entries[root], _entries[child])) {
+			return;
+		}
+
+		TarFSEntry tmp = _entries[root];
+		_entries[root] = _entries[child];
+		_entries[child] = tmp;
+
+		root = child;
+	}
+}
+
+/**
+ * Finds the first entry whose path does not sort before the given key.
+ * @param key The NUL-terminated path to search for.
+ * @return Returns the index of the entry, or the number of entries if there is none.
+ */
+unsigned int TarFS::lower_bound(const char *key) const
+{
+	unsigned int lo = 0, hi = _nr_entries;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (strcmp(entry_path(mid), key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
 
-	// Return the current working value.
-	return value;
+	return lo;
 }
 
-// The structure that represents the header block present in
-// TAR files.  A header block occurs before every file, this
-// this structure must EXACTLY match the layout as described
-// in the TAR file format description.
-namespace tarfs {
-	struct posix_header {         /* byte offset */
-  	char name[100];               /*   0 */
-  	char mode[8];                 /* 100 */
-  	char uid[8];                  /* 108 */
-  	char gid[8];                  /* 116 */
-  	char size[12];                /* 124 */
-  	char mtime[12];               /* 136 */
-  	char chksum[8];               /* 148 */
-  	char typeflag;                /* 156 */
-  	char linkname[100];           /* 157 */
-  	char magic[6];                /* 257 */
-  	char version[2];              /* 263 */
-  	char uname[32];               /* 265 */
-  	char gname[32];               /* 297 */
-  	char devmajor[8];             /* 329 */
-  	char devminor[8];             /* 337 */
-  	char prefix[155];             /* 345 */
-                                  /* 500 */
-	} __packed;
+/**
+ * Looks up a child of a directory node in the entry table, and creates a node for it.
+ * A child with an entry of its own takes its metadata from the entry, and a child that
+ * only appears as part of longer paths becomes a plain directory.  The caller must hold
+ * the mount's lock.
+ * @param parent The directory node.
+ * @param name The name of the child.
+ * @return Returns the new child node, or NULL if the directory has no such child.
+ */
+TarFSNode *TarFS::resolve_child(TarFSNode *parent, const String& name)
+{
+	size_t parent_len = parent->path_len();
+	size_t name_len = name.length();
+
+	// Build the child's full path, with room for a trailing slash.
+	char *key = new char[parent_len + name_len + 3];
+	size_t key_len = 0;
+
+	if (parent_len) {
+		memcpy(key, entry_path(parent->path_entry()), parent_len);
+		key[parent_len] = '/';
+		key_len = parent_len + 1;
+	}
+
+	memcpy(&key[key_len], name.c_str(), name_len);
+	key_len += name_len;
+	key[key_len] = 0;
+
+	TarFSNode *child = NULL;
+
+	unsigned int idx = lower_bound(key);
+	if (idx < _nr_entries && strcmp(entry_path(idx), key) == 0) {
+		// If the path appears more than once, the last occurrence wins, as it would when
+		// the archive is extracted.
+		while (idx + 1 < _nr_entries && strcmp(entry_path(idx + 1), key) == 0) {
+			idx++;
+		}
+
+		child = new (_arena) TarFSNode(parent, name, idx, key_len, *this);
+		_nr_nodes++;
+		child->set_metadata(_entries[idx].metadata);
+	} else {
+		key[key_len] = '/';
+		key[key_len + 1] = 0;
+
+		idx = lower_bound(key);
+		if (idx < _nr_entries && strncmp(entry_path(idx), key, key_len + 1) == 0) {
+			child = new (_arena) TarFSNode(parent, name, idx, key_len, *this);
+			_nr_nodes++;
+		}
+	}
+
+	delete[] key;
+
+	if (child) {
+		parent->add_child(child);
+	}
+
+	return child;
 }
 
 /**
- * Reads the contents of the file into the buffer, from the specified file offset.
- * @param buffer The buffer to read the data into.
- * @param size The size of the buffer, and hence the number of bytes to read.
- * @param off The offset within the file.
- * @return Returns the number of bytes read into the buffer.
+ * Starts a listing of a directory node's children from the entry table.  The children's paths
+ * all start with the directory's path and a slash, so they sort together, after that prefix.
+ * @param parent The directory node.
+ * @param listing Filled in with the position of the first child.  Its key is released by
+ * end_listing.
  */
-int TarFSFile::pread(void* buffer, size_t size, off_t off)
+void TarFS::begin_listing(const TarFSNode *parent, TarFSListing& listing) const
 {
-    if (off >= this->size()) return 0;
-	// If either the buffer, or the file we want to read are empty, return 0 bytes read
-	if(size == 0 || this->size() == 0) return 0;
-	unsigned int idx_last = off + size;
-	unsigned int block_size = _owner.block_device().block_size();
-	// If buffer size exceeds file size, adjust buffer size to read to EOF only
-	if (this->size() < idx_last) {
-		idx_last = this->size();
-	}
-	// Identify which block precedes the block containing the offset byte, store in pre_block
-	unsigned int pre_block = 0;
- 	for (unsigned int i = 0; i*block_size < off; i++) {
-		pre_block = i;
-	}
-	// Initialise for return
-	int bytes_read = 0;
-	// cast buffer from void to uint8_t pointer and create temporary buffers
-	uint8_t * byte_buffer = (uint8_t *) buffer;
-	uint8_t * temp_buffer = new uint8_t[block_size];
-
-	// Read file into a temporary buffer block by block
-	for (int i = pre_block; i*block_size < idx_last; ++i) {
-		_owner.block_device().read_blocks(temp_buffer, _file_start_block + i, 1);
-		unsigned int range = i*block_size;
-		// iterate over bytes within each block
-		for (unsigned int j=0; j < block_size; ++j) {
-			// check we satisfy buffer size and offset constraints before reading
-			if(off <= range + j && range + j < idx_last) {
-				byte_buffer[bytes_read] = temp_buffer[j];
-	            ++bytes_read;
+	size_t parent_len = parent->path_len();
+
+	// The key holds the prefix, with room for any child's name and two more characters after it.
+	listing.key = new char[_max_path_len + 3];
+	listing.prefix_len = 0;
+
+	if (parent_len) {
+		memcpy(listing.key, entry_path(parent->path_entry()), parent_len);
+		listing.key[parent_len] = '/';
+		listing.prefix_len = parent_len + 1;
+	}
+
+	listing.key[listing.prefix_len] = 0;
+	listing.next = lower_bound(listing.key);
+}
+
+void TarFS::end_listing(TarFSListing& listing) const
+{
+	delete[] listing.key;
+	listing.key = NULL;
+}
+
+/**
+ * Reads the next child of a listing.  A child's own entry sorts straight after its name, but
+ * the entries below it only sort after "name/", and siblings such as "name.txt" can come in
+ * between, so each subtree is skipped in one search when it is reached, and only listed there
+ * if the child has no entry of its own.
+ * @param listing The listing, which is advanced past the child.
+ * @param entry Filled in with the child's name and size.
+ * @return Returns true if there was another child, or false at the end of the directory.
+ */
+bool TarFS::next_child(TarFSListing& listing, DirectoryEntry& entry) const
+{
+	char *key = listing.key;
+	size_t prefix_len = listing.prefix_len;
+
+	while (listing.next < _nr_entries) {
+		const char *path = entry_path(listing.next);
+		if (strncmp(path, key, prefix_len) != 0) {
+			listing.next = _nr_entries;
+			break;
+		}
+
+		const char *name = &path[prefix_len];
+		const char *slash = strchr(name, '/');
+
+		if (!slash) {
+			// If the path appears more than once, the last occurrence wins, as in resolve_child.
+			unsigned int idx = listing.next;
+			while (idx + 1 < _nr_entries && strcmp(entry_path(idx + 1), path) == 0) {
+				idx++;
 			}
+
+			entry.name = String(name, strlen(name));
+			entry.size = _entries[idx].metadata.size;
+
+			listing.next = idx + 1;
+			return true;
+		}
+
+		// This entry is below a child.  Its subtree ends before "name0", as '0' follows '/'.
+		size_t name_len = slash - name;
+		memcpy(&key[prefix_len], name, name_len);
+		key[prefix_len + name_len] = 0;
+
+		unsigned int own = lower_bound(key);
+		bool listed = own < _nr_entries && strcmp(entry_path(own), key) == 0;
+
+		key[prefix_len + name_len] = '0';
+		key[prefix_len + name_len + 1] = 0;
+		listing.next = lower_bound(key);
+
+		if (!listed) {
+			entry.name = String(name, name_len);
+			entry.size = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Creates nodes for every child of a directory node that doesn't have one yet.  Afterwards,
+ * the node's children map is complete.  The caller must hold the mount's lock.
+ * @param parent The directory node.
+ */
+void TarFS::materialize_children(TarFSNode *parent)
+{
+	TarFSListing listing;
+	begin_listing(parent, listing);
+
+	DirectoryEntry entry;
+	while (next_child(listing, entry)) {
+		parent->lookup_child(entry.name);
+	}
+
+	end_listing(listing);
+
+	parent->materialized(true);
+}
+
+/**
+ * Creates nodes for the whole tree below the given node.
+ * @param node The node to start from.
+ */
+void TarFS::materialize_tree(TarFSNode *node)
+{
+	materialize_children(node);
+
+	for (TarFSNode *child = node->first_child(); child; child = child->next_sibling()) {
+		materialize_tree(child);
+	}
+}
+
+/**
+ * Logs the I/O statistics of this mount: how many device requests, and how many blocks,
+ * each kind of operation has cost, and how well the caches are doing.
+ */
+void TarFS::dump_stats() const
+{
+	syslog.messagef(LogLevel::INFO, "tarfs: mount: %u requests, %lu blocks", _stats.mount_reads, _stats.mount_blocks);
+	syslog.messagef(LogLevel::INFO, "tarfs: pread: %lu calls, %lu bytes", _stats.nr_preads, _stats.pread_bytes);
+	syslog.messagef(LogLevel::INFO, "tarfs:   cached: %lu hits, %lu misses, %lu blocks filled",
+		_block_cache.nr_hits(), _block_cache.nr_misses(), _block_cache.blocks_filled());
+	syslog.messagef(LogLevel::INFO, "tarfs:   direct: %lu requests, %lu blocks", _stats.direct_reads, _stats.direct_blocks);
+	syslog.messagef(LogLevel::INFO, "tarfs: queue: %lu reads submitted, %lu device requests, %lu blocks bounced",
+		_request_queue.nr_submitted(), _request_queue.nr_issued(), _request_queue.blocks_bounced());
+	syslog.messagef(LogLevel::INFO, "tarfs: page fills: %lu requests, %lu blocks", _stats.page_fills, _stats.page_fill_blocks);
+	syslog.messagef(LogLevel::INFO, "tarfs: opendir: %lu, %u nodes created", _stats.nr_opendirs, _nr_nodes);
+}
+
+/**
+ * Destroys every node in the tree below, and including, the given node.  Their memory
+ * belongs to the arena, and is freed with it.
+ * @param node The node to start from.
+ */
+void TarFS::destroy_tree(TarFSNode *node)
+{
+	TarFSNode *child = node->first_child();
+	while (child) {
+		TarFSNode *next = child->next_sibling();
+		destroy_tree(child);
+		child = next;
+	}
+
+	node->~TarFSNode();
+}
+
+/**
+ * Logs how much memory the tree takes in the arena, next to what the same objects
+ * would have taken as separate heap allocations, at TARFS_HEAP_OVERHEAD bytes of
+ * allocator bookkeeping each.
+ */
+void TarFS::log_footprint() const
+{
+	size_t heap_bytes = _arena.bytes_requested() + (size_t) _arena.nr_allocs() * TARFS_HEAP_OVERHEAD;
+
+	syslog.messagef(LogLevel::DEBUG, "tarfs: %u nodes in %lu bytes of arena (%u chunks, %lu reserved), vs ~%lu bytes in %u heap allocations",
+		_nr_nodes, (uint64_t) _arena.bytes_requested(), _arena.nr_chunks(), (uint64_t) _arena.bytes_reserved(),
+		(uint64_t) heap_bytes, _arena.nr_allocs());
+}
+
+/**
+ * Adds the entries listed in the index member at the start of the archive to the entry
+ * table, with a single read of the index data.  Nothing is added unless the whole index is
+ * valid.
+ * @param nr_index_blocks The number of data blocks of the index member.
+ * @return Returns true if the entries were loaded from the index, or false if the index
+ * could not be read or is malformed.
+ */
+bool TarFS::load_index(unsigned int nr_index_blocks)
+{
+	unsigned int block_size = block_device().block_size();
+	size_t nr_blocks = block_device().block_count();
+
+	if (nr_index_blocks == 0 || nr_index_blocks >= nr_blocks) {
+		return false;
+	}
+
+	size_t index_size = (size_t) nr_index_blocks * block_size;
+	uint8_t *buffer = new uint8_t[index_size];
+	if (!block_device().read_blocks(buffer, 1, nr_index_blocks)) {
+		delete[] buffer;
+		return false;
+	}
+
+	_stats.mount_reads++;
+	_stats.mount_blocks += nr_index_blocks;
+
+	const struct tarfs_index_header *index = (const struct tarfs_index_header *) buffer;
+	const struct tarfs_index_entry *entries = (const struct tarfs_index_entry *) &index[1];
+	const char *strtab = (const char *) &entries[index->nr_entries];
+
+	// Check that the index is the version we understand, that its tables fit in the member,
+	// and that the path table is terminated, before trusting any of it.
+	bool valid = memcmp(index->magic, TARFS_INDEX_MAGIC, sizeof(index->magic)) == 0
+		&& index->version == TARFS_INDEX_VERSION
+		&& index->nr_entries <= (index_size - sizeof(*index)) / sizeof(*entries)
+		&& index->strtab_size > 0
+		&& index->strtab_size <= index_size - sizeof(*index) - index->nr_entries * sizeof(*entries)
+		&& strtab[index->strtab_size - 1] == 0;
+
+	// Every entry's header, and the data after it, must lie within the archive.
+	for (unsigned int i = 0; valid && i < index->nr_entries; i++) {
+		uint64_t data_blocks = entries[i].size / block_size + (entries[i].size % block_size != 0);
+		valid = entries[i].name_offset < index->strtab_size
+			&& entries[i].header_block < nr_blocks
+			&& data_blocks < nr_blocks - entries[i].header_block;
+	}
+
+	if (valid) {
+		for (unsigned int i = 0; i < index->nr_entries; i++) {
+			TarFSMetadata metadata;
+			metadata.size = entries[i].size;
+			metadata.mode = entries[i].mode;
+			metadata.mtime = entries[i].mtime;
+			metadata.type = entries[i].typeflag;
+			metadata.data_block = entries[i].header_block + 1;
+
+			add_entry(&strtab[entries[i].name_offset], index->strtab_size - entries[i].name_offset, metadata);
 		}
 	}
-	return bytes_read;
+
+	delete[] buffer;
+	return valid;
 }
 
 /**
  * Reads all the file headers in the TAR file, and builds an in-memory
  * representation.
- * @return Returns the root TarFSNode that corresponds to the TAR file structure.
+ * @return Returns the root TarFSNode that corresponds to the TAR file structure, or NULL
+ * if the image can't be mounted.
  */
 TarFSNode* TarFS::build_tree()
 {
-	// Create the root node.
-	TarFSNode *root = new TarFSNode(NULL, "", *this);
-    unsigned int block_size = block_device().block_size();
-    // store header and  block succeeding header block to check if we have reached two 0 blocks indicating EOF
-    struct posix_header *header = (struct posix_header *) new char[block_size];
-    uint8_t * succ = new uint8_t[block_size];
-    // syslog.messagef(LogLevel::DEBUG, "Block Device nr-blocks=%lu", nr_blocks);
-    size_t nr_blocks = block_device().block_count();
-    unsigned int current_block = 0;
-    TarFSNode * parent;
-
-    // reads blocks in pairs into buffers, gets names
-    // then depth first builds parent child links, for all files in TAR file
-    while(current_block < nr_blocks) {
-        // read blocks in pairs to later check zero blocks
-        // use zero checks to check whether we are at the end of the TAR file
-        block_device().read_blocks(header, current_block, 1);
-        block_device().read_blocks(succ, current_block + 1, 1);
-        if (is_zero_block((uint8_t*) header) && is_zero_block(succ)) {
-            return root;
-        }
-        // get file size from header and  number of blocks needed to store it
-        unsigned int size = octal2ui(header->size);
-        unsigned int blocks_needed = (size % block_size == 0) ? size/block_size : (size/block_size)+1;
-        // Get file path, split and store path name components
-        parent = root;
-        String full_path = String(header->name);
-        List<String> pnc = full_path.split('/', true);
-        // Iterate through components, checking child lists
-        int element = 0;
-        int pnc_count = pnc.count();
-        while(element < pnc_count) {
-
-            // If current element is in this parent's child list, assign parent to child
-            if(parent->get_child(pnc.at(element))) {
-                parent = (TarFSNode*) (parent->get_child(pnc.at(element)));
-                ++element;
-            }
-            else {
-                // otherwise, create a new child, traversing tree depth first
-                TarFSNode *child = new TarFSNode(parent, pnc.at(element), *this);
-                parent->add_child(pnc.at(element), child);
-                if (element == pnc_count - 1) {
-                    child->set_block_offset(current_block);
-                    // store file size, will return 0 if leaf is a directory
-                    child->size(octal2ui(header->size));
-                }
-                ++element;
-            }
-        }
-        // updated current block index with number of blocks used by this file +1 for the header block
-        current_block += blocks_needed + 1;
-    }
+	uint64_t start_cycles = __builtin_ia32_rdtsc();
+
+	unsigned int block_size = block_device().block_size();
+	size_t nr_blocks = block_device().block_count();
+	bool from_index = false;
+
+	// Members are located by device block, so each block has to be exactly one tar record.
+	if (block_size != TAR_BLOCK_SIZE) {
+		syslog.messagef(LogLevel::ERROR, "tarfs: device has %u-byte blocks, but only %u-byte blocks are supported", block_size, TAR_BLOCK_SIZE);
+		return NULL;
+	}
+
+	TarFSHeaderScanner scanner(block_device(), TARFS_SCAN_BATCH_MIN, TARFS_SCAN_BATCH);
+
+	// Attributes from extended headers, for the next entry only, and for every entry after a
+	// PAX global header.
+	TarFSExtendedAttributes next, global;
+
+	unsigned int current_block = 0;
+	while (current_block < nr_blocks) {
+		const struct posix_header *header = (const struct posix_header *) scanner.block(current_block);
+		if (!header) {
+			break;
+		}
+
+		// A compressed image can't be read in place, and would otherwise just look like a
+		// corrupt archive.  gzip images are mounted through a TarFSGzipDevice instead, by
+		// tarfs_create.  Only a first block that isn't a valid header is sniffed, as a
+		// member's name can begin with the same bytes as a compression format's magic.
+		const char *compression = NULL;
+		if (current_block == 0 && !tar_verify_checksum((const uint8_t *) header)) {
+			compression = tar_compression_format((const uint8_t *) header);
+		}
+		if (compression) {
+			syslog.messagef(LogLevel::ERROR, "tarfs: image is %s-compressed, which is not supported", compression);
+			return NULL;
+		}
+
+		// The archive ends with two zero blocks.  A lone zero block is skipped, and the block
+		// after it is only looked at when it's needed.
+		if (tar_is_zero_block((const uint8_t *) header, block_size)) {
+			const uint8_t *next = (current_block + 1 < nr_blocks) ? scanner.block(current_block + 1) : NULL;
+			if (!next || tar_is_zero_block(next, block_size)) {
+				break;
+			}
+
+			current_block++;
+			continue;
+		}
+
+		// A header that fails its checksum means the archive is corrupt from here on, so keep
+		// what has been found so far and stop.
+		uint64_t size;
+		if (!tar_verify_checksum((const uint8_t *) header) || !tar_parse_number(header->size, sizeof(header->size), size)) {
+			syslog.messagef(LogLevel::WARNING, "tarfs: corrupt header at block %u, ignoring the rest of the archive", current_block);
+			break;
+		}
+
+		// Get number of blocks needed to store the file
+		uint64_t blocks_needed = (size + block_size - 1) / block_size;
+		if (blocks_needed >= nr_blocks - current_block) {
+			break;
+		}
+
+		// An index member at the start of the archive is used instead of scanning.  If it
+		// turns out to be unusable, the scan carries on, but the index is still kept out of
+		// the tree.
+		if (current_block == 0 && strncmp(header->name, TARFS_INDEX_NAME, sizeof(header->name)) == 0) {
+			if (load_index((unsigned int) blocks_needed)) {
+				from_index = true;
+				break;
+			}
+
+			syslog.messagef(LogLevel::WARNING, "tarfs: ignoring invalid index, scanning archive");
+			current_block += blocks_needed + 1;
+			continue;
+		}
+
+		char type = header->typeflag;
+
+		// GNU long names and PAX extended headers are members of their own, whose data describes
+		// the member that follows.  Their data is read through the scanner, so it usually comes
+		// out of the batch that the header was in.
+		if (type == TAR_TYPE_GNU_LONGNAME || type == TAR_TYPE_GNU_LONGLINK || type == TAR_TYPE_PAX_EXTENDED || type == TAR_TYPE_PAX_GLOBAL) {
+			if (size > TARFS_MAX_EXTENDED_HEADER) {
+				syslog.messagef(LogLevel::WARNING, "tarfs: oversized extended header at block %u, ignoring the rest of the archive", current_block);
+				break;
+			}
+
+			char *data = new char[size + 1];
+			if (!scanner.read(current_block + 1, size, data)) {
+				delete[] data;
+				break;
+			}
+			data[size] = 0;
+
+			bool valid = true;
+			if (type == TAR_TYPE_GNU_LONGNAME) {
+				next.set_path(data, strnlen(data, size));
+			} else if (type == TAR_TYPE_PAX_EXTENDED) {
+				valid = parse_pax_records(data, size, next);
+			} else if (type == TAR_TYPE_PAX_GLOBAL) {
+				valid = parse_pax_records(data, size, global);
+			}
+
+			delete[] data;
+
+			if (!valid) {
+				syslog.messagef(LogLevel::WARNING, "tarfs: malformed extended header at block %u, ignoring the rest of the archive", current_block);
+				break;
+			}
+
+			current_block += blocks_needed + 1;
+			continue;
+		}
+
+		// A PAX size replaces the one in the header, which can't hold every size.
+		if (next.has_size) {
+			size = next.size;
+			blocks_needed = (size + block_size - 1) / block_size;
+			if (blocks_needed >= nr_blocks - current_block) {
+				break;
+			}
+		}
+
+		if (type != TAR_TYPE_GNU_VOLUME) {
+			// Everything a file needs later is parsed now, so that opening and reading it never
+			// has to go back to the header.
+			TarFSMetadata metadata;
+			uint64_t mode = 0, mtime = 0;
+			tar_parse_number(header->mode, sizeof(header->mode), mode);
+			tar_parse_number(header->mtime, sizeof(header->mtime), mtime);
+
+			metadata.size = size;
+			metadata.mode = (unsigned int) mode;
+			metadata.mtime = next.has_mtime ? next.mtime : global.has_mtime ? global.mtime : mtime;
+			metadata.type = type;
+			metadata.data_block = current_block + 1;
+
+			// The path is, in order of preference, a long name from a preceding member, or the
+			// POSIX prefix and name fields joined together, or just the name field.  GNU archives
+			// use the prefix field for other things, so it only counts in POSIX ones.
+			if (next.path) {
+				add_entry(next.path, next.path_len, metadata);
+			} else if (header->prefix[0] && memcmp(header->magic, TAR_MAGIC_POSIX, sizeof(header->magic)) == 0) {
+				char path[sizeof(header->prefix) + 1 + sizeof(header->name)];
+				size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+				size_t name_len = strnlen(header->name, sizeof(header->name));
+
+				memcpy(path, header->prefix, prefix_len);
+				path[prefix_len] = '/';
+				memcpy(&path[prefix_len + 1], header->name, name_len);
+
+				add_entry(path, prefix_len + 1 + name_len, metadata);
+			} else {
+				add_entry(header->name, sizeof(header->name), metadata);
+			}
+		}
+
+		next.clear();
+
+		// Skip over the header block, and the data blocks of this entry.  Data that falls outside
+		// the current batch isn't read.
+		current_block += blocks_needed + 1;
+	}
+
+	sort_entries();
+
+	// Only the root node is created here.  The rest are created from the entry table as they are
+	// looked up, unless the whole tree has been asked for up front.
+	TarFSNode *root = new (_arena) TarFSNode(NULL, "", 0, 0, *this);
+	_nr_nodes++;
+
+#ifdef TARFS_EAGER_TREE
+	materialize_tree(root);
+#endif
+
+	_stats.mount_reads += scanner.nr_reads();
+	_stats.mount_blocks += scanner.bytes_read() / block_size;
+
+	syslog.messagef(LogLevel::DEBUG, "tarfs: mounted %u entries%s, read %lu blocks in %u device requests, %lu cycles",
+		_nr_entries, from_index ? " from index" : "", _stats.mount_blocks, _stats.mount_reads,
+		(uint64_t) (__builtin_ia32_rdtsc() - start_cycles));
+
 	return root;
 }
 
 /**
  * Returns the size of this TarFS File
  */
-unsigned int TarFSFile::size() const
+uint64_t TarFSFile::size() const
 {
-	return octal2ui(_hdr->size);
+	return _metadata.size;
 }
 
 /* --- YOU DO NOT NEED TO CHANGE ANYTHING BELOW THIS LINE --- */
 
+/**
+ * Constructs a TarFS over a block device.
+ * @param block_device The device holding the archive.
+ * @param owned_device A device to delete along with the file-system, if the archive's device
+ * was created for it.
+ */
+TarFS::TarFS(BlockDevice& block_device, BlockDevice *owned_device)
+: BlockBasedFilesystem(block_device),
+_root_node(NULL),
+_nr_nodes(0),
+_entries(NULL),
+_nr_entries(0),
+_max_entries(0),
+_paths(NULL),
+_paths_size(0),
+_paths_capacity(0),
+_max_path_len(0),
+_block_cache(block_device.block_size(), TARFS_CACHE_BLOCKS),
+_request_queue(block_device, TARFS_QUEUE_DEPTH, TARFS_QUEUE_BOUNCE_BLOCKS),
+_owned_device(owned_device)
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+TarFS::~TarFS()
+{
+	// The nodes' memory goes with the arena, but they still need to be destroyed.
+	if (_root_node) {
+		log_footprint();
+		dump_stats();
+		destroy_tree(_root_node);
+	}
+
+	delete[] _paths;
+	delete[] _entries;
+	delete _owned_device;
+}
+
 /**
  * Mounts a TARFS filesystem, by pre-building the file system tree in memory.
  * @return Returns the root node of the TARFS filesystem.
@@ -214,28 +1718,21 @@ PFSNode *TarFS::mount()
 }
 
 /**
- * Constructs a TarFS File object, given the owning file system and the block
+ * Constructs a TarFS File object, given the owning file system and the metadata of the
+ * node being opened, which the file shares rather than copies.
  */
-TarFSFile::TarFSFile(TarFS& owner, unsigned int file_header_block)
-: _hdr(NULL),
+TarFSFile::TarFSFile(TarFS& owner, const TarFSMetadata& metadata)
+: _metadata(metadata),
 _owner(owner),
-_file_start_block(file_header_block),
-_cur_pos(0)
+_file_start_block(metadata.data_block),
+_cur_pos(0),
+_ra_prev_end(0),
+_ra_window(0)
 {
-	// Allocate storage for the header.
-	_hdr = (struct posix_header *) new char[_owner.block_device().block_size()];
-
-	// Read the header block into the header structure.
-	_owner.block_device().read_blocks(_hdr, _file_start_block, 1);
-
-	// Increment the starting block for file data.
-	_file_start_block++;
 }
 
 TarFSFile::~TarFSFile()
 {
-	// Delete the header structure that was allocated in the constructor.
-	delete _hdr;
 }
 
 /**
@@ -289,13 +1786,35 @@ void TarFSFile::seek(off_t offset, SeekType type)
 	} else if (type == File::SeekRelative) {
 		_cur_pos += offset;
 	}
-	if (_cur_pos >= size()) {
+	if ((uint64_t) _cur_pos >= size()) {
 		_cur_pos = size() - 1;
 	}
 }
 
-TarFSNode::TarFSNode(TarFSNode *parent, const String& name, TarFS& owner) : PFSNode(parent, owner), _name(name), _size(0), _has_block_offset(false), _block_offset(0)
+TarFSNode::TarFSNode(TarFSNode *parent, const String& name, unsigned int path_entry, unsigned int path_len, TarFS& owner)
+: PFSNode(parent, owner),
+_name(owner.arena().copy_string(name.c_str(), name.length())),
+_has_metadata(false),
+_path_entry(path_entry),
+_path_len(path_len),
+_materialized(false),
+_first_child(NULL),
+_last_child(NULL),
+_next_sibling(NULL),
+_hash_next(NULL),
+_child_buckets(NULL),
+_nr_child_buckets(0),
+_nr_children(0)
 {
+	_name_hash = name.get_hash();
+
+	// Until an entry says otherwise, this is a directory that only exists because there are
+	// paths below it.
+	_metadata.size = 0;
+	_metadata.mode = 0755;
+	_metadata.mtime = 0;
+	_metadata.type = TAR_TYPE_DIRECTORY;
+	_metadata.data_block = 0;
 }
 
 TarFSNode::~TarFSNode()
@@ -308,13 +1827,13 @@ TarFSNode::~TarFSNode()
  */
 File* TarFSNode::open()
 {
-	// This is only a file if it has been associated with a block offset.
-	if (!_has_block_offset) {
+	// This is only a file if it has an entry in the archive.
+	if (!_has_metadata) {
 		return NULL;
 	}
 
-	// Create a new file object, with a header from this node's block offset.
-	return new TarFSFile((TarFS&) owner(), _block_offset);
+	// Create a new file object that shares this node's metadata.
+	return new TarFSFile((TarFS&) owner(), _metadata);
 }
 
 /**
@@ -323,7 +1842,14 @@ File* TarFSNode::open()
  */
 Directory* TarFSNode::opendir()
 {
-	return new TarFSDirectory(*this);
+	TarFS& fs = (TarFS&) owner();
+	{
+		UniqueLock<Mutex> l(fs.lock());
+		fs.stats().nr_opendirs++;
+	}
+
+	// The listing comes straight from the entry table, so no nodes are created for it.
+	return new TarFSDirectory(fs, *this);
 }
 
 /**
@@ -333,15 +1859,39 @@ Directory* TarFSNode::opendir()
  */
 PFSNode* TarFSNode::get_child(const String& name)
 {
-	TarFSNode *child;
+	// Try to find the given child node in the children table.  Children are only ever added,
+	// so a lookup racing with another that adds one can at worst miss.
+	TarFSNode *child = find_child(name, name.get_hash());
+	if (child) {
+		return child;
+	}
 
-	// Try to find the given child node in the children map, and return
-	// NULL if it wasn't found.
-	if (!_children.try_get_value(name.get_hash(), child)) {
-		return NULL;
+	// A miss may create the child, which changes the children table and the arena, so it
+	// happens under the mount's lock, and looks again in case the child was created meanwhile.
+	UniqueLock<Mutex> l(((TarFS&) owner()).lock());
+	return lookup_child(name);
+}
+
+/**
+ * Finds a child by name, creating its node from the entry table if it hasn't been looked up
+ * yet.  The caller must hold the mount's lock.
+ * @param name The name of the child.
+ * @return Returns the child node, or NULL if there is no child of that name.
+ */
+TarFSNode *TarFSNode::lookup_child(const String& name)
+{
+	TarFSNode *child = find_child(name, name.get_hash());
+	if (child) {
+		return child;
 	}
 
-	return child;
+	// Until every child has been created, a miss might just mean this child hasn't been
+	// looked up yet, so go and find it in the entry table.
+	if (!_materialized) {
+		return ((TarFS&) owner()).resolve_child(this, name);
+	}
+
+	return NULL;
 }
 
 /**
@@ -357,52 +1907,118 @@ PFSNode* TarFSNode::mkdir(const String& name)
 }
 
 /**
- * A helper routine that updates this node with the offset of the block
- * that contains the header of the file that this node represents.
- * @param offset The block offset that corresponds to this node.
+ * A helper routine that updates this node with the metadata parsed from
+ * the header of the file that this node represents.
+ * @param metadata The metadata that corresponds to this node.
  */
-void TarFSNode::set_block_offset(unsigned int offset)
+void TarFSNode::set_metadata(const TarFSMetadata& metadata)
 {
-	_has_block_offset = true;
-	_block_offset = offset;
+	_has_metadata = true;
+	_metadata = metadata;
 }
 
 /**
  * A helper routine that adds a child node to the internal children
- * map of this node.
- * @param name The name of the child node.
+ * table of this node.
  * @param child The actual child node.
  */
-void TarFSNode::add_child(const String& name, TarFSNode *child)
+void TarFSNode::add_child(TarFSNode *child)
+{
+	if (_nr_children >= _nr_child_buckets) {
+		grow_child_buckets();
+	}
+
+	TarFSNode **bucket = &_child_buckets[child->_name_hash & (_nr_child_buckets - 1)];
+	child->_hash_next = *bucket;
+	*bucket = child;
+
+	if (_last_child) {
+		_last_child->_next_sibling = child;
+	} else {
+		_first_child = child;
+	}
+	_last_child = child;
+
+	_nr_children++;
+}
+
+/**
+ * Looks a child up by name.  Names are only compared when the hashes match,
+ * so that most lookups compare a single name.
+ * @param name The name of the child.
+ * @param hash The hash of the name.
+ * @return Returns the child node, or NULL if there is no child of that name.
+ */
+TarFSNode *TarFSNode::find_child(const String& name, unsigned int hash) const
 {
-	_children.add(name.get_hash(), child);
+	if (!_nr_child_buckets) {
+		return NULL;
+	}
+
+	for (TarFSNode *child = _child_buckets[hash & (_nr_child_buckets - 1)]; child; child = child->_hash_next) {
+		if (child->_name_hash == hash && strcmp(child->_name, name.c_str()) == 0) {
+			return child;
+		}
+	}
+
+	return NULL;
 }
 
-TarFSDirectory::TarFSDirectory(TarFSNode& node) : _entries(NULL), _nr_entries(0), _cur_entry(0)
+/**
+ * Doubles the size of the children table, keeping it at one bucket per
+ * child or more.
+ */
+void TarFSNode::grow_child_buckets()
 {
-	_nr_entries = node.children().count();
-	_entries = new DirectoryEntry[_nr_entries];
+	unsigned int nr_buckets = _nr_child_buckets ? _nr_child_buckets * 2 : TARFS_CHILD_BUCKETS_INITIAL;
+
+	// The old table stays in the arena until unmount.  Tables only ever double, so that's
+	// never more than the final table's size.
+	_child_buckets = (TarFSNode **) ((TarFS&) owner()).arena().alloc(nr_buckets * sizeof(TarFSNode *));
+	_nr_child_buckets = nr_buckets;
+
+	for (unsigned int i = 0; i < nr_buckets; i++) {
+		_child_buckets[i] = NULL;
+	}
 
-	int i = 0;
-	for (const auto& child : node.children()) {
-		_entries[i].name = child.value->name();
-		_entries[i++].size = child.value->size();
+	for (TarFSNode *child = _first_child; child; child = child->_next_sibling) {
+		TarFSNode **bucket = &_child_buckets[child->_name_hash & (nr_buckets - 1)];
+		child->_hash_next = *bucket;
+		*bucket = child;
 	}
 }
 
+TarFSDirectory::TarFSDirectory(TarFS& fs, TarFSNode& node) : _fs(fs)
+{
+	_fs.begin_listing(&node, _listing);
+}
+
 TarFSDirectory::~TarFSDirectory()
 {
-	delete _entries;
+	_fs.end_listing(_listing);
 }
 
 bool TarFSDirectory::read_entry(infos::fs::DirectoryEntry& entry)
 {
-	if (_cur_entry < _nr_entries) {
-		entry = _entries[_cur_entry++];
-		return true;
-	} else {
-		return false;
+	return read_entries(&entry, 1) == 1;
+}
+
+/**
+ * Reads the next entries of the directory, straight from the mount's entry table, which
+ * doesn't change once the mount is built, so nothing is locked or created along the way.
+ * @param entries The entries to fill in.
+ * @param nr_entries The number of entries to read.
+ * @return Returns the number of entries read, which is less than asked for only at the end
+ * of the directory.
+ */
+unsigned int TarFSDirectory::read_entries(infos::fs::DirectoryEntry *entries, unsigned int nr_entries)
+{
+	unsigned int i = 0;
+	while (i < nr_entries && _fs.next_child(_listing, entries[i])) {
+		i++;
 	}
+
+	return i;
 }
 
 void TarFSDirectory::close()
@@ -413,7 +2029,20 @@ void TarFSDirectory::close()
 static Filesystem *tarfs_create(VirtualFilesystem& vfs, Device *dev)
 {
 	if (!dev->device_class().is(BlockDevice::BlockDeviceClass)) return NULL;
-	return new TarFS((BlockDevice &) * dev);
+
+	// A gzip-compressed image is read through a device that inflates it, which the mount owns.
+	BlockDevice& image = (BlockDevice &) *dev;
+	if (!TarFSGzipDevice::detect(image)) {
+		return new TarFS(image);
+	}
+
+	TarFSGzipDevice *gzip = new TarFSGzipDevice(image, TARFS_GZIP_CHECKPOINT_SPAN);
+	if (!gzip->build_index()) {
+		delete gzip;
+		return NULL;
+	}
+
+	return new TarFS(*gzip, gzip);
 }
 
 RegisterFilesystem(tarfs, tarfs_create);
@@ -0,0 +1,337 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * fs/tarfs.h
+ *
+ * InfOS
+ * Copyright (C) University of Edinburgh 2016.  All Rights Reserved.
+ *
+ * Tom Spink <tspink@inf.ed.ac.uk>
+ */
+#pragma once
+
+#include <infos/fs/filesystem.h>
+#include <infos/fs/file.h>
+#include <infos/fs/directory.h>
+#include <infos/drivers/block/block-device.h>
+#include <infos/util/map.h>
+#include <infos/util/string.h>
+#include <infos/util/lock.h>
+
+namespace tarfs
+{
+	class TarFS;
+
+	struct TarFSMetadata {
+		uint64_t size;
+		unsigned int mode;
+		uint64_t mtime;
+		char type;
+		unsigned int data_block;
+	};
+
+	struct TarFSExtent {
+		unsigned int device_block;
+		unsigned int nr_blocks;
+		unsigned int offset_in_block;
+		uint64_t length;
+	};
+
+	// Counts of the work done by a mount, and of the device requests each kind of operation made.
+	struct TarFSStats {
+		unsigned int mount_reads;
+		uint64_t mount_blocks;
+
+		uint64_t nr_preads, pread_bytes;
+		uint64_t direct_reads, direct_blocks;
+		uint64_t page_fills, page_fill_blocks;
+
+		uint64_t nr_opendirs;
+	};
+
+	struct TarFSEntry {
+		unsigned int path_offset;
+		TarFSMetadata metadata;
+	};
+
+	// A position in the listing of a directory's children, in the sorted entry table.  The key
+	// starts with the directory's path and a slash, and is scratch space after that.
+	struct TarFSListing {
+		char *key;
+		size_t prefix_len;
+		unsigned int next;
+	};
+
+	class TarFSBlockCache
+	{
+	public:
+		TarFSBlockCache(unsigned int block_size, unsigned int nr_entries);
+		~TarFSBlockCache();
+
+		const uint8_t *find_block(unsigned int block);
+		bool contains(unsigned int block) { return lookup(block) != NULL; }
+		void insert_blocks(unsigned int block, const uint8_t *data, unsigned int nr_blocks);
+
+		uint64_t nr_hits() const { return _nr_hits; }
+		uint64_t nr_misses() const { return _nr_misses; }
+		uint64_t blocks_filled() const { return _blocks_filled; }
+
+	private:
+		struct Entry {
+			unsigned int block;
+			bool valid;
+			Entry *hash_next;
+			Entry *lru_prev, *lru_next;
+			uint8_t *data;
+		};
+
+		Entry *lookup(unsigned int block);
+		void unlink_lru(Entry *entry);
+		void push_lru(Entry *entry);
+		void unlink_hash(Entry *entry);
+		Entry *insert(unsigned int block, const uint8_t *data);
+
+		unsigned int _block_size;
+		unsigned int _nr_entries;
+
+		Entry *_entries;
+		Entry **_buckets;
+		Entry *_lru_head, *_lru_tail;
+		uint8_t *_data;
+
+		uint64_t _nr_hits, _nr_misses, _blocks_filled;
+	};
+
+	// Reads are queued with a completion to call when their data arrives, and are only issued
+	// when the queue is flushed, so that reads of neighbouring blocks can share a device request.
+	class TarFSRequestQueue
+	{
+	public:
+		typedef void (*Completion)(void *context, const uint8_t *data, bool success);
+
+		TarFSRequestQueue(infos::drivers::block::BlockDevice& block_device, unsigned int depth, unsigned int bounce_blocks);
+		~TarFSRequestQueue();
+
+		void submit(unsigned int block, unsigned int nr_blocks, uint8_t *buffer, Completion complete, void *context);
+		void flush();
+
+		unsigned int bounce_blocks() const { return _bounce_blocks; }
+
+		uint64_t nr_submitted() const { return _nr_submitted; }
+		uint64_t nr_issued() const { return _nr_issued; }
+		uint64_t blocks_bounced() const { return _blocks_bounced; }
+
+	private:
+		struct Request {
+			unsigned int block, nr_blocks;
+			uint8_t *buffer;
+			Completion complete;
+			void *context;
+		};
+
+		void issue(unsigned int first, unsigned int end, unsigned int nr_blocks, bool direct);
+
+		infos::drivers::block::BlockDevice& _block_device;
+		unsigned int _block_size;
+		unsigned int _depth, _bounce_blocks;
+
+		Request *_pending;
+		unsigned int _nr_pending;
+		uint8_t *_bounce;
+
+		uint64_t _nr_submitted, _nr_issued, _blocks_bounced;
+	};
+
+	class TarFSArena
+	{
+	public:
+		TarFSArena();
+		~TarFSArena();
+
+		void *alloc(size_t size);
+		const char *copy_string(const char *str, size_t len);
+
+		size_t bytes_requested() const { return _bytes_requested; }
+		size_t bytes_reserved() const { return _bytes_reserved; }
+		unsigned int nr_allocs() const { return _nr_allocs; }
+		unsigned int nr_chunks() const { return _nr_chunks; }
+
+	private:
+		struct Chunk {
+			Chunk *next;
+			size_t size;
+		};
+
+		Chunk *_chunks;
+		uint8_t *_next, *_end;
+
+		size_t _bytes_requested, _bytes_reserved;
+		unsigned int _nr_allocs, _nr_chunks;
+	};
+
+	class TarFSNode : public infos::fs::PFSNode
+	{
+	public:
+		// Nodes live in their file-system's arena, and are only ever freed along with it.
+		static void *operator new(size_t size, TarFSArena& arena) { return arena.alloc(size); }
+		static void operator delete(void *ptr, TarFSArena& arena) { }
+		static void operator delete(void *ptr) { }
+
+		TarFSNode(TarFSNode *parent, const infos::util::String& name, unsigned int path_entry, unsigned int path_len, TarFS& owner);
+		virtual ~TarFSNode();
+
+		infos::fs::File* open() override;
+		infos::fs::Directory* opendir() override;
+
+		infos::fs::PFSNode* get_child(const infos::util::String& name) override;
+		infos::fs::PFSNode* mkdir(const infos::util::String& name) override;
+
+		TarFSNode *lookup_child(const infos::util::String& name);
+
+		void add_child(TarFSNode *child);
+		void set_metadata(const TarFSMetadata& metadata);
+
+		const char *name() const { return _name; }
+
+		uint64_t size() const { return _metadata.size; }
+		const TarFSMetadata& metadata() const { return _metadata; }
+
+		TarFSNode *first_child() const { return _first_child; }
+		TarFSNode *next_sibling() const { return _next_sibling; }
+		unsigned int nr_children() const { return _nr_children; }
+
+		unsigned int path_entry() const { return _path_entry; }
+		unsigned int path_len() const { return _path_len; }
+
+		bool materialized() const { return _materialized; }
+		void materialized(bool materialized) { _materialized = materialized; }
+
+	private:
+		TarFSNode *find_child(const infos::util::String& name, unsigned int hash) const;
+		void grow_child_buckets();
+
+		const char *_name;
+		unsigned int _name_hash;
+		bool _has_metadata;
+		TarFSMetadata _metadata;
+
+		// This node's path is the first _path_len characters of the path of entry _path_entry.
+		unsigned int _path_entry;
+		unsigned int _path_len;
+		bool _materialized;
+
+		// Children are kept on a list in the order they were added, for listing, and in a hash
+		// table keyed by name, for lookups.
+		TarFSNode *_first_child, *_last_child, *_next_sibling;
+		TarFSNode *_hash_next;
+		TarFSNode **_child_buckets;
+		unsigned int _nr_child_buckets, _nr_children;
+	};
+
+	class TarFS : public infos::fs::BlockBasedFilesystem
+	{
+	public:
+		TarFS(infos::drivers::block::BlockDevice& block_device, infos::drivers::block::BlockDevice *owned_device = NULL);
+		virtual ~TarFS();
+
+		infos::fs::PFSNode *mount() override;
+		const char *name() const override { return "tarfs"; }
+
+		TarFSBlockCache& block_cache() { return _block_cache; }
+		TarFSRequestQueue& request_queue() { return _request_queue; }
+		TarFSArena& arena() { return _arena; }
+		infos::util::Mutex& lock() { return _lock; }
+
+		TarFSStats& stats() { return _stats; }
+		void dump_stats() const;
+
+		TarFSNode *resolve_child(TarFSNode *parent, const infos::util::String& name);
+		void materialize_children(TarFSNode *parent);
+
+		void begin_listing(const TarFSNode *parent, TarFSListing& listing) const;
+		bool next_child(TarFSListing& listing, infos::fs::DirectoryEntry& entry) const;
+		void end_listing(TarFSListing& listing) const;
+
+	private:
+		TarFSNode *build_tree();
+		bool load_index(unsigned int nr_index_blocks);
+		void materialize_tree(TarFSNode *node);
+		void destroy_tree(TarFSNode *node);
+		void log_footprint() const;
+
+		void add_entry(const char *path, size_t max_len, const TarFSMetadata& metadata);
+		bool entry_before(const TarFSEntry& a, const TarFSEntry& b) const;
+		void sort_entries();
+		void sift_down(unsigned int root, unsigned int end);
+		unsigned int lower_bound(const char *key) const;
+
+		const char *entry_path(unsigned int idx) const { return &_paths[_entries[idx].path_offset]; }
+
+		TarFSNode *_root_node;
+
+		// Held by every operation on the mount after it is built, as they share the block cache,
+		// the request queue, the statistics, and the tree that nodes are added to on demand.
+		infos::util::Mutex _lock;
+
+		// Nodes, their names and their children tables, all freed together at unmount.
+		TarFSArena _arena;
+		unsigned int _nr_nodes;
+
+		TarFSStats _stats;
+
+		// Every entry in the archive, sorted by path, and the pool their paths are stored in.
+		TarFSEntry *_entries;
+		unsigned int _nr_entries, _max_entries;
+		char *_paths;
+		size_t _paths_size, _paths_capacity, _max_path_len;
+
+		TarFSBlockCache _block_cache;
+		TarFSRequestQueue _request_queue;
+
+		// A device stacked on the one the file-system was created on, such as a decompressor,
+		// which goes with the mount.
+		infos::drivers::block::BlockDevice *_owned_device;
+	};
+
+	class TarFSFile : public infos::fs::File
+	{
+	public:
+		TarFSFile(TarFS& owner, const TarFSMetadata& metadata);
+		virtual ~TarFSFile();
+
+		void close() override;
+		int read(void *buffer, size_t size) override;
+		int pread(void *buffer, size_t size, off_t off) override;
+		void seek(off_t offset, SeekType type) override;
+
+		uint64_t size() const;
+
+		bool extent(uint64_t offset, TarFSExtent& extent) const;
+		int64_t read_pages(uint64_t offset, void *pages, unsigned int nr_pages);
+
+	private:
+		const TarFSMetadata& _metadata;
+		TarFS& _owner;
+		unsigned int _file_start_block;
+		off_t _cur_pos;
+
+		// Read-ahead state: where the previous read ended, and the current window in blocks.
+		off_t _ra_prev_end;
+		unsigned int _ra_window;
+	};
+
+	class TarFSDirectory : public infos::fs::Directory
+	{
+	public:
+		TarFSDirectory(TarFS& fs, TarFSNode& node);
+		virtual ~TarFSDirectory();
+
+		bool read_entry(infos::fs::DirectoryEntry& entry) override;
+		unsigned int read_entries(infos::fs::DirectoryEntry *entries, unsigned int nr_entries);
+		void close() override;
+
+	private:
+		TarFS& _fs;
+		TarFSListing _listing;
+	};
+}